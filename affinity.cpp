@@ -0,0 +1,197 @@
+//
+// NUMA topology and thread affinity.
+//
+
+#include "affinity.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef PATH_TRACER_HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+using namespace rt;
+
+namespace {
+
+// cpus the process may run on, every cpu if that cannot be asked
+std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        for (int cpu = 0; cpu < (int)std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// a cpulist such as "0-3,8-11"
+std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// node number to its cpus, empty if the kernel has no node directory
+std::vector<std::vector<int>> sysfsNodes() {
+    std::vector<std::vector<int>> nodes;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir) {
+        return nodes;
+    }
+    while (dirent *entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "node", 4) != 0 || !std::isdigit((unsigned char)entry->d_name[4])) {
+            continue;
+        }
+        int node = std::atoi(entry->d_name + 4);
+        std::ifstream in(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+        std::string list;
+        std::getline(in, list);
+        if ((int)nodes.size() <= node) {
+            nodes.resize(node + 1);
+        }
+        nodes[node] = parseCpuList(list);
+    }
+    closedir(dir);
+    return nodes;
+}
+
+NumaTopology detect() {
+    NumaTopology topology;
+    topology.cpus = allowedCpus();
+
+    std::vector<std::vector<int>> nodes;
+#ifdef PATH_TRACER_HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        topology.fromLibnuma = true;
+        bitmask *mask = numa_allocate_cpumask();
+        for (int node = 0; node <= numa_max_node(); node++) {
+            nodes.emplace_back();
+            if (numa_node_to_cpus(node, mask) == 0) {
+                for (unsigned cpu = 0; cpu < mask->size; cpu++) {
+                    if (numa_bitmask_isbitset(mask, cpu)) {
+                        nodes.back().push_back(cpu);
+                    }
+                }
+            }
+        }
+        numa_free_cpumask(mask);
+    }
+#endif
+    if (nodes.empty()) {
+        nodes = sysfsNodes();
+    }
+
+    for (auto &node : nodes) {
+        node.erase(std::remove_if(node.begin(), node.end(), [&](int cpu) {
+            return !std::binary_search(topology.cpus.begin(), topology.cpus.end(), cpu);
+        }), node.end());
+        if (!node.empty()) {
+            topology.nodeCpus.push_back(node);
+        }
+    }
+    if (topology.nodeCpus.empty()) {
+        topology.nodeCpus.push_back(topology.cpus);
+    }
+    return topology;
+}
+
+}
+
+const NumaTopology &NumaTopology::get() {
+    static const NumaTopology topology = detect();
+    return topology;
+}
+
+int NumaTopology::nodeOfThread(int tid, int threadCount) const {
+    return (long long)tid * nodeCount() / std::max(1, threadCount);
+}
+
+int NumaTopology::cpuOfThread(int tid, int threadCount) const {
+    int node = nodeOfThread(tid, threadCount);
+    // the first tid of the node's block
+    int first = ((long long)node * threadCount + nodeCount() - 1) / nodeCount();
+    const std::vector<int> &cpus = nodeCpus[node];
+    return cpus[(tid - first) % cpus.size()];
+}
+
+bool rt::pinThread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0) {
+        CPU_SET(cpu, &set);
+    } else {
+        for (int c : NumaTopology::get().cpus) {
+            CPU_SET(c, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+NodeLocalBuffer::NodeLocalBuffer(size_t count) : count(count) {
+    size_t bytes = std::max<size_t>(1, count) * sizeof(float);
+#ifdef PATH_TRACER_HAVE_LIBNUMA
+    if (NumaTopology::get().fromLibnuma) {
+        values = (float *)numa_alloc_local(bytes);
+    } else {
+        values = (float *)std::malloc(bytes);
+    }
+#else
+    values = (float *)std::malloc(bytes);
+#endif
+    if (!values) {
+        throw std::bad_alloc();
+    }
+    // without libnuma the pages land on the node of the thread touching them first
+    std::memset(values, 0, bytes);
+}
+
+NodeLocalBuffer::~NodeLocalBuffer() {
+#ifdef PATH_TRACER_HAVE_LIBNUMA
+    if (NumaTopology::get().fromLibnuma) {
+        numa_free(values, std::max<size_t>(1, count) * sizeof(float));
+        return;
+    }
+#endif
+    std::free(values);
+}
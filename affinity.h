@@ -0,0 +1,53 @@
+//
+// NUMA topology, thread pinning and node-local buffers. Uses libnuma when
+// the build found it (PATH_TRACER_HAVE_LIBNUMA), else sysfs and first touch.
+//
+
+#ifndef PATH_TRACER_AFFINITY_H
+#define PATH_TRACER_AFFINITY_H
+
+#include <cstddef>
+#include <vector>
+
+namespace rt {
+
+struct NumaTopology {
+    std::vector<std::vector<int>> nodeCpus; // the cpus of each node that has any
+    std::vector<int> cpus; // every cpu the process may run on
+    bool fromLibnuma = false;
+
+    // detected once; a machine without NUMA is one node of every cpu
+    static const NumaTopology &get();
+
+    int nodeCount() const { return nodeCpus.size(); }
+    // contiguous blocks of render threads share a node, like the contiguous
+    // runs of tiles the TileScheduler deals them
+    int nodeOfThread(int tid, int threadCount) const;
+    int cpuOfThread(int tid, int threadCount) const;
+};
+
+// pins the calling thread to cpu, or lets it run on every cpu again if cpu
+// is negative. Returns false if the system refused.
+bool pinThread(int cpu);
+
+// zeroed floats on the node of the calling thread
+class NodeLocalBuffer {
+public:
+    explicit NodeLocalBuffer(size_t count);
+    ~NodeLocalBuffer();
+
+    NodeLocalBuffer(const NodeLocalBuffer &) = delete;
+    NodeLocalBuffer &operator=(const NodeLocalBuffer &) = delete;
+
+    float *data() { return values; }
+    size_t size() const { return count; }
+    float &operator[](size_t i) { return values[i]; }
+
+private:
+    float *values;
+    size_t count;
+};
+
+}
+
+#endif //PATH_TRACER_AFFINITY_H
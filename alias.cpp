@@ -0,0 +1,64 @@
+//
+// Alias table.
+//
+
+#include "alias.h"
+
+#include <algorithm>
+
+using namespace rt;
+
+void AliasTable::build(const std::vector<double> &weights) {
+    bins.clear();
+    probabilities.clear();
+    double total = 0;
+    for (double w : weights) {
+        total += std::max(0.0, w);
+    }
+    if (weights.empty() || total <= 0) {
+        return;
+    }
+
+    int n = weights.size();
+    probabilities.resize(n);
+    bins.resize(n);
+    std::vector<double> scaled(n);
+    std::vector<int> small;
+    std::vector<int> large;
+    for (int i = 0; i < n; i++) {
+        probabilities[i] = std::max(0.0, weights[i]) / total;
+        scaled[i] = probabilities[i] * n;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        bins[s] = Bin{scaled[s], l};
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // what is left is 1 up to rounding
+    for (int i : small) {
+        bins[i] = Bin{1, i};
+    }
+    for (int i : large) {
+        bins[i] = Bin{1, i};
+    }
+}
+
+int AliasTable::sample(double u, double &pmf) const {
+    if (bins.empty()) {
+        pmf = 0;
+        return -1;
+    }
+    double x = u * bins.size();
+    int i = std::min((int)x, (int)bins.size() - 1);
+    const Bin &bin = bins[i];
+    int picked = x - i < bin.threshold ? i : bin.alias;
+    pmf = probabilities[picked];
+    return picked;
+}
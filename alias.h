@@ -0,0 +1,36 @@
+//
+// Alias table (Vose's method) for O(1) sampling of a discrete distribution.
+//
+
+#ifndef PATH_TRACER_ALIAS_H
+#define PATH_TRACER_ALIAS_H
+
+#include <vector>
+
+namespace rt {
+
+class AliasTable {
+public:
+    // weights need not be normalized, a table of zero total weight is empty
+    void build(const std::vector<double> &weights);
+
+    // returns the picked index and its probability, or -1 if empty
+    int sample(double u, double &pmf) const;
+    double pmf(int i) const { return probabilities[i]; }
+
+    bool empty() const { return bins.empty(); }
+    int size() const { return bins.size(); }
+
+private:
+    struct Bin {
+        double threshold; // keep the bin's own index below this
+        int alias;
+    };
+
+    std::vector<Bin> bins;
+    std::vector<double> probabilities;
+};
+
+}
+
+#endif //PATH_TRACER_ALIAS_H
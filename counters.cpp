@@ -0,0 +1,55 @@
+//
+// Hardware event counters.
+//
+
+#include "counters.h"
+
+#include <cstring>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace rt;
+
+CacheMissCounter::CacheMissCounter() {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+CacheMissCounter::~CacheMissCounter() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void CacheMissCounter::start() {
+#ifdef __linux__
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+long long CacheMissCounter::stop() {
+#ifdef __linux__
+    long long count;
+    if (fd >= 0 && ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) == 0 && read(fd, &count, sizeof(count)) == sizeof(count)) {
+        return count;
+    }
+#endif
+    return -1;
+}
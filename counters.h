@@ -0,0 +1,31 @@
+//
+// Hardware event counters of the calling thread, through perf_event_open on
+// Linux. Elsewhere, or where the kernel or a VM refuses, they are unavailable.
+//
+
+#ifndef PATH_TRACER_COUNTERS_H
+#define PATH_TRACER_COUNTERS_H
+
+namespace rt {
+
+// last level cache misses of the thread that made it, in user space
+class CacheMissCounter {
+public:
+    CacheMissCounter();
+    ~CacheMissCounter();
+
+    CacheMissCounter(const CacheMissCounter &) = delete;
+    CacheMissCounter &operator=(const CacheMissCounter &) = delete;
+
+    bool available() const { return fd >= 0; }
+    void start();
+    // misses since start, or -1 if unavailable
+    long long stop();
+
+private:
+    int fd = -1;
+};
+
+}
+
+#endif //PATH_TRACER_COUNTERS_H
@@ -0,0 +1,125 @@
+//
+// Edge-avoiding a-trous wavelet denoiser.
+//
+
+#include "denoise.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+
+using namespace rt;
+
+namespace {
+
+const float KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+float squaredDistance(const float *a, const float *b) {
+    float d0 = a[0] - b[0];
+    float d1 = a[1] - b[1];
+    float d2 = a[2] - b[2];
+    return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+// one a-trous iteration with the given step over the tiles handed out by next
+void filterTiles(const std::vector<float> &src, std::vector<float> &dst, const FeatureBuffers &f,
+                 int step, float sigmaColor, const DenoiseOptions &opt, std::atomic<int> &next) {
+    int tilesX = (f.width + opt.tileSize - 1) / opt.tileSize;
+    int tilesY = (f.height + opt.tileSize - 1) / opt.tileSize;
+    float invColor = 1 / (sigmaColor * sigmaColor);
+    float invNormal = 1 / (opt.sigmaNormal * opt.sigmaNormal);
+    float invDepth = 1 / (opt.sigmaDepth * opt.sigmaDepth);
+    float invAlbedo = 1 / (opt.sigmaAlbedo * opt.sigmaAlbedo);
+
+    for (int tile = next++; tile < tilesX * tilesY; tile = next++) {
+        int r0 = tile / tilesX * opt.tileSize;
+        int c0 = tile % tilesX * opt.tileSize;
+        int r1 = std::min(r0 + opt.tileSize, f.height);
+        int c1 = std::min(c0 + opt.tileSize, f.width);
+
+        for (int r = r0; r < r1; r++) {
+            for (int c = c0; c < c1; c++) {
+                int p = r * f.width + c;
+                float sum[3] = {0, 0, 0};
+                float weightSum = 0;
+                for (int dy = -2; dy <= 2; dy++) {
+                    int rr = r + dy * step;
+                    if (rr < 0 || rr >= f.height) {
+                        continue;
+                    }
+                    for (int dx = -2; dx <= 2; dx++) {
+                        int cc = c + dx * step;
+                        if (cc < 0 || cc >= f.width) {
+                            continue;
+                        }
+                        int q = rr * f.width + cc;
+                        float dz = f.depth[p] - f.depth[q];
+                        float w = KERNEL[dx + 2] * KERNEL[dy + 2]
+                                * std::exp(-squaredDistance(&src[p * 3], &src[q * 3]) * invColor
+                                           - squaredDistance(&f.normal[p * 3], &f.normal[q * 3]) * invNormal
+                                           - dz * dz * invDepth
+                                           - squaredDistance(&f.albedo[p * 3], &f.albedo[q * 3]) * invAlbedo);
+                        sum[0] += src[q * 3 + 0] * w;
+                        sum[1] += src[q * 3 + 1] * w;
+                        sum[2] += src[q * 3 + 2] * w;
+                        weightSum += w;
+                    }
+                }
+                for (int i = 0; i < 3; i++) {
+                    dst[p * 3 + i] = sum[i] / weightSum;
+                }
+            }
+        }
+    }
+}
+
+}
+
+void rt::denoise(const Film &in, const FeatureBuffers &features, Film &out, const DenoiseOptions &options,
+                 DenoiseStats *stats) {
+    auto start = std::chrono::steady_clock::now();
+    int pixelCount = in.width * in.height;
+
+    // filter the illumination with the albedo divided out, so texture and
+    // color edges survive
+    std::vector<float> a(pixelCount * 3);
+    std::vector<float> b(pixelCount * 3);
+    for (int p = 0; p < pixelCount; p++) {
+        Vector3d color = in.radianceAt(p / in.width, p % in.width);
+        for (int i = 0; i < 3; i++) {
+            a[p * 3 + i] = color[i] / std::max(features.albedo[p * 3 + i], 1e-3f);
+        }
+    }
+
+    // started once for all iterations when no pool is given
+    std::unique_ptr<ThreadPool> localPool;
+    ThreadPool *pool = options.pool;
+    if (!pool) {
+        localPool.reset(new ThreadPool(options.threadCount));
+        pool = localPool.get();
+    }
+
+    float sigmaColor = options.sigmaColor;
+    for (int it = 0; it < options.iterations; it++) {
+        std::atomic<int> next(0);
+        pool->run(std::max(1, options.threadCount), [&](int) {
+            filterTiles(a, b, features, 1 << it, sigmaColor, options, next);
+        });
+        std::swap(a, b);
+        sigmaColor /= 2;
+    }
+
+    out = Film(in.width, in.height);
+    for (int p = 0; p < pixelCount; p++) {
+        Vector3d color;
+        for (int i = 0; i < 3; i++) {
+            color[i] = a[p * 3 + i] * std::max(features.albedo[p * 3 + i], 1e-3f);
+        }
+        out.add(p / in.width, p % in.width, color, 1);
+    }
+
+    if (stats) {
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+}
@@ -0,0 +1,34 @@
+//
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010) guided by
+// first-hit feature buffers.
+//
+
+#ifndef PATH_TRACER_DENOISE_H
+#define PATH_TRACER_DENOISE_H
+
+#include "rt.h"
+
+namespace rt {
+
+struct DenoiseOptions {
+    int iterations = 5; // the filter footprint doubles every iteration
+    double sigmaColor = 2; // halved every iteration
+    double sigmaNormal = 0.3;
+    double sigmaDepth = 0.5;
+    double sigmaAlbedo = 0.1;
+    int threadCount = 8;
+    int tileSize = 32;
+    ThreadPool *pool = nullptr; // runs the threadCount filter tasks, else threads of its own
+};
+
+struct DenoiseStats {
+    double seconds = 0;
+};
+
+// filters the radiance in in into out, which is resized to match
+void denoise(const Film &in, const FeatureBuffers &features, Film &out, const DenoiseOptions &options,
+             DenoiseStats *stats = nullptr);
+
+}
+
+#endif //PATH_TRACER_DENOISE_H
@@ -0,0 +1,532 @@
+//
+// Distributed rendering.
+//
+
+#include "distributed.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace rt;
+
+namespace {
+
+const uint32_t MAGIC = 0x50545731; // "PTW1"
+
+enum MessageType : uint32_t {
+    Hello = 1, // worker: the image size as r1, c1 and its samplesPerPixel
+    Chunk, // coordinator: render this
+    Done, // coordinator: nothing left
+    Result // worker: the chunk's r, g, b, weight floats follow
+};
+
+struct Message {
+    uint32_t magic = MAGIC;
+    uint32_t type;
+    int32_t r0 = 0;
+    int32_t c0 = 0;
+    int32_t r1 = 0;
+    int32_t c1 = 0;
+    int32_t samples = 0;
+    int64_t rays = 0;
+};
+
+bool sendAll(int fd, const void *data, size_t size) {
+    const char *p = (const char *)data;
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+    char *p = (char *)data;
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool receiveMessage(int fd, Message &m) {
+    return receiveAll(fd, &m, sizeof(m)) && m.magic == MAGIC;
+}
+
+bool sendMessage(int fd, uint32_t type, const ImageTile &tile = ImageTile{0, 0, 0, 0}) {
+    Message m;
+    m.type = type;
+    m.r0 = tile.r0;
+    m.c0 = tile.c0;
+    m.r1 = tile.r1;
+    m.c1 = tile.c1;
+    return sendAll(fd, &m, sizeof(m));
+}
+
+// a listening or connected socket for address, -1 with err set on failure
+int openSocket(const std::string &address, bool listening, std::string &err) {
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        std::string path = address.substr(5);
+        if (path.size() >= sizeof(addr.sun_path)) {
+            err = "socket path too long: " + path;
+            return -1;
+        }
+        std::strcpy(addr.sun_path, path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listening) {
+            unlink(path.c_str());
+        }
+        if (fd < 0 || (listening ? bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0
+                                 : connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)) {
+            err = std::string("cannot ") + (listening ? "listen on " : "connect to ") + address + ": "
+                    + std::strerror(errno);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        return fd;
+    }
+
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        err = "address is neither unix:<path> nor <host>:<port>: " + address;
+        return -1;
+    }
+    std::string host = address.substr(0, colon);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo *found = nullptr;
+    int status = getaddrinfo(host.empty() || host == "*" ? nullptr : host.c_str(), address.c_str() + colon + 1,
+                             &hints, &found);
+    if (status != 0) {
+        err = "cannot resolve " + address + ": " + gai_strerror(status);
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo *a = found; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (listening ? bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, 64) != 0
+                      : connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (fd < 0) {
+        err = std::string("cannot ") + (listening ? "listen on " : "connect to ") + address + ": "
+                + std::strerror(errno);
+    }
+    return fd;
+}
+
+double secondsBetween(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+    return std::chrono::duration<double>(b - a).count();
+}
+
+// a worker that stops halfway through a message for this long is lost
+const int stallSeconds = 2;
+
+// a connected worker and the chunk it is rendering, -1 if none, which stays
+// its chunk until it sends it back even when another worker's copy is merged
+// first, so a worker never has more than one chunk; since is when it
+// connected until it says hello
+struct Peer {
+    int fd;
+    int chunk = -1;
+    std::chrono::steady_clock::time_point since;
+    bool greeted = false;
+};
+
+}
+
+bool rt::coordinate(const std::string &address, Film &film, int chunkSize, double timeout,
+                    CoordinatorStats *statsOut, std::string &err) {
+    CoordinatorStats localStats;
+    CoordinatorStats &stats = statsOut ? *statsOut : localStats;
+    stats = CoordinatorStats();
+    auto start = std::chrono::steady_clock::now();
+
+    int listener = openSocket(address, true, err);
+    if (listener < 0) {
+        return false;
+    }
+
+    chunkSize = std::max(1, chunkSize);
+    std::vector<ImageTile> chunks;
+    for (int r = 0; r < film.height; r += chunkSize) {
+        for (int c = 0; c < film.width; c += chunkSize) {
+            chunks.push_back({r, c, std::min(film.height, r + chunkSize), std::min(film.width, c + chunkSize)});
+        }
+    }
+    stats.chunks = chunks.size();
+    std::deque<int> pending;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        pending.push_back(i);
+    }
+    std::vector<bool> merged(chunks.size(), false);
+    int remaining = chunks.size();
+    std::vector<Peer> peers;
+    std::vector<float> buffer;
+
+    // the next chunk for a worker: a pending one, else the one out longest
+    // past the timeout, unless the worker is the one rendering it
+    auto assign = [&](Peer &peer) {
+        auto now = std::chrono::steady_clock::now();
+        int chunk = -1;
+        if (!pending.empty()) {
+            chunk = pending.front();
+            pending.pop_front();
+        } else {
+            double longest = timeout;
+            for (const Peer &other : peers) {
+                double out = secondsBetween(other.since, now);
+                if (other.chunk >= 0 && !merged[other.chunk] && &other != &peer && out > longest) {
+                    longest = out;
+                    chunk = other.chunk;
+                }
+            }
+            if (chunk >= 0) {
+                stats.reissued++;
+            }
+        }
+        if (chunk < 0) {
+            peer.chunk = -1;
+            return true;
+        }
+        peer.chunk = chunk;
+        peer.since = now;
+        return sendMessage(peer.fd, Chunk, chunks[chunk]);
+    };
+    auto drop = [&](size_t i) {
+        int chunk = peers[i].greeted ? peers[i].chunk : -1;
+        if (chunk >= 0 && !merged[chunk]) {
+            stats.workersLost++;
+            if (std::find(pending.begin(), pending.end(), chunk) == pending.end()) {
+                pending.push_front(chunk);
+                stats.reissued++;
+            }
+        }
+        close(peers[i].fd);
+        peers.erase(peers.begin() + i);
+    };
+
+    while (remaining > 0) {
+        std::vector<pollfd> fds(1, pollfd{listener, POLLIN, 0});
+        for (const Peer &peer : peers) {
+            fds.push_back(pollfd{peer.fd, POLLIN, 0});
+        }
+        poll(fds.data(), fds.size(), 100);
+
+        // reads only start once poll says a message is arriving, and give up
+        // on a worker that then stalls
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                timeval stall = {stallSeconds, 0};
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+                peers.push_back(Peer{fd, -1, std::chrono::steady_clock::now()});
+            }
+        }
+
+        // peers after the ones polled were accepted just now
+        for (size_t i = fds.size() - 1; i >= 1; i--) {
+            if (i > peers.size() || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            Peer &peer = peers[i - 1];
+            Message m;
+            if (!peer.greeted) {
+                // not a worker, or one rendering another image size, is let go
+                if (receiveMessage(peer.fd, m) && m.type == Hello && m.r1 == film.height && m.c1 == film.width) {
+                    stats.workers++;
+                    peer.greeted = true;
+                    if (assign(peer)) {
+                        continue;
+                    }
+                }
+                drop(i - 1);
+                continue;
+            }
+            bool ok = receiveMessage(peer.fd, m) && m.type == Result;
+            ImageTile tile = {m.r0, m.c0, m.r1, m.c1};
+            ok = ok && tile.r0 >= 0 && tile.c0 >= 0 && tile.r1 <= film.height && tile.c1 <= film.width
+                    && tile.r0 < tile.r1 && tile.c0 < tile.c1;
+            if (ok) {
+                buffer.resize((size_t)(tile.r1 - tile.r0) * (tile.c1 - tile.c0) * 4);
+                ok = receiveAll(peer.fd, buffer.data(), buffer.size() * sizeof(float));
+            }
+            if (!ok) {
+                drop(i - 1);
+                continue;
+            }
+            auto chunk = std::find_if(chunks.begin(), chunks.end(), [&](const ImageTile &c) {
+                return c.r0 == tile.r0 && c.c0 == tile.c0 && c.r1 == tile.r1 && c.c1 == tile.c1;
+            }) - chunks.begin();
+            // a chunk handed out twice is merged from whichever copy comes first
+            if (chunk < (long)chunks.size() && !merged[chunk]) {
+                merged[chunk] = true;
+                remaining--;
+                stats.raysTraced += m.rays;
+                const float *px = buffer.data();
+                for (int r = tile.r0; r < tile.r1; r++) {
+                    for (int c = tile.c0; c < tile.c1; c++, px += 4) {
+                        std::copy(px, px + 4, &film.data[(r * film.width + c) * 4]);
+                    }
+                }
+            }
+            if (!assign(peer)) {
+                drop(i - 1);
+            }
+        }
+
+        // idle workers take over chunks that have been out too long, and
+        // connections that never say hello are closed
+        for (size_t i = peers.size(); i-- > 0;) {
+            if (!peers[i].greeted) {
+                if (secondsBetween(peers[i].since, std::chrono::steady_clock::now()) > timeout) {
+                    drop(i);
+                }
+            } else if (peers[i].chunk < 0) {
+                if (!assign(peers[i])) {
+                    drop(i);
+                }
+            }
+        }
+    }
+
+    for (const Peer &peer : peers) {
+        if (peer.greeted) {
+            sendMessage(peer.fd, Done);
+        }
+        close(peer.fd);
+    }
+    close(listener);
+    if (address.compare(0, 5, "unix:") == 0) {
+        unlink(address.c_str() + 5);
+    }
+    stats.seconds = secondsBetween(start, std::chrono::steady_clock::now());
+    return true;
+}
+
+bool rt::work(const std::string &address, Renderer &renderer, Scene &scene, RenderOptions &options,
+              std::string &err, double connectSeconds, int failAfter) {
+    auto start = std::chrono::steady_clock::now();
+    int fd;
+    while ((fd = openSocket(address, false, err)) < 0) {
+        if (secondsBetween(start, std::chrono::steady_clock::now()) > connectSeconds) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    Message hello;
+    hello.type = Hello;
+    hello.r1 = options.verticalResolution;
+    hello.c1 = options.horizontalResolution;
+    hello.samples = options.samplesPerPixel;
+    if (!sendAll(fd, &hello, sizeof(hello))) {
+        err = "coordinator went away";
+        close(fd);
+        return false;
+    }
+
+    // the scene's photon map, irradiance cache and path guide are built once
+    // and serve every chunk
+    Image image(options.horizontalResolution, options.verticalResolution);
+    Film film(options.horizontalResolution, options.verticalResolution);
+    std::vector<float> buffer;
+    int rendered = 0;
+    bool finished = false;
+    Message chunk;
+    auto next = [&](ImageTile &tile) {
+        if (!receiveMessage(fd, chunk)) {
+            err = "coordinator went away";
+            return false;
+        }
+        if (chunk.type == Done) {
+            finished = true;
+            return false;
+        }
+        if (failAfter >= 0 && rendered == failAfter) {
+            std::_Exit(1);
+        }
+        tile = ImageTile{chunk.r0, chunk.c0, chunk.r1, chunk.c1};
+        if (chunk.type != Chunk || tile.r0 < 0 || tile.c0 < 0 || tile.r1 > film.height || tile.c1 > film.width
+                || tile.r0 >= tile.r1 || tile.c0 >= tile.c1) {
+            err = "bad chunk from the coordinator";
+            return false;
+        }
+        return true;
+    };
+    auto send = [&](const ImageTile &tile, const RenderStats &stats) {
+        buffer.clear();
+        for (int r = tile.r0; r < tile.r1; r++) {
+            const float *px = &film.data[(r * film.width + tile.c0) * 4];
+            buffer.insert(buffer.end(), px, px + (tile.c1 - tile.c0) * 4);
+        }
+        Message result = chunk;
+        result.type = Result;
+        result.rays = stats.raysTraced;
+        if (!sendAll(fd, &result, sizeof(result)) || !sendAll(fd, buffer.data(), buffer.size() * sizeof(float))) {
+            err = "coordinator went away";
+            return false;
+        }
+        rendered++;
+        return true;
+    };
+
+    RenderContext ctx;
+    ctx.scene = &scene;
+    ctx.options = &options;
+    ctx.image = &image;
+    ctx.film = &film;
+    renderer.renderRegions(ctx, next, send);
+    close(fd);
+    return finished;
+}
+
+bool rt::checkCoordinator(std::string &err) {
+    // five chunks of one pixel, handed out again after a second
+    std::string address = "unix:/tmp/path-tracer-check-" + std::to_string(getpid()) + ".sock";
+    const double timeout = 1;
+    pid_t coordinator = fork();
+    if (coordinator == 0) {
+        Film film(5, 1);
+        std::string childErr;
+        std::_Exit(coordinate(address, film, 1, timeout, nullptr, childErr) ? 0 : 1);
+    }
+    if (coordinator < 0) {
+        err = std::string("cannot fork: ") + std::strerror(errno);
+        return false;
+    }
+
+    std::vector<int> fds;
+    auto connectWorker = [&]() {
+        int fd = -1;
+        for (int tries = 0; tries < 50 && (fd = openSocket(address, false, err)) < 0; tries++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (fd >= 0) {
+            timeval wait = {5, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+            fds.push_back(fd);
+            Message hello;
+            hello.type = Hello;
+            hello.r1 = 1;
+            hello.c1 = 5;
+            sendAll(fd, &hello, sizeof(hello));
+        }
+        return fd;
+    };
+    // the column of the chunk handed to fd, -1 for Done or nothing
+    auto next = [](int fd) {
+        Message m;
+        return receiveMessage(fd, m) && m.type == Chunk ? m.c0 : -1;
+    };
+    auto result = [](int fd, int c) {
+        Message m;
+        m.type = Result;
+        m.c0 = c;
+        m.r1 = 1;
+        m.c1 = c + 1;
+        float px[4] = {1, 1, 1, 1};
+        sendAll(fd, &m, sizeof(m));
+        sendAll(fd, px, sizeof(px));
+    };
+    auto pause = []() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    };
+
+    // a takes its chunk and stalls until b has been given it too and sent it
+    // back; then c goes away with its chunk while a is still rendering, a
+    // sends its stale copy and is killed, and b must be left to render c's
+    bool ok = true;
+    int b = connectWorker();
+    ok = ok && b >= 0 && next(b) == 0;
+    int a = connectWorker();
+    ok = ok && a >= 0 && next(a) == 1;
+    std::this_thread::sleep_for(std::chrono::duration<double>(timeout + 0.2));
+    int c = connectWorker();
+    ok = ok && c >= 0 && next(c) == 2;
+    // once the others are done b is given a's chunk
+    for (int chunk : {0, 3, 4}) {
+        result(b, chunk);
+        ok = ok && next(b) == (chunk == 0 ? 3 : chunk == 3 ? 4 : 1);
+    }
+    if (!ok) {
+        err = "the chunks were not handed out as scripted";
+    } else {
+        result(b, 1);
+        pause();
+        close(c);
+        pause();
+        result(a, 1);
+        pause();
+        close(a);
+        ok = next(b) == 2;
+        if (ok) {
+            result(b, 2);
+            Message done;
+            ok = receiveMessage(b, done) && done.type == Done;
+        }
+        if (!ok) {
+            err = "a chunk was lost with the killed worker";
+        }
+    }
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    int status = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (waitpid(coordinator, &status, WNOHANG) == 0) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            kill(coordinator, SIGKILL);
+            waitpid(coordinator, &status, 0);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    if (ok && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        err = "the coordinator did not finish";
+        ok = false;
+    }
+    return ok;
+}
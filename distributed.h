@@ -0,0 +1,55 @@
+//
+// Distributed rendering: a coordinator hands out chunks of the image to
+// worker processes over Unix or TCP sockets and merges the float buffers
+// they send back. Workers load the same scene and options themselves.
+//
+
+#ifndef PATH_TRACER_DISTRIBUTED_H
+#define PATH_TRACER_DISTRIBUTED_H
+
+#include <string>
+
+#include "rt.h"
+
+namespace rt {
+
+// Addresses are "unix:<path>" or "<host>:<port>" for TCP. Messages are
+// sent in host byte order, so all machines must share it.
+
+struct CoordinatorStats {
+    int chunks = 0;
+    int reissued = 0; // chunks handed out again after a loss or timeout
+    int workers = 0; // that said hello
+    int workersLost = 0; // that went away holding a chunk
+    long long raysTraced = 0;
+    double seconds = 0;
+};
+
+// Splits the film into chunks of chunkSize pixels square and hands them out
+// one at a time to the workers connecting to address until every chunk is
+// merged into film. A worker gets its next chunk only once it has sent back
+// its current one. The chunk of a worker that disconnects, or stalls in
+// the middle of a message, is handed out again, as is a chunk out for more
+// than timeout seconds once no other is left. Connections that do not say
+// hello within timeout are closed. Returns false if address cannot be
+// listened on.
+bool coordinate(const std::string &address, Film &film, int chunkSize, double timeout, CoordinatorStats *stats,
+                std::string &err);
+
+// Connects to the coordinator at address, retrying for connectSeconds, and
+// renders the chunks it hands out with renderer until it says it is done.
+// The photon map, irradiance cache and path guide are built once for all.
+// A worker with failAfter >= 0 exits abruptly after that many chunks, for
+// testing that the coordinator recovers.
+bool work(const std::string &address, Renderer &renderer, Scene &scene, RenderOptions &options,
+          std::string &err, double connectSeconds = 10, int failAfter = -1);
+
+// Runs a coordinator against scripted workers: one stalls until its chunk is
+// handed out again and merged, then sends its stale copy and is killed after
+// another worker went away with a chunk. Returns whether every chunk is still
+// merged, with err saying what went wrong if not.
+bool checkCoordinator(std::string &err);
+
+}
+
+#endif //PATH_TRACER_DISTRIBUTED_H
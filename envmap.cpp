@@ -0,0 +1,106 @@
+//
+// Environment map.
+//
+
+#include "envmap.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "tinygltf/stb_image.h"
+
+using namespace rt;
+using lin::Vector3d;
+
+bool EnvironmentMap::load(const std::string &path, double scale) {
+    int channels;
+    float *data = stbi_loadf(path.c_str(), &width, &height, &channels, 3);
+    if (!data) {
+        width = height = 0;
+        return false;
+    }
+    pixels.assign(data, data + width * height * 3);
+    stbi_image_free(data);
+    for (float &x : pixels) {
+        x *= scale;
+    }
+    build();
+    return true;
+}
+
+void EnvironmentMap::setConstant(const Vector3d &radiance) {
+    width = 2;
+    height = 1;
+    pixels.clear();
+    for (int i = 0; i < width * height; i++) {
+        pixels.push_back(radiance[0]);
+        pixels.push_back(radiance[1]);
+        pixels.push_back(radiance[2]);
+    }
+    build();
+}
+
+// pixels are weighted by luminance and by the solid angle of their row
+void EnvironmentMap::build() {
+    std::vector<double> weights(width * height);
+    for (int y = 0; y < height; y++) {
+        double sinTheta = std::sin(M_PI * (y + 0.5) / height);
+        for (int x = 0; x < width; x++) {
+            const float *p = &pixels[(y * width + x) * 3];
+            weights[y * width + x] = (0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2]) * sinTheta;
+        }
+    }
+    table.build(weights);
+}
+
+int EnvironmentMap::pixelIndex(const Vector3d &dir, double &sinTheta) const {
+    double cosTheta = std::max(-1.0, std::min(1.0, dir[1]));
+    sinTheta = std::sqrt(std::max(0.0, 1 - cosTheta * cosTheta));
+    double u = (std::atan2(dir[2], dir[0]) + M_PI) / (2 * M_PI);
+    double v = std::acos(cosTheta) / M_PI;
+    int x = std::min(width - 1, std::max(0, (int)(u * width)));
+    int y = std::min(height - 1, std::max(0, (int)(v * height)));
+    return y * width + x;
+}
+
+Vector3d EnvironmentMap::eval(const Vector3d &dir) const {
+    if (pixels.empty()) {
+        return Vector3d();
+    }
+    double sinTheta;
+    const float *p = &pixels[pixelIndex(dir, sinTheta) * 3];
+    return Vector3d(p[0], p[1], p[2]);
+}
+
+bool EnvironmentMap::sample(double u1, double u2, double u3, Vector3d &dir, double &pdf) const {
+    double pmf;
+    int i = table.sample(u1, pmf);
+    // rounding in the table can leave a black pixel as the alias of a bin
+    if (i < 0 || pmf <= 0) {
+        return false;
+    }
+    double x = i % width + u2;
+    double y = i / width + u3;
+    double phi = x / width * 2 * M_PI - M_PI;
+    double theta = y / height * M_PI;
+    double sinTheta = std::sin(theta);
+    if (sinTheta <= 0) {
+        return false;
+    }
+    dir = Vector3d(sinTheta * std::cos(phi), std::cos(theta), sinTheta * std::sin(phi));
+    // pixels cover 2 pi / width by pi / height of (phi, theta)
+    pdf = pmf * width * height / (2 * M_PI * M_PI * sinTheta);
+    return std::isfinite(pdf) && pdf > 0;
+}
+
+double EnvironmentMap::pdf(const Vector3d &dir) const {
+    if (table.empty()) {
+        return 0;
+    }
+    double sinTheta;
+    int i = pixelIndex(dir, sinTheta);
+    if (sinTheta <= 0) {
+        return 0;
+    }
+    return table.pmf(i) * width * height / (2 * M_PI * M_PI * sinTheta);
+}
@@ -0,0 +1,46 @@
+//
+// Environment lighting from an equirectangular HDR image.
+//
+
+#ifndef PATH_TRACER_ENVMAP_H
+#define PATH_TRACER_ENVMAP_H
+
+#include <string>
+#include <vector>
+
+#include "alias.h"
+#include "linalg.h"
+
+namespace rt {
+
+// Radiance arriving from infinitely far away, +y up. Directions are sampled
+// in proportion to the radiance of the pixels through an alias table.
+class EnvironmentMap {
+public:
+    // any image stb_image reads as float (.hdr, or png/jpeg linearized)
+    bool load(const std::string &path, double scale = 1);
+    // a constant color, for testing
+    void setConstant(const lin::Vector3d &radiance);
+
+    lin::Vector3d eval(const lin::Vector3d &dir) const;
+
+    // importance samples a direction, returning false if the map is black or
+    // the direction has no positive pdf
+    bool sample(double u1, double u2, double u3, lin::Vector3d &dir, double &pdf) const;
+    // solid angle pdf of sample() returning dir
+    double pdf(const lin::Vector3d &dir) const;
+
+    int width = 0;
+    int height = 0;
+
+private:
+    std::vector<float> pixels; // rgb
+    AliasTable table;
+
+    void build();
+    int pixelIndex(const lin::Vector3d &dir, double &sinTheta) const;
+};
+
+}
+
+#endif //PATH_TRACER_ENVMAP_H
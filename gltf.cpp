@@ -0,0 +1,264 @@
+//
+// Scenes from glTF files.
+//
+
+#define TINYGLTF_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "rt.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace rt;
+
+namespace {
+
+// keeps the encoded bytes, the texture cache decodes them when first used
+bool keepEncodedImage(tinygltf::Image *image, const int, std::string *, std::string *, int, int,
+                      const unsigned char *bytes, int size, void *) {
+    image->image.assign(bytes, bytes + size);
+    image->as_is = true;
+    return true;
+}
+
+// element i of an accessor as doubles, normalizing integer components when
+// the accessor says so
+void readElement(const tinygltf::Model &model, const tinygltf::Accessor &accessor, size_t i, double *out) {
+    const tinygltf::BufferView &view = model.bufferViews[accessor.bufferView];
+    const unsigned char *base = model.buffers[view.buffer].data.data() + view.byteOffset + accessor.byteOffset;
+    int components = tinygltf::GetNumComponentsInType(accessor.type);
+    int componentSize = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    size_t stride = view.byteStride > 0 ? view.byteStride : components * componentSize;
+    const unsigned char *p = base + i * stride;
+    for (int c = 0; c < components; c++, p += componentSize) {
+        double v = 0;
+        double scale = 1;
+        switch (accessor.componentType) {
+            case TINYGLTF_COMPONENT_TYPE_FLOAT: { float f; std::memcpy(&f, p, 4); v = f; break; }
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: v = *p; scale = 255; break;
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: { uint16_t x; std::memcpy(&x, p, 2); v = x; scale = 65535; break; }
+            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: { uint32_t x; std::memcpy(&x, p, 4); v = x; break; }
+            default: break;
+        }
+        out[c] = accessor.normalized ? v / scale : v;
+    }
+}
+
+Matrix4_4d identity() {
+    return Matrix4_4d({{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}});
+}
+
+Matrix4_4d nodeTransform(const tinygltf::Node &node) {
+    if (node.matrix.size() == 16) {
+        Matrix4_4d m;
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++) {
+                m.coeffRef(r, c) = node.matrix[c * 4 + r]; // column major
+            }
+        }
+        return m;
+    }
+    Matrix4_4d t = identity();
+    Matrix4_4d r = identity();
+    Matrix4_4d s = identity();
+    if (node.translation.size() == 3) {
+        for (int i = 0; i < 3; i++) {
+            t.coeffRef(i, 3) = node.translation[i];
+        }
+    }
+    if (node.rotation.size() == 4) {
+        double x = node.rotation[0], y = node.rotation[1], z = node.rotation[2], w = node.rotation[3];
+        double rot[3][3] = {{1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w)},
+                            {2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w)},
+                            {2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y)}};
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                r.coeffRef(i, j) = rot[i][j];
+            }
+        }
+    }
+    if (node.scale.size() == 3) {
+        for (int i = 0; i < 3; i++) {
+            s.coeffRef(i, i) = node.scale[i];
+        }
+    }
+    return t * (r * s);
+}
+
+Vector3d transform(const Matrix4_4d &m, const Vector3d &v, double w) {
+    Vector4d r = m * Vector4d(v[0], v[1], v[2], w);
+    return Vector3d(r[0], r[1], r[2]);
+}
+
+struct Loader {
+    const tinygltf::Model &model;
+    Scene &scene;
+    int defaultMaterial;
+    bool haveCamera = false;
+    Vector3d boundsMin = Vector3d(INFINITY, INFINITY, INFINITY);
+    Vector3d boundsMax = Vector3d(-INFINITY, -INFINITY, -INFINITY);
+
+    void addMesh(const tinygltf::Mesh &gltfMesh, const Matrix4_4d &m) {
+        Mesh *mesh = new Mesh;
+        for (const auto &prim : gltfMesh.primitives) {
+            auto position = prim.attributes.find("POSITION");
+            if (prim.mode != TINYGLTF_MODE_TRIANGLES || position == prim.attributes.end()) {
+                continue;
+            }
+            const tinygltf::Accessor &positions = model.accessors[position->second];
+            int base = mesh->vertices.size();
+            for (size_t i = 0; i < positions.count; i++) {
+                double p[3];
+                readElement(model, positions, i, p);
+                Vector3d v = transform(m, Vector3d(p[0], p[1], p[2]), 1);
+                mesh->vertices.push_back(v);
+                for (int k = 0; k < 3; k++) {
+                    boundsMin[k] = std::min(boundsMin[k], v[k]);
+                    boundsMax[k] = std::max(boundsMax[k], v[k]);
+                }
+            }
+
+            auto texcoord = prim.attributes.find("TEXCOORD_0");
+            if (texcoord != prim.attributes.end()) {
+                // earlier primitives of this mesh without texcoords get zeros
+                mesh->texcoords.resize(base * 2, 0.0);
+                const tinygltf::Accessor &uvs = model.accessors[texcoord->second];
+                for (size_t i = 0; i < positions.count; i++) {
+                    double uv[2] = {0, 0};
+                    if (i < uvs.count) {
+                        readElement(model, uvs, i, uv);
+                    }
+                    mesh->texcoords.push_back(uv[0]);
+                    mesh->texcoords.push_back(uv[1]);
+                }
+            } else if (!mesh->texcoords.empty()) {
+                mesh->texcoords.resize(mesh->vertices.size() * 2, 0.0);
+            }
+
+            int matIdx = prim.material >= 0 ? prim.material : defaultMaterial;
+            auto addTriangle = [&](int a, int b, int c) {
+                Primitive p;
+                p.vIndicies[0] = base + a;
+                p.vIndicies[1] = base + b;
+                p.vIndicies[2] = base + c;
+                p.matIdx = matIdx;
+                mesh->primitives.push_back(p);
+            };
+            if (prim.indices >= 0) {
+                const tinygltf::Accessor &indices = model.accessors[prim.indices];
+                for (size_t i = 0; i + 2 < indices.count; i += 3) {
+                    double idx[3][1];
+                    for (int k = 0; k < 3; k++) {
+                        readElement(model, indices, i + k, idx[k]);
+                    }
+                    addTriangle((int)idx[0][0], (int)idx[1][0], (int)idx[2][0]);
+                }
+            } else {
+                for (size_t i = 0; i + 2 < positions.count; i += 3) {
+                    addTriangle(i, i + 1, i + 2);
+                }
+            }
+        }
+        if (!mesh->texcoords.empty()) {
+            mesh->texcoords.resize(mesh->vertices.size() * 2, 0.0);
+        }
+        scene.objects.push_back(std::unique_ptr<Object>(mesh));
+    }
+
+    void setCamera(const tinygltf::Camera &gltfCamera, const Matrix4_4d &m) {
+        if (haveCamera || gltfCamera.type != "perspective") {
+            return;
+        }
+        haveCamera = true;
+        double halfHeight = std::tan(gltfCamera.perspective.yfov / 2);
+        double aspect = gltfCamera.perspective.aspectRatio > 0 ? gltfCamera.perspective.aspectRatio : 1;
+        Camera &camera = scene.camera;
+        camera.focalPoint = transform(m, Vector3d(0, 0, 0), 1);
+        camera.lookPoint = camera.focalPoint + transform(m, Vector3d(0, 0, -1), 0);
+        camera.upVector = transform(m, Vector3d(0, 1, 0), 0);
+        camera.imagePlaneDistance = 1;
+        camera.vB1 = -halfHeight;
+        camera.vB2 = halfHeight;
+        camera.hB1 = -halfHeight * aspect;
+        camera.hB2 = halfHeight * aspect;
+    }
+
+    void visit(int nodeIdx, const Matrix4_4d &parent) {
+        const tinygltf::Node &node = model.nodes[nodeIdx];
+        Matrix4_4d m = parent * nodeTransform(node);
+        if (node.mesh >= 0) {
+            addMesh(model.meshes[node.mesh], m);
+        }
+        if (node.camera >= 0) {
+            setCamera(model.cameras[node.camera], m);
+        }
+        for (int child : node.children) {
+            visit(child, m);
+        }
+    }
+};
+
+}
+
+bool rt::loadGltf(const std::string &path, tinygltf::Model &model, std::string &err) {
+    tinygltf::TinyGLTF loader;
+    loader.SetImageLoader(keepEncodedImage, nullptr);
+    std::string warn;
+    bool binary = path.size() >= 4 && path.compare(path.size() - 4, 4, ".glb") == 0;
+    return binary ? loader.LoadBinaryFromFile(&model, &err, &warn, path)
+                  : loader.LoadASCIIFromFile(&model, &err, &warn, path);
+}
+
+Scene::Scene(const tinygltf::Model &m, ThreadPool *pool) {
+    std::vector<int> imageTextures(m.images.size(), -1);
+    for (const auto &gltfMaterial : m.materials) {
+        Material material = Material::makeFromGltfMaterial(gltfMaterial);
+        int texture = gltfMaterial.pbrMetallicRoughness.baseColorTexture.index;
+        if (!material.isEmissive && texture >= 0 && texture < (int)m.textures.size()) {
+            int source = m.textures[texture].source;
+            if (source >= 0 && !m.images[source].image.empty()) {
+                if (!textures) {
+                    textures.reset(new TextureCache);
+                }
+                if (imageTextures[source] < 0) {
+                    imageTextures[source] = textures->addTexture(m.images[source].image, true);
+                }
+                material.baseColorTexture = imageTextures[source];
+            }
+        }
+        materials.push_back(material);
+    }
+
+    Loader loader{m, *this, (int)materials.size()};
+    materials.push_back(Material::makeDielectric(Vector3d(0.8, 0.8, 0.8)));
+
+    int sceneIdx = m.defaultScene >= 0 ? m.defaultScene : 0;
+    if (sceneIdx < (int)m.scenes.size()) {
+        for (int node : m.scenes[sceneIdx].nodes) {
+            loader.visit(node, identity());
+        }
+    }
+
+    if (!loader.haveCamera) {
+        // look down -z at the whole scene
+        Vector3d center = (loader.boundsMin + loader.boundsMax) / 2;
+        double radius = std::max(1e-3, (loader.boundsMax - loader.boundsMin).norm() / 2);
+        if (!std::isfinite(radius)) {
+            center = Vector3d(0, 0, 0);
+            radius = 1;
+        }
+        camera.focalPoint = center + Vector3d(0, 0, radius * 2.5);
+        camera.lookPoint = center;
+        camera.upVector = Vector3d(0, 1, 0);
+        camera.imagePlaneDistance = 1;
+        camera.vB1 = -0.5;
+        camera.vB2 = 0.5;
+        camera.hB1 = -0.5;
+        camera.hB2 = 0.5;
+    }
+    camera.init();
+
+    prepare(pool);
+}
@@ -0,0 +1,328 @@
+//
+// Path guiding with a spatial-directional tree.
+//
+
+#include "guiding.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace rt;
+using lin::Vector3d;
+
+namespace {
+
+void atomicAdd(std::atomic<float> &x, float value) {
+    float cur = x.load(std::memory_order_relaxed);
+    while (!x.compare_exchange_weak(cur, cur + value, std::memory_order_relaxed)) {
+    }
+}
+
+void atomicMin(std::atomic<double> &x, double value) {
+    double cur = x.load(std::memory_order_relaxed);
+    while (value < cur && !x.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+    }
+}
+
+void atomicMax(std::atomic<double> &x, double value) {
+    double cur = x.load(std::memory_order_relaxed);
+    while (value > cur && !x.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+    }
+}
+
+void toCanonical(const Vector3d &d, double &u, double &v) {
+    double cosTheta = std::max(-1.0, std::min(1.0, d[2]));
+    double phi = std::atan2(d[1], d[0]);
+    if (phi < 0) {
+        phi += 2 * M_PI;
+    }
+    u = std::min((cosTheta + 1) / 2, 0.99999999);
+    v = std::min(phi / (2 * M_PI), 0.99999999);
+}
+
+Vector3d fromCanonical(double u, double v) {
+    double cosTheta = 2 * u - 1;
+    double sinTheta = std::sqrt(std::max(0.0, 1 - cosTheta * cosTheta));
+    double phi = 2 * M_PI * v;
+    return Vector3d(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+}
+
+const double SPATIAL_THRESHOLD = 1000;
+const int MAX_SPATIAL_DEPTH = 24;
+const double DIRECTIONAL_THRESHOLD = 0.01;
+const int MAX_DIRECTIONAL_DEPTH = 16;
+
+}
+
+// ******************* DTree *******************
+
+DTree::Node::Node() {
+    for (int i = 0; i < 4; i++) {
+        sum[i] = 0;
+        child[i] = 0;
+    }
+}
+
+DTree::Node::Node(const Node &n) {
+    *this = n;
+}
+
+DTree::Node &DTree::Node::operator=(const Node &n) {
+    for (int i = 0; i < 4; i++) {
+        sum[i] = n.sum[i].load(std::memory_order_relaxed);
+        child[i] = n.child[i];
+    }
+    return *this;
+}
+
+DTree::DTree() : nodes(1), count(0) {}
+
+DTree::DTree(const DTree &t) : nodes(t.nodes), count(t.count.load()) {}
+
+DTree &DTree::operator=(const DTree &t) {
+    nodes = t.nodes;
+    count = t.count.load();
+    return *this;
+}
+
+float DTree::total() const {
+    const Node &root = nodes[0];
+    return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+}
+
+long long DTree::sampleCount() const {
+    return count.load(std::memory_order_relaxed);
+}
+
+void DTree::setSampleCount(long long c) {
+    count.store(c, std::memory_order_relaxed);
+}
+
+void DTree::record(const Vector3d &dir, float value) {
+    count.fetch_add(1, std::memory_order_relaxed);
+    if (!(value > 0) || !std::isfinite(value)) {
+        return;
+    }
+    double u, v;
+    toCanonical(dir, u, v);
+    int idx = 0;
+    while (true) {
+        int q = (u >= 0.5) + 2 * (v >= 0.5);
+        atomicAdd(nodes[idx].sum[q], value);
+        int c = nodes[idx].child[q];
+        if (c == 0) {
+            return;
+        }
+        u = 2 * u - (q & 1);
+        v = 2 * v - (q >> 1);
+        idx = c;
+    }
+}
+
+Vector3d DTree::sample(double u1, double u2) const {
+    double x0 = 0;
+    double y0 = 0;
+    double size = 1;
+    int idx = 0;
+    while (true) {
+        const Node &node = nodes[idx];
+        float sums[4] = {node.sum[0], node.sum[1], node.sum[2], node.sum[3]};
+        float nodeTotal = sums[0] + sums[1] + sums[2] + sums[3];
+        if (nodeTotal <= 0) {
+            break;
+        }
+        // the walk ends on the last non-empty quadrant, even when rounding
+        // leaves target past the sum of the ones before it
+        int last = 3;
+        while (sums[last] <= 0) {
+            last--;
+        }
+        int q = 0;
+        double target = u1 * nodeTotal;
+        while (q < last && target >= sums[q]) {
+            target -= sums[q];
+            q++;
+        }
+        u1 = std::min(target / sums[q], 0.99999999);
+        size /= 2;
+        x0 += (q & 1) * size;
+        y0 += (q >> 1) * size;
+        if (node.child[q] == 0) {
+            break;
+        }
+        idx = node.child[q];
+    }
+    return fromCanonical(x0 + u1 * size, y0 + u2 * size);
+}
+
+double DTree::pdf(const Vector3d &dir) const {
+    double u, v;
+    toCanonical(dir, u, v);
+    double p = 1;
+    int idx = 0;
+    while (true) {
+        const Node &node = nodes[idx];
+        float nodeTotal = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        if (nodeTotal <= 0) {
+            break;
+        }
+        int q = (u >= 0.5) + 2 * (v >= 0.5);
+        p *= 4 * node.sum[q] / nodeTotal;
+        if (node.child[q] == 0) {
+            break;
+        }
+        u = 2 * u - (q & 1);
+        v = 2 * v - (q >> 1);
+        idx = node.child[q];
+    }
+    return p / (4 * M_PI);
+}
+
+DTree DTree::refined(double threshold, int maxDepth) const {
+    DTree ret;
+    float t = total();
+    if (t <= 0) {
+        return ret;
+    }
+    const Node &root = nodes[0];
+    float sums[4] = {root.sum[0], root.sum[1], root.sum[2], root.sum[3]};
+    ret.refineNode(*this, 0, sums, 0, 1, threshold, maxDepth, t);
+    return ret;
+}
+
+// old node oldIdx (-1 if the old tree was a leaf here, energy spread evenly)
+// with quadrant energies sums maps onto new node newIdx
+void DTree::refineNode(const DTree &old, int oldIdx, const float sums[4], int newIdx, int depth,
+                       double threshold, int maxDepth, float total) {
+    for (int q = 0; q < 4; q++) {
+        if (depth >= maxDepth || sums[q] / total <= threshold) {
+            continue;
+        }
+        int childIdx = nodes.size();
+        nodes.push_back(Node());
+        nodes[newIdx].child[q] = childIdx;
+
+        int oldChild = oldIdx >= 0 ? old.nodes[oldIdx].child[q] : 0;
+        float childSums[4];
+        for (int i = 0; i < 4; i++) {
+            childSums[i] = oldChild ? (float)old.nodes[oldChild].sum[i] : sums[q] / 4;
+        }
+        refineNode(old, oldChild ? oldChild : -1, childSums, childIdx, depth + 1, threshold, maxDepth, total);
+    }
+}
+
+// ******************* PathGuide *******************
+
+PathGuide::PathGuide() {
+    SNode root;
+    root.axis = 0;
+    root.child = 0;
+    root.leaf = 0;
+    nodes.push_back(root);
+    leaves.push_back(Leaf());
+    for (int a = 0; a < 3; a++) {
+        min[a] = max[a] = 0;
+        seenMin[a] = INFINITY;
+        seenMax[a] = -INFINITY;
+    }
+}
+
+int PathGuide::leafAt(const Vector3d &p) const {
+    double lo[3] = {min[0], min[1], min[2]};
+    double hi[3] = {max[0], max[1], max[2]};
+    int idx = 0;
+    while (nodes[idx].child != 0) {
+        int axis = nodes[idx].axis;
+        double mid = (lo[axis] + hi[axis]) / 2;
+        if (p[axis] < mid) {
+            hi[axis] = mid;
+            idx = nodes[idx].child;
+        } else {
+            lo[axis] = mid;
+            idx = nodes[idx].child + 1;
+        }
+    }
+    return nodes[idx].leaf;
+}
+
+Vector3d PathGuide::sample(const Vector3d &p, double u1, double u2) const {
+    return leaves[leafAt(p)].sampling.sample(u1, u2);
+}
+
+double PathGuide::pdf(const Vector3d &p, const Vector3d &dir) const {
+    return leaves[leafAt(p)].sampling.pdf(dir);
+}
+
+void PathGuide::record(const Vector3d &p, const Vector3d &dir, float value) {
+    if (!bounded) {
+        for (int a = 0; a < 3; a++) {
+            atomicMin(seenMin[a], p[a]);
+            atomicMax(seenMax[a], p[a]);
+        }
+    }
+    leaves[leafAt(p)].building.record(dir, value);
+}
+
+void PathGuide::split(int nodeIdx) {
+    int childIdx = nodes.size();
+    SNode parent = nodes[nodeIdx];
+    for (int i = 0; i < 2; i++) {
+        SNode child;
+        child.axis = (parent.axis + 1) % 3;
+        child.child = 0;
+        child.leaf = i == 0 ? parent.leaf : (int)leaves.size();
+        if (i == 1) {
+            leaves.push_back(leaves[parent.leaf]);
+        }
+        nodes.push_back(child);
+    }
+    nodes[nodeIdx].child = childIdx;
+    nodes[nodeIdx].leaf = -1;
+
+    // the children share the parent's samples
+    for (int i = 0; i < 2; i++) {
+        DTree &building = leaves[nodes[childIdx + i].leaf].building;
+        building.setSampleCount(building.sampleCount() / 2);
+    }
+}
+
+void PathGuide::update(int pass) {
+    if (!bounded) {
+        for (int a = 0; a < 3; a++) {
+            double lo = seenMin[a];
+            double hi = seenMax[a];
+            if (!(lo <= hi)) {
+                lo = hi = 0;
+            }
+            double pad = std::max(1e-3, (hi - lo) * 0.01);
+            min[a] = lo - pad;
+            max[a] = hi + pad;
+        }
+        bounded = true;
+    }
+
+    // split leaves that saw enough samples, the children sharing the samples
+    double threshold = SPATIAL_THRESHOLD * std::sqrt(std::pow(2.0, pass));
+    std::vector<std::pair<int, int>> stack; // node, depth
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+        auto [nodeIdx, depth] = stack.back();
+        stack.pop_back();
+        if (nodes[nodeIdx].child != 0) {
+            stack.emplace_back(nodes[nodeIdx].child, depth + 1);
+            stack.emplace_back(nodes[nodeIdx].child + 1, depth + 1);
+            continue;
+        }
+        if (depth < MAX_SPATIAL_DEPTH && leaves[nodes[nodeIdx].leaf].building.sampleCount() > threshold) {
+            split(nodeIdx);
+            stack.emplace_back(nodes[nodeIdx].child, depth + 1);
+            stack.emplace_back(nodes[nodeIdx].child + 1, depth + 1);
+        }
+    }
+
+    for (auto &leaf : leaves) {
+        leaf.sampling = leaf.building;
+        leaf.building = leaf.sampling.refined(DIRECTIONAL_THRESHOLD, MAX_DIRECTIONAL_DEPTH);
+    }
+    trained = true;
+}
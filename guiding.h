@@ -0,0 +1,100 @@
+//
+// Path guiding with a spatial-directional tree (Mueller et al. 2017, "Practical
+// Path Guiding for Efficient Light-Transport Simulation").
+//
+
+#ifndef PATH_TRACER_GUIDING_H
+#define PATH_TRACER_GUIDING_H
+
+#include <atomic>
+#include <vector>
+
+#include "linalg.h"
+
+namespace rt {
+
+// quadtree over the sphere of directions, mapped to the unit square by
+// (cos theta, phi) so that equal areas have equal solid angles
+class DTree {
+public:
+    DTree();
+    DTree(const DTree &t);
+    DTree &operator=(const DTree &t);
+
+    // adds value to every node on the path to dir, safe to call concurrently
+    void record(const lin::Vector3d &dir, float value);
+    lin::Vector3d sample(double u1, double u2) const;
+    double pdf(const lin::Vector3d &dir) const;
+
+    // a tree with zeroed sums, subdivided where this tree holds more than
+    // threshold of the total energy
+    DTree refined(double threshold, int maxDepth) const;
+    long long sampleCount() const;
+    void setSampleCount(long long c);
+
+private:
+    struct Node {
+        std::atomic<float> sum[4];
+        int child[4]; // 0 for leaves
+
+        Node();
+        Node(const Node &n);
+        Node &operator=(const Node &n);
+    };
+
+    std::vector<Node> nodes;
+    std::atomic<long long> count;
+
+    float total() const;
+    void refineNode(const DTree &old, int oldIdx, const float sums[4], int newIdx, int depth,
+                    double threshold, int maxDepth, float total);
+};
+
+// spatial kd-tree whose leaves hold a directional distribution to sample
+// from and one being learned. Sampling is read-only and recording is
+// lock-free while a pass renders; update() runs between passes.
+class PathGuide {
+public:
+    PathGuide();
+
+    bool isTrained() const { return trained; }
+    bool isTraining() const { return training; }
+    void setTraining(bool t) { training = t; }
+
+    lin::Vector3d sample(const lin::Vector3d &p, double u1, double u2) const;
+    double pdf(const lin::Vector3d &p, const lin::Vector3d &dir) const;
+    void record(const lin::Vector3d &p, const lin::Vector3d &dir, float value);
+
+    // swaps the learned distributions in and refines the tree; pass is the
+    // number of training passes done so far
+    void update(int pass);
+
+private:
+    struct SNode {
+        int axis;
+        int child; // first of two children, 0 for leaves
+        int leaf;
+    };
+
+    struct Leaf {
+        DTree sampling;
+        DTree building;
+    };
+
+    std::vector<SNode> nodes;
+    std::vector<Leaf> leaves;
+    double min[3];
+    double max[3];
+    std::atomic<double> seenMin[3];
+    std::atomic<double> seenMax[3];
+    bool bounded = false;
+    bool trained = false;
+    bool training = false;
+
+    int leafAt(const lin::Vector3d &p) const;
+    void split(int nodeIdx);
+};
+
+}
+
+#endif //PATH_TRACER_GUIDING_H
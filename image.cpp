@@ -4,6 +4,10 @@
 
 #include "image.h"
 
+#include <cmath>
+#include <cstring>
+#include <string>
+
 using namespace rt;
 
 void Pixel::set(uint8_t r, uint8_t g, uint8_t b) {
@@ -19,8 +23,12 @@ Image::Image(const int width, const int height):width(width), height(height) {
     memset(this->pixels, 0, sizeof(Pixel)*width*height);
 }
 
+Image::Image(Image &&other) : pixels(other.pixels), width(other.width), height(other.height) {
+    other.pixels = nullptr;
+}
+
 Image::~Image() {
-    delete pixels;
+    delete[] pixels;
 }
 
 Pixel &Image::pxAt(int row, int col) {
@@ -57,3 +65,33 @@ void Image::writeBinaryPgm(std::ostream &out) const {
     delete[] row;
 }
 
+
+bool Image::readBinaryPgm(std::istream &in) {
+    std::string magic;
+    int w, h, maxVal;
+    in >> magic >> w >> h >> maxVal;
+    in.get();
+    if (!in || magic != "P6" || w != width || h != height || maxVal != 255) {
+        return false;
+    }
+    in.read(reinterpret_cast<char*>(pixels), width * height * 3);
+    return (bool)in;
+}
+
+double rt::rmse(const Image &a, const Image &b) {
+    if (a.width != b.width || a.height != b.height) {
+        return NAN;
+    }
+    double sum = 0;
+    for (int r = 0; r < a.height; r++) {
+        for (int c = 0; c < a.width; c++) {
+            const Pixel &pa = a.pxAt(r, c);
+            const Pixel &pb = b.pxAt(r, c);
+            double dr = (pa.r - pb.r) / 255.0;
+            double dg = (pa.g - pb.g) / 255.0;
+            double db = (pa.b - pb.b) / 255.0;
+            sum += dr * dr + dg * dg + db * db;
+        }
+    }
+    return std::sqrt(sum / (3.0 * a.width * a.height));
+}
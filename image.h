@@ -25,13 +25,19 @@ struct Image {
     const int height;
 
     Image(int width, int height);
+    Image(Image &&other); // leaves other without pixels
+    Image(const Image &) = delete;
     ~Image();
     Pixel &pxAt(int row, int col);
     const Pixel &pxAt(int row, int col) const;
     void writePgm(std::ostream &out) const;
     void writeBinaryPgm(std::ostream &out) const;
+    bool readBinaryPgm(std::istream &in); // false unless in holds a P6 image of this size
 };
 
+// root mean square difference of the pixel values, scaled to 0-1
+double rmse(const Image &a, const Image &b);
+
 }
 
 
@@ -0,0 +1,90 @@
+//
+// Irradiance cache.
+//
+
+#include "irradiance.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+using namespace rt;
+using lin::Vector3d;
+
+IrradianceCache::IrradianceCache(double maxError, double minSpacing, double maxSpacing)
+    : minSpacing(minSpacing), maxSpacing(maxSpacing), maxError(maxError), cellSize(maxError * maxSpacing) {}
+
+uint64_t IrradianceCache::cellKey(int x, int y, int z) const {
+    return ((uint64_t)(uint32_t)x * 73856093u) ^ ((uint64_t)(uint32_t)y * 19349663u << 21)
+           ^ ((uint64_t)(uint32_t)z * 83492791u << 42);
+}
+
+bool IrradianceCache::lookup(const Vector3d &p, const Vector3d &n, Vector3d &irradiance) const {
+    int cx = (int)std::floor(p[0] / cellSize);
+    int cy = (int)std::floor(p[1] / cellSize);
+    int cz = (int)std::floor(p[2] / cellSize);
+
+    double weightSum = 0;
+    Vector3d sum;
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dz = -1; dz <= 1; dz++) {
+                auto it = cells.find(cellKey(cx + dx, cy + dy, cz + dz));
+                if (it == cells.end()) {
+                    continue;
+                }
+                for (uint32_t idx : it->second) {
+                    const IrradianceRecord &rec = records[idx];
+                    double d0 = p[0] - rec.point[0];
+                    double d1 = p[1] - rec.point[1];
+                    double d2 = p[2] - rec.point[2];
+                    double cosine = n[0] * rec.normal[0] + n[1] * rec.normal[1] + n[2] * rec.normal[2];
+                    // Ward's error, the record is used where it is below maxError
+                    // and weighted by its inverse
+                    double error = std::sqrt(d0 * d0 + d1 * d1 + d2 * d2) / rec.radius
+                            + std::sqrt(std::max(0.0, 1 - cosine));
+                    if (error >= maxError) {
+                        continue;
+                    }
+                    // skip records in front of p, they see geometry p may not
+                    double front = (d0 * (n[0] + rec.normal[0]) + d1 * (n[1] + rec.normal[1])
+                            + d2 * (n[2] + rec.normal[2])) / 2;
+                    if (front < -0.01 * rec.radius) {
+                        continue;
+                    }
+                    double w = 1 / std::max(error, 1e-6);
+                    sum = sum + Vector3d(rec.irradiance[0], rec.irradiance[1], rec.irradiance[2]) * w;
+                    weightSum += w;
+                }
+            }
+        }
+    }
+    if (weightSum <= 0) {
+        return false;
+    }
+    irradiance = sum / weightSum;
+    return true;
+}
+
+void IrradianceCache::insert(const Vector3d &p, const Vector3d &n, const Vector3d &irradiance,
+                             double harmonicDistance) {
+    IrradianceRecord rec;
+    for (int i = 0; i < 3; i++) {
+        rec.point[i] = p[i];
+        rec.normal[i] = n[i];
+        rec.irradiance[i] = irradiance[i];
+    }
+    rec.radius = std::min(maxSpacing, std::max(minSpacing, harmonicDistance));
+
+    uint64_t key = cellKey((int)std::floor(p[0] / cellSize), (int)std::floor(p[1] / cellSize),
+                           (int)std::floor(p[2] / cellSize));
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    cells[key].push_back(records.size());
+    records.push_back(rec);
+}
+
+size_t IrradianceCache::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return records.size();
+}
@@ -0,0 +1,57 @@
+//
+// Irradiance cache: sparse records of indirect irradiance on diffuse
+// surfaces, interpolated with Ward's error metric.
+//
+
+#ifndef PATH_TRACER_IRRADIANCE_H
+#define PATH_TRACER_IRRADIANCE_H
+
+#include <cstdint>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "linalg.h"
+
+namespace rt {
+
+struct IrradianceRecord {
+    float point[3];
+    float normal[3];
+    float irradiance[3];
+    float radius; // harmonic mean distance to the surfaces seen from the record
+};
+
+// Records are added while rendering by whichever thread misses first, so
+// lookups and inserts may run concurrently.
+class IrradianceCache {
+public:
+    // maxError is Ward's a: a record is used within maxError * its radius,
+    // radii are clamped to [minSpacing, maxSpacing]
+    IrradianceCache(double maxError, double minSpacing, double maxSpacing);
+
+    // weighted average of the records valid at p facing n, false if none is
+    bool lookup(const lin::Vector3d &p, const lin::Vector3d &n, lin::Vector3d &irradiance) const;
+
+    void insert(const lin::Vector3d &p, const lin::Vector3d &n, const lin::Vector3d &irradiance,
+                double harmonicDistance);
+
+    size_t size() const;
+
+    double minSpacing;
+    double maxSpacing;
+
+private:
+    double maxError;
+    double cellSize; // the largest distance a record is used at
+
+    mutable std::shared_mutex mutex;
+    std::vector<IrradianceRecord> records;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> cells;
+
+    uint64_t cellKey(int x, int y, int z) const;
+};
+
+}
+
+#endif //PATH_TRACER_IRRADIANCE_H
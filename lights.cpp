@@ -0,0 +1,393 @@
+//
+// Light sampling: per-light sampling routines and a light bvh for picking
+// lights in proportion to their estimated contribution.
+//
+
+#include "rt.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace rt;
+
+namespace {
+
+double safeSqrt(double x) {
+    return std::sqrt(std::max(0.0, x));
+}
+
+double safeAcos(double x) {
+    return std::acos(std::max(-1.0, std::min(1.0, x)));
+}
+
+Vector3d componentMin(const Vector3d &a, const Vector3d &b) {
+    return Vector3d(std::min(a[0], b[0]), std::min(a[1], b[1]), std::min(a[2], b[2]));
+}
+
+Vector3d componentMax(const Vector3d &a, const Vector3d &b) {
+    return Vector3d(std::max(a[0], b[0]), std::max(a[1], b[1]), std::max(a[2], b[2]));
+}
+
+double luminance(const Vector3d &c) {
+    return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
+void makeBasis(const Vector3d &n, Vector3d &t, Vector3d &b) {
+    t = std::fabs(n[0]) > 0.9 ? Vector3d(0, 1, 0) : Vector3d(1, 0, 0);
+    t = t - n * n.dot(t);
+    t.normalize();
+    b = n.cross(t);
+}
+
+// rotates v by theta around the unit axis (Rodrigues' formula)
+Vector3d rotate(const Vector3d &v, const Vector3d &axis, double theta) {
+    double c = std::cos(theta);
+    double s = std::sin(theta);
+    return v * c + axis.cross(v) * s + axis * (axis.dot(v) * (1 - c));
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+double cosSubClamped(double sinA, double cosA, double sinB, double cosB) {
+    if (cosA > cosB) {
+        return 1;
+    }
+    return cosA * cosB + sinA * sinB;
+}
+
+double sinSubClamped(double sinA, double cosA, double sinB, double cosB) {
+    if (cosA > cosB) {
+        return 0;
+    }
+    return sinA * cosB - cosA * sinB;
+}
+
+}
+
+// ******************* LightBounds *******************
+
+double LightBounds::importance(const Vector3d &p, const Vector3d &n) const {
+    Vector3d pc = (min + max) * 0.5;
+    Vector3d diag = max - min;
+    double d2 = (p - pc).dot(p - pc);
+    d2 = std::max(d2, diag.norm() / 2);
+
+    Vector3d wi = p - pc;
+    double len = wi.norm();
+    if (len > 0) {
+        wi = wi / len;
+    }
+    double cosThetaW = w.dot(wi);
+    if (twoSided) {
+        cosThetaW = std::fabs(cosThetaW);
+    }
+    double sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+
+    // angle subtended by the bounding sphere of the bounds
+    double radius2 = diag.dot(diag) / 4;
+    double cosThetaB = -1;
+    if (len * len > radius2) {
+        cosThetaB = safeSqrt(1 - radius2 / (len * len));
+    }
+    double sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+    double sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO);
+
+    double cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    double sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    double cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE) {
+        return 0;
+    }
+
+    double importance = phi * cosThetaP / d2;
+
+    // light arriving from below the surface does not contribute
+    double cosThetaI = -wi.dot(n);
+    double sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+    importance *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+    return std::max(importance, 0.0);
+}
+
+LightBounds LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+    if (a.phi == 0) {
+        return b;
+    }
+    if (b.phi == 0) {
+        return a;
+    }
+
+    LightBounds ret;
+    ret.min = componentMin(a.min, b.min);
+    ret.max = componentMax(a.max, b.max);
+    ret.phi = a.phi + b.phi;
+    ret.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+    ret.twoSided = a.twoSided || b.twoSided;
+
+    // smallest cone containing both normal cones
+    double thetaA = safeAcos(a.cosThetaO);
+    double thetaB = safeAcos(b.cosThetaO);
+    double thetaD = safeAcos(a.w.dot(b.w));
+    if (std::min(thetaD + thetaB, M_PI) <= thetaA) {
+        ret.w = a.w;
+        ret.cosThetaO = a.cosThetaO;
+        return ret;
+    }
+    if (std::min(thetaD + thetaA, M_PI) <= thetaB) {
+        ret.w = b.w;
+        ret.cosThetaO = b.cosThetaO;
+        return ret;
+    }
+
+    double thetaO = (thetaA + thetaD + thetaB) / 2;
+    Vector3d axis = a.w.cross(b.w);
+    if (thetaO >= M_PI || axis.norm() == 0) {
+        ret.w = a.w;
+        ret.cosThetaO = -1;
+        return ret;
+    }
+    axis.normalize();
+    ret.w = rotate(a.w, axis, thetaO - thetaA);
+    ret.w.normalize();
+    ret.cosThetaO = std::cos(thetaO);
+    return ret;
+}
+
+// ******************* Light *******************
+
+double Light::area() const {
+    if (type == SphereLight) {
+        return 4 * M_PI * radius * radius;
+    }
+    return (p1 - p0).cross(p2 - p0).norm() / 2;
+}
+
+double Light::power() const {
+    double sides = type == TriangleLight ? 2 : 1;
+    return luminance(emission) * area() * M_PI * sides;
+}
+
+LightBounds Light::bounds() const {
+    LightBounds ret;
+    ret.phi = power();
+    if (type == SphereLight) {
+        Vector3d r(radius, radius, radius);
+        ret.min = p0 - r;
+        ret.max = p0 + r;
+        ret.w = Vector3d(0, 0, 1);
+        ret.cosThetaO = -1;
+        ret.cosThetaE = 0;
+        return ret;
+    }
+    ret.min = componentMin(p0, componentMin(p1, p2));
+    ret.max = componentMax(p0, componentMax(p1, p2));
+    ret.w = (p1 - p0).cross(p2 - p0);
+    ret.w.normalize();
+    ret.cosThetaO = 1;
+    ret.cosThetaE = 0;
+    ret.twoSided = true;
+    return ret;
+}
+
+void Light::samplePoint(double u1, double u2, Vector3d &point, Vector3d &normal) const {
+    if (type == SphereLight) {
+        double z = 1 - 2 * u1;
+        double r = safeSqrt(1 - z * z);
+        double phi = 2 * M_PI * u2;
+        normal = Vector3d(r * std::cos(phi), r * std::sin(phi), z);
+        point = p0 + normal * radius;
+        return;
+    }
+    double su = std::sqrt(u1);
+    double b0 = 1 - su;
+    double b1 = u2 * su;
+    point = p0 * b0 + p1 * b1 + p2 * (1 - b0 - b1);
+    normal = (p1 - p0).cross(p2 - p0);
+    normal.normalize();
+}
+
+bool Light::sample(const Vector3d &p, double u1, double u2, Vector3d &wi, double &pdf) const {
+    if (type == SphereLight) {
+        // uniform over the cone of directions subtended by the sphere; the
+        // inside of a sphere is never hit, so points inside see nothing
+        Vector3d toCenter = p0 - p;
+        double d2 = toCenter.dot(toCenter);
+        double r2 = radius * radius;
+        if (d2 <= r2) {
+            return false;
+        }
+        double d = std::sqrt(d2);
+        double cosThetaMax = std::sqrt(1 - r2 / d2);
+        double oneMinusCos = (r2 / d2) / (1 + cosThetaMax);
+
+        double cosTheta = 1 - u1 * oneMinusCos;
+        double sinTheta = safeSqrt(1 - cosTheta * cosTheta);
+        double phi = 2 * M_PI * u2;
+
+        Vector3d axis = toCenter / d;
+        Vector3d t, b;
+        makeBasis(axis, t, b);
+        wi = axis * cosTheta + t * (sinTheta * std::cos(phi)) + b * (sinTheta * std::sin(phi));
+        pdf = 1 / (2 * M_PI * oneMinusCos);
+        return true;
+    }
+
+    // uniform over the triangle area
+    double su = std::sqrt(u1);
+    double b0 = 1 - su;
+    double b1 = u2 * su;
+    Vector3d q = p0 * b0 + p1 * b1 + p2 * (1 - b0 - b1);
+    Vector3d n = (p1 - p0).cross(p2 - p0);
+    double area = n.norm() / 2;
+    n.normalize();
+
+    Vector3d toLight = q - p;
+    double dist2 = toLight.dot(toLight);
+    if (dist2 == 0) {
+        return false;
+    }
+    wi = toLight / std::sqrt(dist2);
+    double cosLight = std::fabs(n.dot(wi));
+    if (cosLight < 1e-8) {
+        return false;
+    }
+    pdf = dist2 / (area * cosLight);
+    return true;
+}
+
+double Light::pdf(const Ray &ray, const HitRecord &hit) const {
+    if (type == SphereLight) {
+        Vector3d toCenter = p0 - ray.o;
+        double d2 = toCenter.dot(toCenter);
+        double r2 = radius * radius;
+        if (d2 <= r2) {
+            return 0;
+        }
+        double oneMinusCos = (r2 / d2) / (1 + std::sqrt(1 - r2 / d2));
+        return 1 / (2 * M_PI * oneMinusCos);
+    }
+
+    double cosLight = std::fabs(hit.normal.dot(ray.d));
+    if (cosLight < 1e-8) {
+        return 0;
+    }
+    return hit.distance * hit.distance / (area() * cosLight);
+}
+
+// ******************* LightBvh *******************
+
+void LightBvh::build(const std::vector<Light> &lights) {
+    nodes.clear();
+    bitTrails.assign(lights.size(), 0);
+    if (lights.empty()) {
+        return;
+    }
+    std::vector<int> idx(lights.size());
+    for (size_t i = 0; i < idx.size(); i++) {
+        idx[i] = i;
+    }
+    buildNode(lights, idx, 0, idx.size(), 0, 0);
+}
+
+int LightBvh::buildNode(const std::vector<Light> &lights, std::vector<int> &idx, int begin, int end,
+                        uint64_t trail, int depth) {
+    int nodeIdx = nodes.size();
+    nodes.push_back(Node());
+
+    if (end - begin == 1) {
+        nodes[nodeIdx].bounds = lights[idx[begin]].bounds();
+        nodes[nodeIdx].child = -1;
+        nodes[nodeIdx].lightIdx = idx[begin];
+        bitTrails[idx[begin]] = trail;
+        return nodeIdx;
+    }
+
+    // median split along the largest extent of the light centroids
+    Vector3d cmin(INFINITY, INFINITY, INFINITY);
+    Vector3d cmax(-INFINITY, -INFINITY, -INFINITY);
+    for (int i = begin; i < end; i++) {
+        LightBounds b = lights[idx[i]].bounds();
+        Vector3d c = (b.min + b.max) * 0.5;
+        cmin = componentMin(cmin, c);
+        cmax = componentMax(cmax, c);
+    }
+    Vector3d extent = cmax - cmin;
+    int axis = 0;
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+
+    int mid = (begin + end) / 2;
+    std::nth_element(idx.begin() + begin, idx.begin() + mid, idx.begin() + end, [&](int a, int b) {
+        LightBounds ba = lights[a].bounds();
+        LightBounds bb = lights[b].bounds();
+        return ba.min[axis] + ba.max[axis] < bb.min[axis] + bb.max[axis];
+    });
+
+    // the trail only has room for 64 levels; a median split stays far below
+    uint64_t bit = depth < 63 ? (uint64_t)1 << depth : 0;
+    int left = buildNode(lights, idx, begin, mid, trail, depth + 1);
+    int right = buildNode(lights, idx, mid, end, trail | bit, depth + 1);
+
+    nodes[nodeIdx].bounds = LightBounds::merge(nodes[left].bounds, nodes[right].bounds);
+    nodes[nodeIdx].child = right;
+    nodes[nodeIdx].lightIdx = -1;
+    return nodeIdx;
+}
+
+int LightBvh::sample(const Vector3d &p, const Vector3d &n, double u, double &pmf) const {
+    if (nodes.empty()) {
+        return -1;
+    }
+    int nodeIdx = 0;
+    pmf = 1;
+    while (nodes[nodeIdx].lightIdx < 0) {
+        const Node &node = nodes[nodeIdx];
+        double i0 = nodes[nodeIdx + 1].bounds.importance(p, n);
+        double i1 = nodes[node.child].bounds.importance(p, n);
+        if (i0 == 0 && i1 == 0) {
+            return -1;
+        }
+        double p0 = i0 / (i0 + i1);
+        if (u < p0) {
+            nodeIdx = nodeIdx + 1;
+            u = std::min(u / p0, 0.99999999);
+            pmf *= p0;
+        } else {
+            nodeIdx = node.child;
+            u = std::min((u - p0) / (1 - p0), 0.99999999);
+            pmf *= 1 - p0;
+        }
+    }
+    if (nodeIdx == 0 && nodes[0].bounds.importance(p, n) == 0) {
+        return -1;
+    }
+    return nodes[nodeIdx].lightIdx;
+}
+
+double LightBvh::pmf(const Vector3d &p, const Vector3d &n, int lightIdx) const {
+    if (nodes.empty()) {
+        return 0;
+    }
+    uint64_t trail = bitTrails[lightIdx];
+    int nodeIdx = 0;
+    double pmf = 1;
+    while (nodes[nodeIdx].lightIdx < 0) {
+        const Node &node = nodes[nodeIdx];
+        double i0 = nodes[nodeIdx + 1].bounds.importance(p, n);
+        double i1 = nodes[node.child].bounds.importance(p, n);
+        if (i0 == 0 && i1 == 0) {
+            return 0;
+        }
+        if (trail & 1) {
+            pmf *= i1 / (i0 + i1);
+            nodeIdx = node.child;
+        } else {
+            pmf *= i0 / (i0 + i1);
+            nodeIdx = nodeIdx + 1;
+        }
+        trail >>= 1;
+    }
+    if (nodeIdx == 0 && nodes[0].bounds.importance(p, n) == 0) {
+        return 0;
+    }
+    return pmf;
+}
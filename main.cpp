@@ -4,38 +4,724 @@
 #include <string>
 #include <map>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <future>
+#include <memory>
+#include <cstdio>
+#include <thread>
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-//#define TINYGLTF_IMPLEMENTATION
-//#define STB_IMAGE_IMPLEMENTATION
-//#define STB_IMAGE_WRITE_IMPLEMENTATION
-//
 #include "tinygltf/tiny_gltf.h"
 
 #include "rt.h"
 #include "image.h"
+#include "denoise.h"
+#include "affinity.h"
+#include "distributed.h"
 
-int main(int argc, const char * argv[]) {
+// --key value pairs from the command line
+std::map<std::string, std::string> parseArgs(int argc, const char * argv[]) {
+    std::map<std::string, std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key.rfind("--", 0) != 0) {
+            continue;
+        }
+        key = key.substr(2);
+        if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) {
+            args[key] = argv[++i];
+        } else {
+            args[key] = "";
+        }
+    }
+    return args;
+}
+
+int intArg(const std::map<std::string, std::string> &args, const std::string &key, int def) {
+    auto it = args.find(key);
+    return it == args.end() || it->second.empty() ? def : std::stoi(it->second);
+}
+
+// Renders the scene at doubling spp up to a sixteenth of options.samplesPerPixel
+// and prints how far each is from a render at the full spp
+void runConvergence(rt::Scene &scene, const rt::RenderOptions &options) {
+    rt::RenderOptions fixed = options;
+    fixed.adaptiveSampling = false;
+    fixed.timeBudget = 0;
+    fixed.seed = options.seed + 1; // so the reference's noise is independent of the renders'
+
+    rt::Image reference(options.horizontalResolution, options.verticalResolution);
+    rt::RenderContext context;
+    context.scene = &scene;
+    context.options = &fixed;
+    context.image = &reference;
+    rt::rayTrace(context);
+    fixed.seed = options.seed;
+
+    for (int spp = 1; spp * 16 <= options.samplesPerPixel; spp *= 2) {
+        fixed.samplesPerPixel = spp;
+        rt::Image image(options.horizontalResolution, options.verticalResolution);
+        rt::RenderStats stats;
+        context.image = &image;
+        context.stats = &stats;
+        rt::rayTrace(context);
+        std::cout << spp << " spp " << stats.seconds << " s rmse " << rt::rmse(image, reference) << std::endl;
+    }
+}
+
+// Renders a reference at options.samplesPerPixel, then a sixteenth of the spp
+// with importance and with uniform environment sampling, and prints their
+// error against the reference
+void runEnvironmentBenchmark(rt::Scene &scene, const rt::RenderOptions &options) {
+    rt::RenderOptions fixed = options;
+    fixed.adaptiveSampling = false;
+    fixed.timeBudget = 0;
+    fixed.environmentImportanceSampling = true;
+    fixed.seed = options.seed + 1; // so the reference's noise is independent of the renders'
+
+    rt::Image reference(options.horizontalResolution, options.verticalResolution);
+    rt::RenderContext context;
+    context.scene = &scene;
+    context.options = &fixed;
+    context.image = &reference;
+    rt::rayTrace(context);
+    fixed.seed = options.seed;
+
+    fixed.samplesPerPixel = std::max(1, options.samplesPerPixel / 16);
+    double mse[2];
+    for (int importance = 1; importance >= 0; importance--) {
+        fixed.environmentImportanceSampling = importance;
+        rt::Image image(options.horizontalResolution, options.verticalResolution);
+        rt::RenderStats stats;
+        context.image = &image;
+        context.stats = &stats;
+        rt::rayTrace(context);
+        double rmse = rt::rmse(image, reference);
+        mse[importance] = rmse * rmse;
+        std::cout << (importance ? "importance" : "uniform") << " sampling " << fixed.samplesPerPixel << " spp "
+                  << stats.seconds << " s rmse " << rmse << std::endl;
+    }
+    std::cout << "variance reduction " << mse[0] / std::max(mse[1], 1e-12) << "x" << std::endl;
+}
+
+// Renders a reference with the bidirectional integrator at
+// options.samplesPerPixel, then each integrator at doubling spp until its
+// error drops below targetRmse, and prints the time that took
+void runIntegratorBenchmark(rt::Scene &scene, const rt::RenderOptions &options, double targetRmse) {
+    rt::RenderOptions fixed = options;
+    fixed.adaptiveSampling = false;
+    fixed.timeBudget = 0;
+    fixed.integrator = rt::Integrator::Bidirectional;
+    fixed.seed = options.seed + 1; // so the reference's noise is independent of the renders'
+
+    rt::Image reference(options.horizontalResolution, options.verticalResolution);
+    rt::RenderContext context;
+    context.scene = &scene;
+    context.options = &fixed;
+    context.image = &reference;
+    rt::rayTrace(context);
+    fixed.seed = options.seed;
+
+    for (rt::Integrator integrator : {rt::Integrator::Path, rt::Integrator::Bidirectional}) {
+        fixed.integrator = integrator;
+        const char *name = integrator == rt::Integrator::Path ? "path" : "bidirectional";
+        double rmse = INFINITY;
+        rt::RenderStats stats;
+        for (int spp = 1; spp * 4 <= options.samplesPerPixel && rmse > targetRmse; spp *= 2) {
+            fixed.samplesPerPixel = spp;
+            rt::Image image(options.horizontalResolution, options.verticalResolution);
+            context.image = &image;
+            context.stats = &stats;
+            rt::rayTrace(context);
+            rmse = rt::rmse(image, reference);
+        }
+        if (rmse <= targetRmse) {
+            std::cout << name << " reached rmse " << rmse << " at " << fixed.samplesPerPixel << " spp in "
+                      << stats.seconds << " s" << std::endl;
+        } else {
+            std::cout << name << " did not reach rmse " << targetRmse << ", rmse " << rmse << " at "
+                      << fixed.samplesPerPixel << " spp in " << stats.seconds << " s" << std::endl;
+        }
+    }
+}
+
+// For 1 to 10k lights, renders a reference at options.samplesPerPixel with
+// light bvh sampling, then a sixteenth of the spp with each light sampling
+// mode, and prints the time and error of each
+void runLightSweep(const rt::RenderOptions &options) {
+    const char *names[] = {"none", "uniform", "power", "bvh"};
+    for (int lightCount = 1; lightCount <= 10000; lightCount *= 10) {
+        rt::Scene scene = rt::Scene::makeManyLights(lightCount);
+        rt::RenderOptions fixed = options;
+        fixed.adaptiveSampling = false;
+        fixed.timeBudget = 0;
+        fixed.lightSampling = rt::LightSampling::LightBvh;
+        fixed.seed = options.seed + 1; // so the reference's noise is independent of the renders'
+
+        rt::Image reference(options.horizontalResolution, options.verticalResolution);
+        rt::RenderContext context;
+        context.scene = &scene;
+        context.options = &fixed;
+        context.image = &reference;
+        rt::rayTrace(context);
 
+        fixed.samplesPerPixel = std::max(1, options.samplesPerPixel / 16);
+        fixed.seed = options.seed;
+        for (int mode = 0; mode < 4; mode++) {
+            fixed.lightSampling = (rt::LightSampling)mode;
+            rt::Image image(options.horizontalResolution, options.verticalResolution);
+            rt::RenderStats stats;
+            context.image = &image;
+            context.stats = &stats;
+            rt::rayTrace(context);
+            std::cout << lightCount << " lights, " << names[mode] << ": " << stats.seconds << " s rmse "
+                      << rt::rmse(image, reference) << std::endl;
+        }
+    }
+}
+
+// share of the render threads' time spent working rather than waiting
+double utilization(const rt::RenderStats &stats) {
+    double busy = 0;
+    double idle = 0;
+    for (size_t i = 0; i < stats.threadBusySeconds.size(); i++) {
+        busy += stats.threadBusySeconds[i];
+        idle += stats.threadIdleSeconds[i];
+    }
+    return busy + idle > 0 ? busy / (busy + idle) : 1;
+}
+
+// Renders the scene with tiles of 4 to 64 pixels and prints the time and
+// thread utilization of each
+void runTileBenchmark(rt::Scene &scene, const rt::RenderOptions &options) {
+    rt::RenderOptions tiled = options;
+    for (int size = 4; size <= 64; size *= 2) {
+        tiled.tileSize = size;
+        rt::Image image(options.horizontalResolution, options.verticalResolution);
+        rt::RenderStats stats;
+        rt::RenderContext context;
+        context.scene = &scene;
+        context.options = &tiled;
+        context.image = &image;
+        context.stats = &stats;
+        rt::rayTrace(context);
+        std::cout << "tile size " << size << ": " << stats.seconds << " s, " << stats.tiles << " tiles, "
+                  << stats.tilesStolen << " stolen, utilization " << utilization(stats) * 100 << "%" << std::endl;
+    }
+}
 
+// Renders the scene with every tile order, walking the tiles row by row and
+// in Z-order, and prints the time and cache misses of each
+void runOrderBenchmark(rt::Renderer &renderer, rt::Scene &scene, const rt::RenderOptions &options) {
+    const char *names[] = {"rows", "morton", "hilbert", "spiral"};
+    rt::RenderOptions ordered = options;
+    ordered.countCacheMisses = true;
+    for (int order = 0; order < 4; order++) {
+        for (int z = 0; z < 2; z++) {
+            ordered.tileOrder = (rt::TileOrder)order;
+            ordered.zOrderPixels = z > 0;
+            rt::Image image(options.horizontalResolution, options.verticalResolution);
+            rt::RenderStats stats;
+            rt::RenderContext context;
+            context.scene = &scene;
+            context.options = &ordered;
+            context.image = &image;
+            context.stats = &stats;
+            renderer.render(context);
+            std::cout << names[order] << " tiles, " << (z ? "z-order" : "row") << " pixels: " << stats.seconds
+                      << " s, cache misses ";
+            if (stats.cacheMisses >= 0) {
+                std::cout << stats.cacheMisses;
+            } else {
+                std::cout << "unavailable";
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+// Renders the scene tracing 1 to 16 paths per thread at once and prints the
+// throughput and cache misses of each, and the rmse of each image against the
+// one path at a time render, which only rounding should make differ
+void runInterleaveBenchmark(rt::Renderer &renderer, rt::Scene &scene, const rt::RenderOptions &options) {
+    rt::Image single(options.horizontalResolution, options.verticalResolution);
+    for (int paths : {1, 2, 4, 8, 16}) {
+        rt::RenderOptions interleaved = options;
+        interleaved.interleavedPaths = paths;
+        interleaved.countCacheMisses = true;
+        rt::Image image(options.horizontalResolution, options.verticalResolution);
+        rt::RenderStats stats;
+        rt::RenderContext context;
+        context.scene = &scene;
+        context.options = &interleaved;
+        context.image = paths == 1 ? &single : &image;
+        context.stats = &stats;
+        renderer.render(context);
+        std::cout << paths << " paths: " << stats.seconds << " s, " << stats.raysPerSecond / 1e6
+                  << " M rays/s, rmse " << rt::rmse(*context.image, single) << ", cache misses ";
+        if (stats.cacheMisses >= 0) {
+            std::cout << stats.cacheMisses;
+        } else {
+            std::cout << "unavailable";
+        }
+        std::cout << std::endl;
+    }
+}
+
+double elapsed(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Submits renders to check that a high priority render preempts a low one
+// and that cancelling stops a render between tiles
+void runAsyncBenchmark(rt::Renderer &renderer, rt::Scene &scene, const rt::RenderOptions &options) {
+    rt::RenderRequest request;
+    request.scene = &scene;
+    request.options = options;
+
+    request.priority = rt::RenderPriority::High;
+    auto start = std::chrono::steady_clock::now();
+    renderer.submit(request).image.get();
+    double alone = elapsed(start);
+    std::cout << "high priority alone: " << alone << " s" << std::endl;
+
+    // the low render reports every quarter of its tiles
+    rt::RenderRequest low = request;
+    low.priority = rt::RenderPriority::Low;
+    int reported = 0;
+    low.onProgress = [&reported](const rt::RenderProgress &p) {
+        if (p.tilesDone * 4 >= (reported + 1) * p.tilesTotal) {
+            reported++;
+            std::cout << "  low: " << p.tilesDone << "/" << p.tilesTotal << " tiles, " << p.seconds << " s, eta "
+                      << p.etaSeconds << " s, " << p.raysPerSecond / 1e6 << " M rays/s" << std::endl;
+        }
+    };
+    start = std::chrono::steady_clock::now();
+    rt::RenderHandle background = renderer.submit(low);
+    for (rt::RenderProgress p; p.tilesTotal == 0 || p.tilesDone * 4 < p.tilesTotal; p = background.progress()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto urgentStart = std::chrono::steady_clock::now();
+    renderer.submit(request).image.get();
+    double urgent = elapsed(urgentStart);
+    background.image.get();
+    std::cout << "high priority over a low one: " << urgent << " s, low finished after " << elapsed(start)
+              << " s" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    rt::RenderHandle cancelled = renderer.submit(request);
+    while (cancelled.progress().tilesDone == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto cancelStart = std::chrono::steady_clock::now();
+    cancelled.cancel();
+    try {
+        cancelled.image.get();
+    } catch (const rt::RenderCancelled &) {
+        std::cout << "cancelled after " << cancelled.progress().tilesDone << " tiles, stopped "
+                  << elapsed(cancelStart) << " s after cancel()" << std::endl;
+    }
+}
+
+// cameras orbiting the scene camera's look point about its up vector
+std::vector<rt::Camera> turntable(const rt::Camera &camera, int count) {
+    std::vector<rt::Camera> cameras;
+    rt::Vector3d axis = camera.upVector / camera.upVector.norm();
+    rt::Vector3d arm = camera.focalPoint - camera.lookPoint;
+    for (int i = 0; i < count; i++) {
+        double angle = 2 * M_PI * i / count;
+        // Rodrigues' rotation of the arm about the axis
+        rt::Vector3d rotated = arm * std::cos(angle) + axis.cross(arm) * std::sin(angle)
+                + axis * (axis.dot(arm) * (1 - std::cos(angle)));
+        rt::Camera view = camera;
+        view.focalPoint = camera.lookPoint + rotated;
+        view.init();
+        cameras.push_back(view);
+    }
+    return cameras;
+}
+
+// cameras from a file of one "fx fy fz lx ly lz" focal and look point per
+// line, otherwise like the scene camera
+std::vector<rt::Camera> readViews(const std::string &path, const rt::Camera &camera) {
+    std::vector<rt::Camera> cameras;
+    std::ifstream in(path);
+    double f[3], l[3];
+    while (in >> f[0] >> f[1] >> f[2] >> l[0] >> l[1] >> l[2]) {
+        rt::Camera view = camera;
+        view.focalPoint = rt::Vector3d(f[0], f[1], f[2]);
+        view.lookPoint = rt::Vector3d(l[0], l[1], l[2]);
+        view.init();
+        cameras.push_back(view);
+    }
+    return cameras;
+}
 
-//    tinygltf::TinyGLTF loader;
-//    tinygltf::Model model;
-//
-//    std::string err;
-//    std::string warn;
-//
-//    bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, argv[1]);
-////    bool ret = loader.LoadBinaryFromFile(&model, &err, &warn, argv[1]);
-////    printf("Cameras: %d\n", model.cameras.size());
+// Renders all cameras in one batch, writing view_<i>.pgm, and prints the time
+// and throughput of each view and of the batch. With compare the views are
+// also rendered one after another.
+void runBatch(rt::Renderer &renderer, rt::Scene &scene, rt::RenderOptions &options,
+              const std::vector<rt::Camera> &cameras, double sceneSeconds, bool compare) {
+    std::vector<std::unique_ptr<rt::Image>> images;
+    std::vector<rt::RenderStats> viewStats(cameras.size());
+    std::vector<rt::BatchView> views;
+    for (size_t i = 0; i < cameras.size(); i++) {
+        images.emplace_back(new rt::Image(options.horizontalResolution, options.verticalResolution));
+        views.push_back({cameras[i], images.back().get(), &viewStats[i]});
+    }
 
-    rt::Scene scene;
+    rt::RenderStats stats;
+    renderer.renderBatch(scene, options, views, &stats);
+    for (size_t i = 0; i < views.size(); i++) {
+        std::cout << "view " << i << ": done after " << viewStats[i].seconds << " s, "
+                  << viewStats[i].raysPerSecond / 1e6 << " M rays/s" << std::endl;
+        char name[32];
+        std::snprintf(name, sizeof(name), "view_%03d.pgm", (int)i);
+        std::ofstream out(name);
+        images[i]->writeBinaryPgm(out);
+    }
+    std::cout << "batch of " << views.size() << " views: " << stats.seconds << " s, "
+              << stats.raysPerSecond / 1e6 << " M rays/s, scene built once in " << sceneSeconds << " s" << std::endl;
+
+    if (compare) {
+        double seconds = 0;
+        long long rays = 0;
+        for (const auto &camera : cameras) {
+            rt::Image image(options.horizontalResolution, options.verticalResolution);
+            rt::RenderStats single;
+            rt::RenderContext context;
+            context.scene = &scene;
+            context.options = &options;
+            context.image = &image;
+            context.camera = &camera;
+            context.stats = &single;
+            renderer.render(context);
+            seconds += single.seconds;
+            rays += single.raysTraced;
+        }
+        std::cout << "one at a time: " << seconds << " s, " << rays / seconds / 1e6 << " M rays/s, plus " << sceneSeconds * cameras.size()
+                  << " s building the scene for each" << std::endl;
+    }
+}
+
+// Renders the scene with 1, 2, 8 and 64 threads, by tiles, sample-parallel and
+// by tiles with 8 interleaved paths, and prints an FNV-1a hash of each film,
+// which are the same for each way of rendering when it is deterministic.
+// Returns whether they are.
+bool runDeterminismCheck(rt::Renderer &renderer, rt::Scene &scene, const rt::RenderOptions &options) {
+    const char *names[] = {"tiles, ", "sample-parallel, ", "interleaved, "};
+    bool same = true;
+    for (int mode = 0; mode < 3; mode++) {
+        uint64_t first = 0;
+        for (int threads : {1, 2, 8, 64}) {
+            rt::RenderOptions check = options;
+            check.threadCount = threads;
+            check.sampleParallel = mode == 1;
+            if (mode == 2) {
+                check.interleavedPaths = 8;
+            }
+            rt::Image image(options.horizontalResolution, options.verticalResolution);
+            rt::Film film(options.horizontalResolution, options.verticalResolution);
+            rt::RenderContext context;
+            context.scene = &scene;
+            context.options = &check;
+            context.image = &image;
+            context.film = &film;
+            renderer.render(context);
+
+            uint64_t hash = 0xcbf29ce484222325ull;
+            const unsigned char *bytes = (const unsigned char *)film.data.data();
+            for (size_t i = 0; i < film.data.size() * sizeof(float); i++) {
+                hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+            }
+            if (threads == 1) {
+                first = hash;
+            }
+            same = same && hash == first;
+            char hex[17];
+            std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+            std::cout << names[mode] << threads << " threads: " << hex << std::endl;
+        }
+    }
+    std::cout << (same ? "identical" : "different") << std::endl;
+    return same;
+}
+
+// Renders the scene without the primary hit cache at two seeds and with it at
+// the first, and prints the rmse of the others against the first. The cache
+// puts every sample of a stratum at its center, which adds error at edges and
+// in textures on top of the noise between the seeds. Returns whether the
+// cached render is within 1.5 times that noise of the uncached one.
+bool runPrimaryHitCacheCheck(rt::Scene &scene, const rt::RenderOptions &options) {
+    rt::RenderOptions check = options;
+    check.adaptiveSampling = false;
+    check.timeBudget = 0;
+    check.primaryHitCache = false;
+    rt::Image uncached(options.horizontalResolution, options.verticalResolution);
+    rt::RenderContext context;
+    context.scene = &scene;
+    context.options = &check;
+    context.image = &uncached;
+    rt::rayTrace(context);
+
+    check.seed = options.seed + 1;
+    rt::Image reseeded(options.horizontalResolution, options.verticalResolution);
+    context.image = &reseeded;
+    rt::rayTrace(context);
+
+    check.seed = options.seed;
+    check.primaryHitCache = true;
+    rt::Image cached(options.horizontalResolution, options.verticalResolution);
+    rt::RenderStats stats;
+    context.image = &cached;
+    context.stats = &stats;
+    rt::rayTrace(context);
+
+    double noise = rt::rmse(reseeded, uncached);
+    double difference = rt::rmse(cached, uncached);
+    std::cout << "another seed: rmse " << noise << std::endl;
+    std::cout << "primary hit cache: rmse " << difference << ", " << stats.primaryHitsReused
+              << " intersections saved" << std::endl;
+    return difference <= 1.5 * noise;
+}
+
+// Renders the scene unpinned, pinned to numa nodes, and pinned with a copy of
+// the scene per node, printing the throughput of each
+void runNumaBenchmark(rt::Renderer &renderer, rt::Scene &scene, const rt::RenderOptions &options) {
+    const char *names[] = {"unpinned", "pinned", "pinned, scene per node"};
+    for (int mode = 0; mode < 3; mode++) {
+        rt::RenderOptions numa = options;
+        numa.numaPinning = mode > 0;
+        numa.numaReplicateScene = mode > 1;
+        rt::Image image(options.horizontalResolution, options.verticalResolution);
+        rt::RenderStats stats;
+        rt::RenderContext context;
+        context.scene = &scene;
+        context.options = &numa;
+        context.image = &image;
+        context.stats = &stats;
+        renderer.render(context);
+        std::cout << names[mode] << ": " << stats.seconds << " s, " << stats.raysPerSecond / 1e6 << " M rays/s";
+        if (mode > 1) {
+            std::cout << ", " << stats.replicaSeconds << " s copying";
+        }
+        std::cout << std::endl;
+    }
+}
+
+// Hands chunks of the image out to workers at address, spawning localWorkers
+// of them first as copies of this process, then writes the merged image to
+// my.pgm and prints how the chunks went. Only the first local worker gets
+// --worker-fail-after, so the others finish its chunks.
+int runCoordinator(const std::string &address, int localWorkers, int argc, const char * argv[],
+                   const rt::RenderOptions &options, int chunkSize, double timeout) {
+    std::vector<pid_t> workers;
+    for (int i = 0; i < localWorkers; i++) {
+        std::vector<std::string> workerArgs;
+        for (int a = 0; a < argc; a++) {
+            if (i > 0 && std::string(argv[a]) == "--worker-fail-after") {
+                a++;
+                continue;
+            }
+            workerArgs.push_back(argv[a]);
+        }
+        workerArgs.push_back("--worker");
+        workerArgs.push_back(address);
+        std::vector<char *> workerArgv;
+        for (auto &arg : workerArgs) {
+            workerArgv.push_back(&arg[0]);
+        }
+        workerArgv.push_back(nullptr);
+        pid_t pid;
+        if (posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, workerArgv.data(), environ) == 0) {
+            workers.push_back(pid);
+        } else {
+            std::cerr << "could not start local worker " << i << std::endl;
+        }
+    }
+
+    rt::Film film(options.horizontalResolution, options.verticalResolution);
+    rt::CoordinatorStats stats;
+    std::string err;
+    bool ok = rt::coordinate(address, film, chunkSize, timeout, &stats, err);
+    for (pid_t pid : workers) {
+        waitpid(pid, nullptr, 0);
+    }
+    if (!ok) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+
+    rt::Image image(options.horizontalResolution, options.verticalResolution);
+    film.develop(image);
+    std::ofstream out("my.pgm");
+    image.writeBinaryPgm(out);
+    std::cout << "rendered " << stats.chunks << " chunks on " << stats.workers << " workers in " << stats.seconds
+              << " s, " << stats.raysTraced / stats.seconds << " rays/s, " << stats.reissued << " reissued, "
+              << stats.workersLost << " workers lost" << std::endl;
+    return 0;
+}
+
+int main(int argc, const char * argv[]) {
+    auto args = parseArgs(argc, argv);
+
+
+    int lightCount = intArg(args, "lights", 0);
+    int sweepCount = intArg(args, "roughness-sweep", 0);
+    auto sceneStart = std::chrono::steady_clock::now();
+    tinygltf::Model model;
+    if (args.count("gltf")) {
+        std::string err;
+        if (!rt::loadGltf(args["gltf"], model, err)) {
+            std::cerr << "could not load " << args["gltf"] << ": " << err << std::endl;
+            return 1;
+        }
+    }
+    // one pool for loading, rendering, denoising and writing images
+    rt::Renderer renderer(intArg(args, "threads", 8));
+    rt::Scene scene = args.count("gltf") ? rt::Scene(model, &renderer.pool())
+            : lightCount > 0 ? rt::Scene::makeManyLights(lightCount)
+            : sweepCount > 0 ? rt::Scene::makeRoughnessSweep(sweepCount)
+            : args.count("product") ? rt::Scene::makeProductShot()
+            : args.count("opening") ? rt::Scene::makeSmallOpening() : rt::Scene();
+    if (args.count("env")) {
+        double scale = args.count("env-scale") ? std::stod(args["env-scale"]) : 1;
+        scene.environment.reset(new rt::EnvironmentMap);
+        if (!scene.environment->load(args["env"], scale)) {
+            std::cerr << "could not load environment " << args["env"] << std::endl;
+            return 1;
+        }
+    }
+    double sceneSeconds = elapsed(sceneStart);
+
+    if (args.count("bench-shading")) {
+        std::cout << rt::benchmarkShading(scene, 20000000) / 1e6 << " M shading evaluations/s" << std::endl;
+        return 0;
+    }
 
     rt::RenderOptions renderOptions;
     renderOptions.maxDepth = 20;
-    renderOptions.threadCount = 8;
-    renderOptions.horizontalResolution = 320;
-    renderOptions.verticalResolution = 320;
-    renderOptions.samplesPerPixel = 1000;
+    renderOptions.threadCount = intArg(args, "threads", 8);
+    renderOptions.horizontalResolution = intArg(args, "res", 320);
+    renderOptions.verticalResolution = intArg(args, "res", 320);
+    renderOptions.samplesPerPixel = intArg(args, "spp", 1000);
+    renderOptions.lightSampling = rt::LightSampling::LightBvh;
+    if (args.count("light-sampling")) {
+        const std::string &mode = args["light-sampling"];
+        renderOptions.lightSampling = mode == "none" ? rt::LightSampling::None
+                : mode == "uniform" ? rt::LightSampling::Uniform
+                : mode == "power" ? rt::LightSampling::Power : rt::LightSampling::LightBvh;
+    }
+    if (args.count("integrator")) {
+        renderOptions.integrator = args["integrator"] == "bdpt" ? rt::Integrator::Bidirectional
+                : rt::Integrator::Path;
+    }
+    renderOptions.pathGuiding = args.count("guiding") > 0;
+    renderOptions.causticPhotons = args.count("photons") > 0;
+    renderOptions.photonCount = intArg(args, "photons", 1000000);
+    renderOptions.irradianceCache = args.count("irradiance-cache") > 0;
+    renderOptions.pixelFilter = rt::PixelFilter::BlackmanHarris;
+    renderOptions.primaryHitCache = false;
+    renderOptions.adaptiveSampling = args.count("fixed") == 0;
+    renderOptions.minSamplesPerPixel = 32;
+    renderOptions.maxSamplesPerPixel = 4000;
+    renderOptions.adaptiveErrorThreshold = 0.02;
+    renderOptions.timeBudget = 0; // seconds, > 0 renders progressively
+    renderOptions.textureCacheBytes = (size_t)intArg(args, "texture-cache", 256) << 20;
+    renderOptions.tileSize = intArg(args, "tile-size", 16);
+    if (args.count("tile-order")) {
+        const std::string &order = args["tile-order"];
+        renderOptions.tileOrder = order == "morton" ? rt::TileOrder::Morton
+                : order == "hilbert" ? rt::TileOrder::Hilbert
+                : order == "spiral" ? rt::TileOrder::Spiral : rt::TileOrder::Rows;
+    }
+    renderOptions.zOrderPixels = args.count("z-order") > 0;
+    renderOptions.sampleParallel = args.count("sample-parallel") > 0;
+    renderOptions.interleavedPaths = intArg(args, "interleave", 1);
+    renderOptions.seed = intArg(args, "seed", 0);
+    renderOptions.countCacheMisses = args.count("cache-misses") > 0;
+    renderOptions.numaPinning = args.count("numa") > 0 || args.count("numa-replicate") > 0;
+    renderOptions.numaReplicateScene = args.count("numa-replicate") > 0;
+
+    renderOptions.environmentImportanceSampling = args.count("env-uniform") == 0;
+    if (args.count("env-benchmark") && scene.environment) {
+        runEnvironmentBenchmark(scene, renderOptions);
+        return 0;
+    }
+    if (args.count("integrator-benchmark")) {
+        double target = args.count("target-rmse") ? std::stod(args["target-rmse"]) : 0.02;
+        runIntegratorBenchmark(scene, renderOptions, target);
+        return 0;
+    }
+    if (args.count("light-sweep")) {
+        runLightSweep(renderOptions);
+        return 0;
+    }
+    if (args.count("tile-benchmark")) {
+        runTileBenchmark(scene, renderOptions);
+        return 0;
+    }
+    if (args.count("turntable") || args.count("views")) {
+        std::vector<rt::Camera> cameras = args.count("views") ? readViews(args["views"], scene.camera)
+                : turntable(scene.camera, intArg(args, "turntable", 8));
+        runBatch(renderer, scene, renderOptions, cameras, sceneSeconds, args.count("batch-compare") > 0);
+        return 0;
+    }
+    if (args.count("interleave-benchmark")) {
+        runInterleaveBenchmark(renderer, scene, renderOptions);
+        return 0;
+    }
+    if (args.count("async-benchmark")) {
+        runAsyncBenchmark(renderer, scene, renderOptions);
+        return 0;
+    }
+    if (args.count("order-benchmark")) {
+        runOrderBenchmark(renderer, scene, renderOptions);
+        return 0;
+    }
+    if (args.count("determinism-check")) {
+        return runDeterminismCheck(renderer, scene, renderOptions) ? 0 : 1;
+    }
+    if (args.count("hit-cache-check")) {
+        return runPrimaryHitCacheCheck(scene, renderOptions) ? 0 : 1;
+    }
+    if (args.count("distributed-check")) {
+        std::string err;
+        bool recovered = rt::checkCoordinator(err);
+        std::cout << (recovered ? "recovered" : err) << std::endl;
+        return recovered ? 0 : 1;
+    }
+    if (args.count("numa-benchmark")) {
+        const rt::NumaTopology &numa = rt::NumaTopology::get();
+        std::cout << numa.nodeCount() << " numa nodes, " << numa.cpus.size() << " cpus, from "
+                  << (numa.fromLibnuma ? "libnuma" : "sysfs") << std::endl;
+        runNumaBenchmark(renderer, scene, renderOptions);
+        return 0;
+    }
+    if (args.count("convergence")) {
+        runConvergence(scene, renderOptions);
+        return 0;
+    }
+
+    if (args.count("worker")) {
+        std::string err;
+        if (!rt::work(args["worker"], renderer, scene, renderOptions, err, 10,
+                      intArg(args, "worker-fail-after", -1))) {
+            std::cerr << "worker: " << err << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (args.count("coordinator")) {
+        double timeout = args.count("timeout") ? std::stod(args["timeout"]) : 60;
+        return runCoordinator(args["coordinator"], intArg(args, "local-workers", 0), argc, argv, renderOptions,
+                              intArg(args, "chunk-size", 64), timeout);
+    }
 
     rt::Image image(renderOptions.horizontalResolution, renderOptions.verticalResolution);
 
@@ -44,10 +730,130 @@ int main(int argc, const char * argv[]) {
     renderContext.options = &renderOptions;
     renderContext.image = &image;
 
-    rt::rayTrace(renderContext);
+    std::vector<int> sampleMap;
+    renderContext.sampleMap = &sampleMap;
 
-    std::ofstream out("my.pgm");
-    image.writeBinaryPgm(out);
+    rt::RenderStats stats;
+    renderContext.stats = &stats;
+
+    bool denoise = args.count("denoise") > 0;
+    rt::Film film(renderOptions.horizontalResolution, renderOptions.verticalResolution);
+    rt::FeatureBuffers features(renderOptions.horizontalResolution, renderOptions.verticalResolution);
+    if (denoise) {
+        renderContext.film = &film;
+        renderContext.features = &features;
+    }
+
+    renderer.render(renderContext);
+
+    std::cout << "rendered " << stats.samplesPerPixel << " spp in " << stats.passes << " passes, "
+              << stats.seconds << " s, " << stats.raysPerSecond << " rays/s" << std::endl;
+    if (stats.numaNodes > 0) {
+        std::cout << "pinned to " << stats.numaNodes << " numa nodes";
+        if (renderOptions.numaReplicateScene) {
+            std::cout << ", scene copied in " << stats.replicaSeconds << " s";
+        }
+        std::cout << std::endl;
+    }
+    if (stats.cacheMisses >= 0) {
+        std::cout << stats.cacheMisses << " cache misses" << std::endl;
+    }
+    std::cout << stats.tiles << " tiles, " << stats.tilesStolen << " stolen, thread utilization "
+              << utilization(stats) * 100 << "%" << std::endl;
+    if (args.count("thread-times")) {
+        for (size_t i = 0; i < stats.threadBusySeconds.size(); i++) {
+            std::cout << "thread " << i << " busy " << stats.threadBusySeconds[i] << " s, idle "
+                      << stats.threadIdleSeconds[i] << " s" << std::endl;
+        }
+    }
+    if (renderOptions.primaryHitCache) {
+        std::cout << "primary hit cache saved " << stats.primaryHitsReused << " intersections" << std::endl;
+    }
+    if (renderOptions.causticPhotons) {
+        std::cout << "photon map " << stats.photonsStored << " of " << stats.photonsEmitted << " photons stored in "
+                  << stats.photonSeconds << " s" << std::endl;
+    }
+    if (scene.textures) {
+        std::cout << "texture cache hit rate "
+                  << (double)stats.textureTileHits / std::max(1LL, stats.textureTileLookups) << ", "
+                  << stats.textureResidentBytes / 1048576.0 << " MB resident, "
+                  << stats.texturePeakBytes / 1048576.0 << " MB peak" << std::endl;
+    }
+    if (renderOptions.irradianceCache) {
+        std::cout << "irradiance cache " << stats.irradianceRecords << " records, hit rate "
+                  << (double)stats.irradianceHits / std::max(1LL, stats.irradianceLookups) << std::endl;
+        if (args.count("compare")) {
+            // same settings without the cache, compared by time per sample
+            rt::RenderOptions baselineOptions = renderOptions;
+            baselineOptions.irradianceCache = false;
+            rt::Image baselineImage(renderOptions.horizontalResolution, renderOptions.verticalResolution);
+            rt::RenderStats baselineStats;
+            rt::RenderContext baselineContext;
+            baselineContext.scene = &scene;
+            baselineContext.options = &baselineOptions;
+            baselineContext.image = &baselineImage;
+            baselineContext.stats = &baselineStats;
+            renderer.render(baselineContext);
+            double speedup = (baselineStats.seconds / baselineStats.samplesPerPixel)
+                    / (stats.seconds / stats.samplesPerPixel);
+            std::cout << "irradiance cache speedup " << speedup << "x" << std::endl;
+        }
+    }
+
+    // encoded on the pool while the reference is read and the film denoised
+    std::vector<std::future<void>> writes;
+    writes.push_back(renderer.pool().submit([&image]() {
+        std::ofstream out("my.pgm");
+        image.writeBinaryPgm(out);
+    }));
+
+    rt::Image reference(renderOptions.horizontalResolution, renderOptions.verticalResolution);
+    bool haveReference = false;
+    if (args.count("reference")) {
+        std::ifstream in(args["reference"], std::ios::binary);
+        haveReference = reference.readBinaryPgm(in);
+        if (!haveReference) {
+            std::cerr << "could not read reference " << args["reference"] << std::endl;
+        } else {
+            std::cout << "rmse " << rt::rmse(image, reference) << std::endl;
+        }
+    }
+
+    if (denoise) {
+        rt::DenoiseOptions denoiseOptions;
+        denoiseOptions.threadCount = renderOptions.threadCount;
+        denoiseOptions.pool = &renderer.pool();
+        rt::DenoiseStats denoiseStats;
+        rt::Film denoised(film.width, film.height);
+        rt::denoise(film, features, denoised, denoiseOptions, &denoiseStats);
+
+        rt::Image denoisedImage(film.width, film.height);
+        denoised.develop(denoisedImage);
+        std::ofstream denoisedOut("denoised.pgm");
+        denoisedImage.writeBinaryPgm(denoisedOut);
+
+        std::cout << "denoised in " << denoiseStats.seconds << " s" << std::endl;
+        if (haveReference) {
+            std::cout << "denoised rmse " << rt::rmse(denoisedImage, reference) << std::endl;
+        }
+    }
+
+    // samples per pixel, scaled so the most sampled pixel is white
+    int maxSamples = std::max(1, *std::max_element(sampleMap.begin(), sampleMap.end()));
+    rt::Image sampleImage(renderOptions.horizontalResolution, renderOptions.verticalResolution);
+    for (int r = 0; r < sampleImage.height; r++) {
+        for (int c = 0; c < sampleImage.width; c++) {
+            uint8_t v = 255 * sampleMap[r * sampleImage.width + c] / maxSamples;
+            sampleImage.pxAt(r, c).set(v, v, v);
+        }
+    }
+    writes.push_back(renderer.pool().submit([&sampleImage]() {
+        std::ofstream sppOut("spp.pgm");
+        sampleImage.writeBinaryPgm(sppOut);
+    }));
+    for (auto &write : writes) {
+        write.get();
+    }
 
     scene.getMatAtIdx(0);
 
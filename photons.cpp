@@ -0,0 +1,248 @@
+//
+// Caustic photon map.
+//
+
+#include "photons.h"
+#include "rt.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+#include <thread>
+
+using namespace rt;
+
+namespace {
+
+struct StoredPhoton {
+    Photon photon;
+    int pair;
+};
+
+void store(std::vector<StoredPhoton> &out, const HitRecord &hit, const Vector3d &power, int pair) {
+    StoredPhoton s;
+    for (int i = 0; i < 3; i++) {
+        s.photon.point[i] = hit.point[i];
+        s.photon.power[i] = power[i];
+        s.photon.normal[i] = hit.normal[i];
+    }
+    s.pair = pair;
+    out.push_back(s);
+}
+
+}
+
+uint32_t PhotonMap::hashCell(int x, int y, int z) const {
+    uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)z * 83492791u;
+    return h & (hashSize - 1);
+}
+
+void PhotonMap::build(const Scene &scene, const RenderOptions &options, ThreadPool *pool) {
+    photons.clear();
+    cellStart.clear();
+    radius = options.photonRadius;
+    emittedCount = 0;
+
+    // photons are aimed at the specular spheres (Jensen's projection maps);
+    // every (light, target) pair gets an equal share
+    targets.clear();
+    for (const auto &x : scene.objects) {
+        const auto *sphere = dynamic_cast<const Sphere*>(x.get());
+        if (sphere && scene.getMatAtIdx(sphere->matIdx).isSpecular()) {
+            targets.push_back(Target{sphere->point, sphere->radius});
+        }
+    }
+    int pairCount = scene.lights.size() * targets.size();
+    if (pairCount == 0 || options.photonCount <= 0) {
+        return;
+    }
+
+    const long long maxStored = options.photonMemoryCap / sizeof(Photon);
+    const long long chunk = 1024;
+    std::atomic<long long> nextPhoton(0);
+    std::atomic<long long> storedCount(0);
+    int threadCount = std::max(1, options.threadCount);
+    std::vector<std::vector<StoredPhoton>> threadPhotons(threadCount);
+
+    auto emit = [&](int tid) {
+        std::mt19937_64 eng(0x9e3779b97f4a7c15ull * (tid + 1));
+        std::uniform_real_distribution<double> urd(0, 1);
+        std::vector<StoredPhoton> &out = threadPhotons[tid];
+
+        while (storedCount.load(std::memory_order_relaxed) < maxStored) {
+            long long begin = nextPhoton.fetch_add(chunk);
+            if (begin >= options.photonCount) {
+                break;
+            }
+            long long end = std::min(begin + chunk, options.photonCount);
+            size_t before = out.size();
+
+            for (long long i = begin; i < end; i++) {
+                int pair = i % pairCount;
+                int lightIdx = pair / targets.size();
+                const Light &light = scene.lights[lightIdx];
+                const Target &target = targets[pair % targets.size()];
+
+                Vector3d x, n;
+                light.samplePoint(urd(eng), urd(eng), x, n);
+
+                Light cone;
+                cone.type = Light::SphereLight;
+                cone.p0 = target.center;
+                cone.radius = target.radius;
+                Vector3d d;
+                double conePdf;
+                if (!cone.sample(x, urd(eng), urd(eng), d, conePdf)) {
+                    continue;
+                }
+                double cosLight = n.dot(d);
+                if (light.type == Light::TriangleLight) {
+                    cosLight = std::fabs(cosLight);
+                }
+                if (cosLight <= 0) {
+                    continue;
+                }
+
+                // the first hit must be this target, seen from the light
+                // sample through the same surfaces a camera path would see
+                HitRecord hit = scene.findHit(Ray(x, d));
+                if (!hit.didHit || std::fabs((hit.point - target.center).norm() - target.radius) > 1e-6 * target.radius) {
+                    continue;
+                }
+                HitRecord back = scene.findHit(Ray(hit.point, -d));
+                if (!back.didHit || back.lightIdx != lightIdx) {
+                    continue;
+                }
+
+                Vector3d power = light.emission * (cosLight * light.area() / conePdf);
+                for (int depth = 1; depth <= options.maxDepth; depth++) {
+                    const Material &material = scene.getMatAtIdx(hit.matIdx);
+                    if (material.isEmissive) {
+                        break;
+                    }
+                    // only lambertian receivers gather photons
+                    if (!material.isSpecular()) {
+                        if (material.type == MaterialType::Dielectric) {
+                            store(out, hit, power, pair);
+                        }
+                        break;
+                    }
+                    Vector3d wo = -d;
+                    d = material.getScatterDir(wo, hit.normal);
+                    Vector3d weight = material.getBRDF(wo, d, hit.normal);
+                    power = Vector3d(power[0] * weight[0], power[1] * weight[1], power[2] * weight[2]);
+                    hit = scene.findHit(Ray(hit.point, d));
+                    if (!hit.didHit) {
+                        break;
+                    }
+                }
+            }
+            storedCount.fetch_add(out.size() - before, std::memory_order_relaxed);
+        }
+    };
+
+    if (pool) {
+        pool->run(threadCount, emit);
+    } else {
+        std::vector<std::thread> threads;
+        for (int tid = 0; tid < threadCount; tid++) {
+            threads.emplace_back(emit, tid);
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    // every chunk handed out was traced in full, so the memory cap can be
+    // overshot by up to a chunk per thread
+    emittedCount = std::min(nextPhoton.load(), options.photonCount);
+    std::vector<long long> pairEmitted(pairCount);
+    for (int p = 0; p < pairCount; p++) {
+        pairEmitted[p] = emittedCount / pairCount + (p < emittedCount % pairCount ? 1 : 0);
+    }
+
+    std::vector<Photon> all;
+    for (const auto &list : threadPhotons) {
+        for (const auto &s : list) {
+            Photon p = s.photon;
+            for (int i = 0; i < 3; i++) {
+                p.power[i] /= pairEmitted[s.pair];
+            }
+            all.push_back(p);
+        }
+    }
+    if (all.empty()) {
+        return;
+    }
+
+    // counting sort by cell hash so each cell's photons are contiguous
+    hashSize = 1;
+    while (hashSize < 2 * all.size()) {
+        hashSize <<= 1;
+    }
+    std::vector<uint32_t> hashes(all.size());
+    cellStart.assign(hashSize + 1, 0);
+    for (size_t i = 0; i < all.size(); i++) {
+        hashes[i] = hashCell((int)std::floor(all[i].point[0] / radius), (int)std::floor(all[i].point[1] / radius),
+                             (int)std::floor(all[i].point[2] / radius));
+        cellStart[hashes[i] + 1]++;
+    }
+    for (uint32_t h = 0; h < hashSize; h++) {
+        cellStart[h + 1] += cellStart[h];
+    }
+    photons.resize(all.size());
+    std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+    for (size_t i = 0; i < all.size(); i++) {
+        photons[fill[hashes[i]]++] = all[i];
+    }
+}
+
+bool PhotonMap::onTarget(const Vector3d &p) const {
+    for (const Target &target : targets) {
+        if (std::fabs((p - target.center).norm() - target.radius) <= 1e-6 * target.radius) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Vector3d PhotonMap::irradiance(const Vector3d &p, const Vector3d &n) const {
+    Vector3d sum;
+    if (photons.empty()) {
+        return sum;
+    }
+    int cx = (int)std::floor(p[0] / radius);
+    int cy = (int)std::floor(p[1] / radius);
+    int cz = (int)std::floor(p[2] / radius);
+    double r2 = radius * radius;
+
+    // a hash can repeat among the 27 neighbours, so visit each bucket once
+    uint32_t seen[27];
+    int seenCount = 0;
+    for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dz = -1; dz <= 1; dz++) {
+                uint32_t h = hashCell(cx + dx, cy + dy, cz + dz);
+                if (std::find(seen, seen + seenCount, h) != seen + seenCount) {
+                    continue;
+                }
+                seen[seenCount++] = h;
+                for (uint32_t i = cellStart[h]; i < cellStart[h + 1]; i++) {
+                    const Photon &ph = photons[i];
+                    double d0 = ph.point[0] - p[0];
+                    double d1 = ph.point[1] - p[1];
+                    double d2 = ph.point[2] - p[2];
+                    if (d0 * d0 + d1 * d1 + d2 * d2 > r2) {
+                        continue;
+                    }
+                    if (ph.normal[0] * n[0] + ph.normal[1] * n[1] + ph.normal[2] * n[2] < 0.9) {
+                        continue;
+                    }
+                    sum = sum + Vector3d(ph.power[0], ph.power[1], ph.power[2]);
+                }
+            }
+        }
+    }
+    return sum / (M_PI * r2);
+}
@@ -0,0 +1,61 @@
+//
+// Caustic photon map: photons shot from the lights through specular
+// surfaces, stored in a hashed grid for density estimation.
+//
+
+#ifndef PATH_TRACER_PHOTONS_H
+#define PATH_TRACER_PHOTONS_H
+
+#include <cstdint>
+#include <vector>
+
+#include "linalg.h"
+
+namespace rt {
+
+struct Scene;
+struct RenderOptions;
+class ThreadPool;
+
+struct Photon {
+    float point[3];
+    float power[3];
+    float normal[3]; // of the surface the photon landed on
+};
+
+class PhotonMap {
+public:
+    // traces options.photonCount photons on options.threadCount threads, of
+    // pool if given, storing at most options.photonMemoryCap bytes of photons
+    void build(const Scene &scene, const RenderOptions &options, ThreadPool *pool = nullptr);
+
+    // flux per unit area arriving within radius of p on a surface facing n
+    lin::Vector3d irradiance(const lin::Vector3d &p, const lin::Vector3d &n) const;
+
+    // whether p lies on one of the specular spheres the photons were aimed
+    // at; emission reached through them is the photon map's to estimate
+    bool onTarget(const lin::Vector3d &p) const;
+
+    bool empty() const { return photons.empty(); }
+    long long emitted() const { return emittedCount; }
+    size_t stored() const { return photons.size(); }
+
+private:
+    struct Target {
+        lin::Vector3d center;
+        double radius;
+    };
+
+    std::vector<Target> targets;
+    std::vector<Photon> photons; // sorted by grid cell
+    std::vector<uint32_t> cellStart; // indexed by cell hash, size hashSize + 1
+    uint32_t hashSize = 0;
+    double radius = 0;
+    long long emittedCount = 0;
+
+    uint32_t hashCell(int x, int y, int z) const;
+};
+
+}
+
+#endif //PATH_TRACER_PHOTONS_H
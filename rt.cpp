@@ -3,25 +3,55 @@
 //
 
 #include "rt.h"
+#include "affinity.h"
+#include "counters.h"
 
+#include <algorithm>
 #include <cmath>
 #include <thread>
-#include <random>
+#include <chrono>
+#include <functional>
+#include <typeinfo>
 
 using namespace rt;
 
+// PCG32 (O'Neill 2014): a 64-bit LCG state permuted into 32-bit outputs, with
+// one of 2^63 streams picked by the increment
 class RandomGenerator {
 private:
-    std::default_random_engine eng;
-    std::uniform_real_distribution<double> urd;
+    uint64_t state = 0x853c49e6748fea9bull;
+    uint64_t inc = 0xda3e39cb94b95bdbull;
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+        uint32_t rot = old >> 59;
+        return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    }
+
+    double urd() {
+        return 2 * getUniform() - 1;
+    }
 
 public:
-    RandomGenerator(): urd(-1,1){}
+    // distinct (key, stream) pairs give distinct, uncorrelated sequences
+    void seed(uint64_t key, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += key;
+        next();
+    }
+
+    double getUniform() {
+        return next() * 0x1p-32;
+    }
 
     Vector3d getRandomNormalVector() {
-        double a = urd(eng);
-        double b = urd(eng);
-        double c = urd(eng);
+        double a = urd();
+        double b = urd();
+        double c = urd();
         Vector3d vec(a, b, c);
         vec.normalize();
         return vec;
@@ -34,8 +64,24 @@ public:
         }
         return rvec;
     }
+
+    // pdf cos(theta) / pi
+    Vector3d getCosineWeightedVectorInHemisphere(const Vector3d &n) {
+        double r = std::sqrt(getUniform());
+        double phi = 2 * M_PI * getUniform();
+        double x = r * std::cos(phi);
+        double y = r * std::sin(phi);
+        double z = std::sqrt(std::max(0.0, 1 - x * x - y * y));
+
+        Vector3d t = std::fabs(n[0]) > 0.9 ? Vector3d(0, 1, 0) : Vector3d(1, 0, 0);
+        t = t - n * n.dot(t);
+        t.normalize();
+        Vector3d b = n.cross(t);
+        return t * x + b * y + n * z;
+    }
 };
-RandomGenerator randomGenerator = RandomGenerator();
+// one per thread, reseeded at the start of every pixel sample, see samplePixel
+thread_local RandomGenerator randomGenerator = RandomGenerator();
 
 //class RandomGenerator {
 //private:
@@ -78,69 +124,232 @@ Ray::Ray(const Vector3d &o, const Vector3d &d) : o(o), d(d) {}
 
 // ******************* Materials *******************
 
-Material *Material::makeFromGltfMaterial(const tinygltf::Material &m) {
+Material Material::makeFromGltfMaterial(const tinygltf::Material &m) {
     const auto pbr = m.pbrMetallicRoughness;
-    PbrMaterial *ret;
 
     if (pbr.extras.Has("emissiveFactor")) {
-        ret = new LightSource;
         const auto &x = pbr.extras.Get("emissiveFactor");
-        ret -> emissiveFactor[0] = x.Get(0).GetNumberAsDouble();
-        ret -> emissiveFactor[1] = x.Get(1).GetNumberAsDouble();
-        ret -> emissiveFactor[2] = x.Get(2).GetNumberAsDouble();
-        return ret;
+        return makeLightSource(Vector3d(
+                x.Get(0).GetNumberAsDouble(),
+                x.Get(1).GetNumberAsDouble(),
+                x.Get(2).GetNumberAsDouble()));
     }
-
-    if (pbr.metallicFactor > pbr.roughnessFactor) {
-        ret = new MetallicMaterial;
-    } else {
-        ret = new DielectricMaterial;
+    if (m.emissiveFactor.size() == 3 && m.emissiveFactor[0] + m.emissiveFactor[1] + m.emissiveFactor[2] > 0) {
+        double strength = 1;
+        auto ext = m.extensions.find("KHR_materials_emissive_strength");
+        if (ext != m.extensions.end() && ext->second.Has("emissiveStrength")) {
+            strength = ext->second.Get("emissiveStrength").GetNumberAsDouble();
+        }
+        return makeLightSource(Vector3d(m.emissiveFactor[0], m.emissiveFactor[1], m.emissiveFactor[2]) * strength);
     }
 
-    ret -> alpha = pbr.baseColorFactor[3];
-    ret->baseColor = Vector3d(
-            pbr.baseColorFactor[0],
-            pbr.baseColorFactor[1],
-            pbr.baseColorFactor[2]);
-    ret->doubleSided = m.doubleSided;
-    ret->name = m.name;
-    ret->metallicFactor = pbr.metallicFactor;
-    ret->roughnessFactor = pbr.roughnessFactor;
+    Material ret = makeMetallicRoughness(
+            Vector3d(pbr.baseColorFactor[0], pbr.baseColorFactor[1], pbr.baseColorFactor[2]),
+            pbr.metallicFactor, pbr.roughnessFactor);
+    ret.alpha = pbr.baseColorFactor[3];
+    ret.doubleSided = m.doubleSided;
+    return ret;
+}
 
-    if (pbr.extras.Has("emissiveFactor")) {
-        const auto &x = pbr.extras.Get("emissiveFactor");
-        ret -> emissiveFactor[0] = x.Get(0).GetNumberAsDouble();
-        ret -> emissiveFactor[1] = x.Get(1).GetNumberAsDouble();
-        ret -> emissiveFactor[2] = x.Get(2).GetNumberAsDouble();
+Material Material::makeDielectric(const Vector3d &baseColor) {
+    Material ret;
+    ret.baseColor = baseColor;
+    return ret;
+}
+
+Material Material::makeMetallic(const Vector3d &baseColor) {
+    Material ret;
+    ret.type = MaterialType::Metallic;
+    ret.baseColor = baseColor;
+    ret.metallicFactor = 1;
+    ret.roughnessFactor = 0;
+    return ret;
+}
+
+Material Material::makeMetallicRoughness(const Vector3d &baseColor, double metallic, double roughness) {
+    if (metallic >= 1 && roughness <= 0.01) {
+        return makeMetallic(baseColor);
     }
+    Material ret;
+    ret.type = MaterialType::MetallicRoughness;
+    ret.baseColor = baseColor;
+    ret.metallicFactor = std::min(1.0, std::max(0.0, metallic));
+    ret.roughnessFactor = std::min(1.0, std::max(0.0, roughness));
+    return ret;
+}
 
+Material Material::makeLightSource(const Vector3d &emission) {
+    Material ret;
+    ret.type = MaterialType::LightSource;
+    ret.isEmissive = true;
+    ret.emissiveFactor = emission;
     return ret;
 }
 
+// GGX microfacet model in the local frame of n, with alpha = roughness^2 and
+// the height correlated Smith masking function. Directions are sampled from
+// the distribution of visible normals (Heitz 2018), so the sample weight only
+// carries the masking of the incident direction.
+
+double ggxAlpha(double roughness) {
+    return std::max(1e-3, roughness * roughness);
+}
+
+double ggxD(double cosH, double alpha) {
+    double a2 = alpha * alpha;
+    double t = cosH * cosH * (a2 - 1) + 1;
+    return a2 / (M_PI * t * t);
+}
+
+double ggxLambda(double cosV, double alpha) {
+    double cos2 = cosV * cosV;
+    double tan2 = std::max(0.0, 1 - cos2) / std::max(cos2, 1e-12);
+    return (std::sqrt(1 + alpha * alpha * tan2) - 1) / 2;
+}
+
+// tangent frame around n
+void buildFrame(const Vector3d &n, Vector3d &t, Vector3d &b) {
+    t = std::fabs(n[0]) > 0.9 ? Vector3d(0, 1, 0) : Vector3d(1, 0, 0);
+    t = t - n * n.dot(t);
+    t.normalize();
+    b = n.cross(t);
+}
+
+// visible normal for the local view direction (x, y, z)
+Vector3d sampleGgxVisibleNormal(double x, double y, double z, double alpha, double u1, double u2) {
+    Vector3d vh(alpha * x, alpha * y, z);
+    vh.normalize();
+    double lensq = vh[0] * vh[0] + vh[1] * vh[1];
+    Vector3d t1 = lensq > 0 ? Vector3d(-vh[1], vh[0], 0) / std::sqrt(lensq) : Vector3d(1, 0, 0);
+    Vector3d t2 = vh.cross(t1);
+
+    double r = std::sqrt(u1);
+    double phi = 2 * M_PI * u2;
+    double p1 = r * std::cos(phi);
+    double p2 = r * std::sin(phi);
+    double s = 0.5 * (1 + vh[2]);
+    p2 = (1 - s) * std::sqrt(std::max(0.0, 1 - p1 * p1)) + s * p2;
+
+    Vector3d nh = t1 * p1 + t2 * p2 + vh * std::sqrt(std::max(0.0, 1 - p1 * p1 - p2 * p2));
+    Vector3d ne(alpha * nh[0], alpha * nh[1], std::max(0.0, nh[2]));
+    ne.normalize();
+    return ne;
+}
+
+double luminance(const Vector3d &c) {
+    return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
+Vector3d Material::specularColor() const {
+    return Vector3d(0.04, 0.04, 0.04) * (1 - metallicFactor) + baseColor * metallicFactor;
+}
 
-Vector3d MetallicMaterial::getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const {
-//    return d1.dot(d2) * baseColor;
-    return  baseColor;
+// chance of sampling the specular lobe instead of the lambertian one
+double Material::specularProbability() const {
+    double diffuse = luminance(baseColor) * (1 - metallicFactor);
+    double specular = luminance(specularColor());
+    return diffuse > 0 ? std::max(0.25, specular / (specular + diffuse)) : 1;
 }
 
-Vector3d MetallicMaterial::getScatterDir(const Vector3d &d1, const Vector3d &n) const {
-    return 2 * d1.dot(n) * n - d1;
+// brdf * cos of the metallic-roughness model
+Vector3d Material::evalMetallicRoughness(const Vector3d &wo, const Vector3d &wi, const Vector3d &n) const {
+    double cosO = wo.dot(n);
+    double cosI = wi.dot(n);
+    if (cosO <= 0 || cosI <= 0) {
+        return Vector3d();
+    }
+    Vector3d h = wo + wi;
+    h.normalize();
+    double alpha = ggxAlpha(roughnessFactor);
+    double schlick = std::pow(1 - std::max(0.0, wo.dot(h)), 5);
+    Vector3d f0 = specularColor();
+    Vector3d fresnel = f0 * (1 - schlick) + Vector3d(1, 1, 1) * schlick;
+    double g2 = 1 / (1 + ggxLambda(cosO, alpha) + ggxLambda(cosI, alpha));
+    Vector3d specular = fresnel * (ggxD(h.dot(n), alpha) * g2 / (4 * cosO));
+
+    Vector3d diffuse = baseColor * ((1 - metallicFactor) * cosI / M_PI);
+    for (int i = 0; i < 3; i++) {
+        diffuse[i] *= 1 - fresnel[i];
+    }
+    return specular + diffuse;
 }
 
-Vector3d DielectricMaterial::getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const {
-    return baseColor;
+// for a lambertian surface sampled with pdf cos / pi the sample weight is the
+// base color, for a mirror it is the base color along the reflection
+Vector3d Material::getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const {
+    switch (type) {
+        case MaterialType::Dielectric:
+        case MaterialType::Metallic:
+            return baseColor;
+        case MaterialType::MetallicRoughness: {
+            double pdf = getPdf(d1, d2, n);
+            return pdf > 0 ? evalMetallicRoughness(d1, d2, n) / pdf : Vector3d();
+        }
+        case MaterialType::LightSource:
+            return emissiveFactor;
+    }
+    return Vector3d();
 }
 
-Vector3d DielectricMaterial::getScatterDir(const Vector3d &d1, const Vector3d &n) const {
-    return randomGenerator.getRandomNormalVectorInHemisphere(n);
+Vector3d Material::getScatterDir(const Vector3d &d1, const Vector3d &n) const {
+    switch (type) {
+        case MaterialType::Dielectric:
+            return randomGenerator.getCosineWeightedVectorInHemisphere(n);
+        case MaterialType::Metallic:
+            return 2 * d1.dot(n) * n - d1;
+        case MaterialType::MetallicRoughness: {
+            if (randomGenerator.getUniform() >= specularProbability()) {
+                return randomGenerator.getCosineWeightedVectorInHemisphere(n);
+            }
+            Vector3d t, b;
+            buildFrame(n, t, b);
+            Vector3d m = sampleGgxVisibleNormal(d1.dot(t), d1.dot(b), d1.dot(n), ggxAlpha(roughnessFactor),
+                                                randomGenerator.getUniform(), randomGenerator.getUniform());
+            Vector3d h = t * m[0] + b * m[1] + n * m[2];
+            // may point below the surface, which the caller discards
+            return 2 * d1.dot(h) * h - d1;
+        }
+        case MaterialType::LightSource:
+            break;
+    }
+    return Vector3d();
 }
 
-Vector3d LightSource::getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const {
-    return emissiveFactor;
+double Material::getPdf(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const {
+    if (type == MaterialType::Dielectric) {
+        return std::max(0.0, d2.dot(n)) / M_PI;
+    }
+    if (type != MaterialType::MetallicRoughness) {
+        return 0;
+    }
+    double cosO = d1.dot(n);
+    double cosI = d2.dot(n);
+    if (cosO <= 0 || cosI <= 0) {
+        return 0;
+    }
+    Vector3d h = d1 + d2;
+    h.normalize();
+    double alpha = ggxAlpha(roughnessFactor);
+    // visible normal pdf D * G1(wo) * (wo.h) / cosO, times the 1 / (4 wo.h) of reflecting about h
+    double specular = ggxD(h.dot(n), alpha) / (1 + ggxLambda(cosO, alpha)) / (4 * cosO);
+    double ps = specularProbability();
+    return ps * specular + (1 - ps) * cosI / M_PI;
 }
 
-Vector3d LightSource::getScatterDir(const Vector3d &d1, const Vector3d &n) const {
-    return rt::Vector3d();
+Vector3d Material::getBrdfCos(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const {
+    double cosO = d1.dot(n);
+    double cosI = d2.dot(n);
+    if (cosO <= 0 || cosI <= 0) {
+        return Vector3d();
+    }
+    switch (type) {
+        case MaterialType::Dielectric:
+            return baseColor * (cosI / M_PI);
+        case MaterialType::MetallicRoughness:
+            return evalMetallicRoughness(d1, d2, n);
+        default:
+            return Vector3d();
+    }
 }
 
 // ******************* Object *******************
@@ -182,6 +391,8 @@ bool doesHitSurface(const Ray &r, const Vector3d &v0, const Vector3d &v1, const
     {
         hit.point = r.o + (r.d * t);
         hit.distance = t;
+        hit.uv[0] = u; // barycentrics until the mesh interpolates its texcoords
+        hit.uv[1] = v;
 //        hit.normal = edge1.cross(edge2); hit.normal.normalize();
         return true;
     }
@@ -189,22 +400,171 @@ bool doesHitSurface(const Ray &r, const Vector3d &v0, const Vector3d &v1, const
         return false;
 }
 
+void Mesh::build() {
+    bvh.clear();
+    if (primitives.empty()) {
+        return;
+    }
+
+    struct Item {
+        double min[3];
+        double max[3];
+        double centroid[3];
+    };
+    auto itemOf = [this](const Primitive &prim) {
+        Item item;
+        for (int a = 0; a < 3; a++) {
+            item.min[a] = INFINITY;
+            item.max[a] = -INFINITY;
+            for (int v = 0; v < 3; v++) {
+                item.min[a] = std::min(item.min[a], vertices[prim.vIndicies[v]][a]);
+                item.max[a] = std::max(item.max[a], vertices[prim.vIndicies[v]][a]);
+            }
+            item.centroid[a] = (item.min[a] + item.max[a]) / 2;
+        }
+        return item;
+    };
+
+    // median split on the largest centroid extent, leaves of up to 4 triangles
+    std::function<void(int, int)> buildNode = [&](int begin, int end) {
+        int nodeIdx = bvh.size();
+        bvh.push_back(BvhNode());
+        double cmin[3] = {INFINITY, INFINITY, INFINITY};
+        double cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+        BvhNode node;
+        for (int a = 0; a < 3; a++) {
+            node.min[a] = INFINITY;
+            node.max[a] = -INFINITY;
+        }
+        for (int i = begin; i < end; i++) {
+            Item item = itemOf(primitives[i]);
+            for (int a = 0; a < 3; a++) {
+                node.min[a] = std::min(node.min[a], item.min[a]);
+                node.max[a] = std::max(node.max[a], item.max[a]);
+                cmin[a] = std::min(cmin[a], item.centroid[a]);
+                cmax[a] = std::max(cmax[a], item.centroid[a]);
+            }
+        }
+
+        if (end - begin <= 4) {
+            node.start = begin;
+            node.count = end - begin;
+            bvh[nodeIdx] = node;
+            return;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis]) {
+                axis = a;
+            }
+        }
+        int mid = (begin + end) / 2;
+        std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end,
+                         [&](const Primitive &a, const Primitive &b) {
+            return itemOf(a).centroid[axis] < itemOf(b).centroid[axis];
+        });
+
+        buildNode(begin, mid);
+        node.start = bvh.size();
+        node.count = 0;
+        buildNode(mid, end);
+        bvh[nodeIdx] = node;
+    };
+    buildNode(0, primitives.size());
+}
+
+// slab test against the ray, accepting only hits nearer than tMax
+bool doesHitBox(const BvhNode &node, const Ray &ray, const double invD[3], double tMax) {
+    double t0 = 0;
+    double t1 = tMax;
+    for (int a = 0; a < 3; a++) {
+        double tNear = (node.min[a] - ray.o[a]) * invD[a];
+        double tFar = (node.max[a] - ray.o[a]) * invD[a];
+        if (tNear > tFar) {
+            std::swap(tNear, tFar);
+        }
+        t0 = std::max(t0, tNear);
+        t1 = std::min(t1, tFar);
+        if (t0 > t1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// tests primitive x of mesh, keeping it in hit if it is the nearest so far
+void hitPrimitive(const Mesh &mesh, int x, const Ray &ray, HitRecord &hit, bool &found, int &closest) {
+    const Primitive &prim = mesh.primitives[x];
+    const Vector3d &v0 = mesh.vertices[prim.vIndicies[0]];
+    const Vector3d &v1 = mesh.vertices[prim.vIndicies[1]];
+    const Vector3d &v2 = mesh.vertices[prim.vIndicies[2]];
+
+    HitRecord cur;
+    if ( doesHitSurface(ray, v0, v1, v2, cur) && (!found || cur.distance < hit.distance) ) {
+        found = true;
+        hit = cur;
+        hit.matIdx = prim.matIdx;
+        hit.lightIdx = prim.lightIdx;
+        hit.normal = calculateSurfaceNormal(ray, v0, v1, v2);
+        closest = x;
+    }
+}
+
+// turns the barycentrics doesHitSurface left in hit.uv into the texcoords of
+// primitive closest
+void interpolateTexcoords(const Mesh &mesh, int closest, HitRecord &hit) {
+    if (mesh.texcoords.empty()) {
+        return;
+    }
+    const Vector3i &idx = mesh.primitives[closest].vIndicies;
+    double b1 = hit.uv[0];
+    double b2 = hit.uv[1];
+    const double *t0 = &mesh.texcoords[idx[0] * 2];
+    const double *t1 = &mesh.texcoords[idx[1] * 2];
+    const double *t2 = &mesh.texcoords[idx[2] * 2];
+    hit.uv[0] = (1 - b1 - b2) * t0[0] + b1 * t1[0] + b2 * t2[0];
+    hit.uv[1] = (1 - b1 - b2) * t0[1] + b1 * t1[1] + b2 * t2[1];
+    double uvArea = std::fabs((t1[0] - t0[0]) * (t2[1] - t0[1]) - (t2[0] - t0[0]) * (t1[1] - t0[1]));
+    const std::vector<Vector3d> &vertices = mesh.vertices;
+    double area = (vertices[idx[1]] - vertices[idx[0]]).cross(vertices[idx[2]] - vertices[idx[0]]).norm();
+    hit.uvDensity = area > 0 ? uvArea / area : 0;
+}
+
 bool Mesh::doesHit(const Ray &ray, HitRecord &hit) const {
     bool doesHit = false;
-    HitRecord cur;
-    for (int x = 0; x < primitives.size(); x++) {
-        const Primitive &prim = primitives[x];
-        const Vector3d &v0 = vertices[prim.vIndicies[0]];
-        const Vector3d &v1 = vertices[prim.vIndicies[1]];
-        const Vector3d &v2 = vertices[prim.vIndicies[2]];
-
-        if ( doesHitSurface(ray, v0, v1, v2, cur) && (!doesHit || cur.distance < hit.distance) ) {
-            doesHit = true;
-            hit = cur;
-            hit.matIdx = prim.matIdx;
-            hit.normal = calculateSurfaceNormal(ray, v0, v1, v2);
+    int closest = -1;
+
+    if (bvh.empty()) {
+        for (int x = 0; x < (int)primitives.size(); x++) {
+            hitPrimitive(*this, x, ray, hit, doesHit, closest);
+        }
+    }
+
+    double invD[3] = {1 / ray.d[0], 1 / ray.d[1], 1 / ray.d[2]};
+    int stack[64];
+    int top = 0;
+    if (!bvh.empty()) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        const BvhNode &node = bvh[stack[--top]];
+        if (!doesHitBox(node, ray, invD, doesHit ? hit.distance : INFINITY)) {
+            continue;
+        }
+        if (node.count > 0) {
+            for (int x = node.start; x < node.start + node.count; x++) {
+                hitPrimitive(*this, x, ray, hit, doesHit, closest);
+            }
+        } else {
+            stack[top++] = node.start;
+            stack[top++] = &node - &bvh[0] + 1;
         }
     }
+
+    if (doesHit) {
+        interpolateTexcoords(*this, closest, hit);
+    }
     return doesHit;
 }
 
@@ -221,13 +581,20 @@ bool Sphere::doesHit(const Ray &ray, HitRecord &hit) const {
 
     if (dsq > 0) {
         double tval = projectLen - sqrt(dsq);
-        if (tval < 1e-9)
-            return false;
+        // rays from inside, such as light leaving the buried part of an
+        // emitter, hit the far side with the normal facing them
+        bool inside = tval < 1e-9;
+        if (inside) {
+            tval = projectLen + std::sqrt(dsq);
+            if (tval < 1e-9)
+                return false;
+        }
 
-        hit.point = ray.o + (projectLen - std::sqrt(dsq)) * ray.d;
+        hit.point = ray.o + tval * ray.d;
         hit.distance = (hit.point - ray.o).norm();
-        hit.normal = hit.point - point; hit.normal.normalize();
+        hit.normal = inside ? point - hit.point : hit.point - point; hit.normal.normalize();
         hit.matIdx = matIdx;
+        hit.lightIdx = lightIdx;
         return true;
     } else {
         return false;
@@ -241,18 +608,22 @@ void Camera::init() {
     hv = lv.cross(upVector); hv.normalize();
     vv = hv.cross(lv); vv.normalize();
     ipCpt = focalPoint + (lv * imagePlaneDistance);
-    planeWidth = abs(hB2 - hB1);
-    planeHeight = abs(vB2 - vB1);
+    planeWidth = std::fabs(hB2 - hB1);
+    planeHeight = std::fabs(vB2 - vB1);
 }
 
 Ray Camera::pixelRay(int r, int c, int hRes, int vRes) const {
+    return pixelRay((double)r, (double)c, hRes, vRes);
+}
+
+Ray Camera::pixelRay(double r, double c, int hRes, int vRes) const {
     double h_amt = 0;
     double v_amt = 0;
     if (hRes > 1) {
-        h_amt = hB1 + (double)c / (hRes - 1) * planeWidth;
+        h_amt = hB1 + c / (hRes - 1) * planeWidth;
     }
     if (vRes > 1) {
-        v_amt = vB2 - (double)r / (vRes - 1) * planeHeight;
+        v_amt = vB2 - r / (vRes - 1) * planeHeight;
     }
     Vector3d pxPoint = ipCpt + (hv * h_amt) + (vv * v_amt);
     Vector3d shoot = pxPoint - focalPoint; shoot.normalize();
@@ -262,51 +633,13 @@ Ray Camera::pixelRay(int r, int c, int hRes, int vRes) const {
 // ******************* Scene *******************
 
 
-Scene::Scene(const tinygltf::Model &m) {
-    using namespace tinygltf;
-}
-
 Scene::Scene() {
-    LightSource *m0 = new LightSource;
-    m0->emissiveFactor = Vector3d(3, 3, 3);
-//    m0->emissiveFactor *= 1000;
-
-    MetallicMaterial *m1= new MetallicMaterial;
-    m1->baseColor = Vector3d(0.9, 0.8, 0.7);
-    m1->metallicFactor = 1.0;
-    m1->roughnessFactor = 0.0;
-    m1->alpha = 0;
-
-    DielectricMaterial *m2= new DielectricMaterial;
-    m2->baseColor = Vector3d(0.9, 0.9, 0.9);
-    m2->metallicFactor = 1.0;
-    m2->roughnessFactor = 0.0;
-    m2->alpha = 0;
-
-    DielectricMaterial *m3= new DielectricMaterial;
-    m3->baseColor = Vector3d(0.3, 0.9, 0.3);
-    m3->metallicFactor = 1.0;
-    m3->roughnessFactor = 0.0;
-    m3->alpha = 0;
-
-    DielectricMaterial *m4= new DielectricMaterial;
-    m4->baseColor = Vector3d(0.9, 0.3, 0.3);
-    m4->metallicFactor = 1.0;
-    m4->roughnessFactor = 0.0;
-    m4->alpha = 0;
-
-    DielectricMaterial *m5= new DielectricMaterial;
-    m5->baseColor = Vector3d(0.3, 0.3, 0.9);
-    m5->metallicFactor = 1.0;
-    m5->roughnessFactor = 0.0;
-    m5->alpha = 0;
-
-//    DielectricMaterial *m2= new DielectricMaterial;
-//    m2->baseColor = Vector3d(0.6, 0.9, 0.9);
-//    m2->metallicFactor = 1.0;
-//    m2->roughnessFactor = 0.0;
-//    m2->alpha = 0;
-
+    materials.push_back(Material::makeLightSource(Vector3d(3, 3, 3)));
+    materials.push_back(Material::makeMetallic(Vector3d(0.9, 0.8, 0.7)));
+    materials.push_back(Material::makeDielectric(Vector3d(0.9, 0.9, 0.9)));
+    materials.push_back(Material::makeDielectric(Vector3d(0.3, 0.9, 0.3)));
+    materials.push_back(Material::makeDielectric(Vector3d(0.9, 0.3, 0.3)));
+    materials.push_back(Material::makeDielectric(Vector3d(0.3, 0.3, 0.9)));
 
     Sphere *s1 = new Sphere;
     s1->point = Vector3d(0,59.8,-20);
@@ -366,14 +699,6 @@ Scene::Scene() {
 //    s1->matIdx = 1;
 //
 
-    materials.push_back(std::unique_ptr<Material>(m0));
-    materials.push_back(std::unique_ptr<Material>(m1));
-    materials.push_back(std::unique_ptr<Material>(m2));
-    materials.push_back(std::unique_ptr<Material>(m3));
-    materials.push_back(std::unique_ptr<Material>(m4));
-    materials.push_back(std::unique_ptr<Material>(m5));
-
-
     objects.push_back(std::unique_ptr<Object>(s1));
     objects.push_back(std::unique_ptr<Object>(s2));
     objects.push_back(std::unique_ptr<Object>(s3));
@@ -395,13 +720,208 @@ Scene::Scene() {
     camera.hB1 = -1;
     camera.hB2 = 1;
     camera.init();
+
+    prepare();
+}
+
+Scene Scene::makeManyLights(int lightCount) {
+    Scene scene;
+    scene.objects.erase(scene.objects.begin()); // the ceiling light
+
+    // total emitted power stays the same as lightCount grows
+    int perRow = (int)std::ceil(std::sqrt((double)lightCount));
+    double side = std::min(0.3, 9.0 / perRow);
+    double area = side * side / 2;
+    int matIdx = scene.materials.size();
+    scene.materials.push_back(Material::makeLightSource(Vector3d(1, 1, 1) * (60.0 / (lightCount * area))));
+
+    Mesh *mesh = new Mesh;
+    for (int i = 0; i < lightCount; i++) {
+        double x = -9 + 18 * (i % perRow + 0.5) / perRow;
+        double z = -29 + 28 * (i / perRow + 0.5) / perRow;
+        int base = mesh->vertices.size();
+        mesh->vertices.push_back(Vector3d(x, 9.5, z));
+        mesh->vertices.push_back(Vector3d(x + side, 9.5, z));
+        mesh->vertices.push_back(Vector3d(x, 9.5, z + side));
+        Primitive prim;
+        prim.vIndicies[0] = base;
+        prim.vIndicies[1] = base + 1;
+        prim.vIndicies[2] = base + 2;
+        prim.matIdx = matIdx;
+        mesh->primitives.push_back(prim);
+    }
+    scene.objects.push_back(std::unique_ptr<Object>(mesh));
+
+    scene.prepare();
+    return scene;
+}
+
+Scene Scene::makeRoughnessSweep(int count) {
+    Scene scene;
+    // drop the two spheres, keeping the light and the walls
+    scene.objects.erase(scene.objects.end() - 1);
+    scene.objects.erase(scene.objects.begin() + 1);
+
+    double spacing = 18.0 / count;
+    for (int i = 0; i < count; i++) {
+        double roughness = count > 1 ? (double)i / (count - 1) : 0.5;
+        Sphere *sphere = new Sphere;
+        sphere->radius = std::min(3.0, spacing * 0.45);
+        sphere->point = Vector3d(-9 + spacing * (i + 0.5), -10 + sphere->radius, -25);
+        sphere->matIdx = scene.materials.size();
+        scene.materials.push_back(Material::makeMetallicRoughness(Vector3d(1.0, 0.78, 0.34), 1, roughness));
+        scene.objects.push_back(std::unique_ptr<Object>(sphere));
+    }
+
+    scene.prepare();
+    return scene;
+}
+
+Scene Scene::makeProductShot() {
+    Scene scene;
+    scene.objects.clear();
+    scene.materials.push_back(Material::makeMetallicRoughness(Vector3d(1.0, 0.78, 0.34), 1, 0.3));
+
+    Sphere *ground = new Sphere;
+    ground->point = Vector3d(0, -1010, -20);
+    ground->radius = 1000;
+    ground->matIdx = 2;
+
+    Sphere *mirror = new Sphere;
+    mirror->point = Vector3d(-6, -7, -24);
+    mirror->radius = 3;
+    mirror->matIdx = 1;
+
+    Sphere *gold = new Sphere;
+    gold->point = Vector3d(0, -7, -22);
+    gold->radius = 3;
+    gold->matIdx = scene.materials.size() - 1;
+
+    Sphere *diffuse = new Sphere;
+    diffuse->point = Vector3d(6, -7, -24);
+    diffuse->radius = 3;
+    diffuse->matIdx = 5;
+
+    scene.objects.push_back(std::unique_ptr<Object>(ground));
+    scene.objects.push_back(std::unique_ptr<Object>(mirror));
+    scene.objects.push_back(std::unique_ptr<Object>(gold));
+    scene.objects.push_back(std::unique_ptr<Object>(diffuse));
+
+    scene.prepare();
+    return scene;
+}
+
+Scene Scene::makeSmallOpening() {
+    Scene scene;
+    scene.objects.erase(scene.objects.begin()); // the ceiling light
+    // move the back wall from z = -30 to -40 to make room for the light
+    static_cast<Sphere*>(scene.objects[4].get())->point = Vector3d(0, 0, -1040);
+
+    Sphere *light = new Sphere;
+    light->point = Vector3d(0, 8, -36);
+    light->radius = 1;
+    light->matIdx = scene.materials.size();
+    scene.materials.push_back(Material::makeLightSource(Vector3d(1, 1, 1) * 400));
+    scene.objects.push_back(std::unique_ptr<Object>(light));
+
+    // a wall at z = -30 with a 3 x 3 hole above the middle
+    Mesh *wall = new Mesh;
+    auto addQuad = [wall](double x0, double y0, double x1, double y1) {
+        int base = wall->vertices.size();
+        wall->vertices.push_back(Vector3d(x0, y0, -30));
+        wall->vertices.push_back(Vector3d(x1, y0, -30));
+        wall->vertices.push_back(Vector3d(x1, y1, -30));
+        wall->vertices.push_back(Vector3d(x0, y1, -30));
+        for (int i = 0; i < 2; i++) {
+            Primitive prim;
+            prim.vIndicies[0] = base;
+            prim.vIndicies[1] = base + 1 + i;
+            prim.vIndicies[2] = base + 2 + i;
+            prim.matIdx = 2;
+            wall->primitives.push_back(prim);
+        }
+    };
+    // the curved walls bulge out of the room, the wall reaches into them
+    addQuad(-12, -12, -1.5, 12);
+    addQuad(1.5, -12, 12, 12);
+    addQuad(-1.5, -12, 1.5, 2);
+    addQuad(-1.5, 5, 1.5, 12);
+    scene.objects.push_back(std::unique_ptr<Object>(wall));
+
+    scene.prepare();
+    return scene;
+}
+
+Scene::Scene(const Scene &other)
+    : materials(other.materials), lights(other.lights), lightBvh(other.lightBvh), lightPower(other.lightPower),
+      camera(other.camera), textures(other.textures), environment(other.environment) {
+    for (const auto &x : other.objects) {
+        objects.push_back(x->clone());
+    }
+}
+
+void Scene::prepare(ThreadPool *pool) {
+    std::vector<Mesh*> meshes;
+    for (auto &x : objects) {
+        if (Mesh *mesh = dynamic_cast<Mesh*>(x.get())) {
+            meshes.push_back(mesh);
+        }
+    }
+    auto build = [&meshes](int i) { meshes[i]->build(); };
+    if (pool) {
+        pool->run(meshes.size(), build);
+    } else {
+        for (size_t i = 0; i < meshes.size(); i++) {
+            build(i);
+        }
+    }
+
+    lights.clear();
+    for (auto &x : objects) {
+        if (Mesh *mesh = dynamic_cast<Mesh*>(x.get())) {
+            for (auto &prim : mesh->primitives) {
+                prim.lightIdx = -1;
+                const Material &source = materials[prim.matIdx];
+                if (!source.isEmissive) {
+                    continue;
+                }
+                Light light;
+                light.type = Light::TriangleLight;
+                light.p0 = mesh->vertices[prim.vIndicies[0]];
+                light.p1 = mesh->vertices[prim.vIndicies[1]];
+                light.p2 = mesh->vertices[prim.vIndicies[2]];
+                light.emission = source.emissiveFactor;
+                prim.lightIdx = lights.size();
+                lights.push_back(light);
+            }
+        } else if (Sphere *sphere = dynamic_cast<Sphere*>(x.get())) {
+            sphere->lightIdx = -1;
+            const Material &source = materials[sphere->matIdx];
+            if (!source.isEmissive) {
+                continue;
+            }
+            Light light;
+            light.type = Light::SphereLight;
+            light.p0 = sphere->point;
+            light.radius = sphere->radius;
+            light.emission = source.emissiveFactor;
+            sphere->lightIdx = lights.size();
+            lights.push_back(light);
+        }
+    }
+    lightBvh.build(lights);
+    std::vector<double> power(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        power[i] = lights[i].power();
+    }
+    lightPower.build(power);
 }
 
 HitRecord Scene::findHit(const Ray &r) const {
     HitRecord hit;
-    HitRecord cur;
     for (const auto &x : objects) {
         const Object &object = *x;
+        HitRecord cur;
         if (object.doesHit(r, cur) && (!hit.didHit|| cur.distance < hit.distance) ) {
             hit = cur;
             hit.didHit = true;
@@ -410,102 +930,2141 @@ HitRecord Scene::findHit(const Ray &r) const {
     return hit;
 }
 
+// Scene::findHit as a state machine that a thread can advance for several
+// rays in turn. A step visits one bvh node and prefetches what the ray's next
+// step reads, so its cache misses are served while the thread works on the
+// other rays. A leaf takes three steps: its primitives, then their vertices
+// are prefetched before it is tested. The hit is the one findHit returns.
+struct RayQuery {
+    Ray ray = Ray(Vector3d(), Vector3d());
+    double invD[3];
+    HitRecord hit;
+    size_t object; // next in scene.objects to test, mesh while its bvh is walked
+    const Mesh *mesh; // null between objects
+    HitRecord meshHit; // nearest hit in mesh so far, as in Mesh::doesHit
+    bool meshFound;
+    int closest;
+    int stack[64];
+    int top;
+    int leaf; // node whose primitives are on their way, -1 for none
+    bool leafReady; // their vertices too
+
+    void begin(const Ray &r) {
+        ray = r;
+        for (int a = 0; a < 3; a++) {
+            invD[a] = 1 / r.d[a];
+        }
+        hit = HitRecord();
+        object = 0;
+        mesh = nullptr;
+    }
+
+    // true once hit is final
+    bool step(const Scene &scene) {
+        if (!mesh) {
+            // spheres and meshes without a bvh are tested in one go
+            for (; object < scene.objects.size(); object++) {
+                const Object &x = *scene.objects[object];
+                if (typeid(x) == typeid(Mesh) && !static_cast<const Mesh&>(x).bvh.empty()) {
+                    mesh = static_cast<const Mesh*>(&x);
+                    break;
+                }
+                HitRecord cur;
+                if (x.doesHit(ray, cur) && (!hit.didHit || cur.distance < hit.distance)) {
+                    hit = cur;
+                    hit.didHit = true;
+                }
+            }
+            if (!mesh) {
+                return true;
+            }
+            meshFound = false;
+            closest = -1;
+            top = 0;
+            stack[top++] = 0;
+            leaf = -1;
+            __builtin_prefetch(&mesh->bvh[0]);
+            return false;
+        }
+
+        const std::vector<BvhNode> &bvh = mesh->bvh;
+        if (leaf >= 0 && !leafReady) {
+            const BvhNode &node = bvh[leaf];
+            for (int x = node.start; x < node.start + node.count; x++) {
+                const Vector3i &idx = mesh->primitives[x].vIndicies;
+                for (int v = 0; v < 3; v++) {
+                    __builtin_prefetch(&mesh->vertices[idx[v]]);
+                }
+            }
+            leafReady = true;
+            return false;
+        }
+        if (leaf >= 0) {
+            const BvhNode &node = bvh[leaf];
+            for (int x = node.start; x < node.start + node.count; x++) {
+                hitPrimitive(*mesh, x, ray, meshHit, meshFound, closest);
+            }
+            leaf = -1;
+        } else {
+            const BvhNode &node = bvh[stack[--top]];
+            if (doesHitBox(node, ray, invD, meshFound ? meshHit.distance : INFINITY)) {
+                if (node.count > 0) {
+                    leaf = &node - &bvh[0];
+                    leafReady = false;
+                    __builtin_prefetch(&mesh->primitives[node.start]);
+                    __builtin_prefetch(&mesh->primitives[node.start + node.count - 1]);
+                    return false;
+                }
+                stack[top++] = node.start;
+                stack[top++] = &node - &bvh[0] + 1;
+            }
+        }
+        if (top > 0) {
+            __builtin_prefetch(&bvh[stack[top - 1]]);
+            return false;
+        }
+
+        if (meshFound && (!hit.didHit || meshHit.distance < hit.distance)) {
+            interpolateTexcoords(*mesh, closest, meshHit);
+            hit = meshHit;
+            hit.didHit = true;
+        }
+        mesh = nullptr;
+        object++;
+        return object == scene.objects.size();
+    }
+};
+
 const Material& Scene::getMatAtIdx(int matIdx) const {
-    return materials[matIdx].operator*();
+    return materials[matIdx];
+}
+
+int Scene::sampleLight(LightSampling mode, const Vector3d &p, const Vector3d &n, double u, double &pmf) const {
+    if (lights.empty()) {
+        return -1;
+    }
+    if (mode == LightSampling::LightBvh) {
+        return lightBvh.sample(p, n, u, pmf);
+    }
+    if (mode == LightSampling::Power) {
+        return lightPower.sample(u, pmf);
+    }
+    pmf = 1.0 / lights.size();
+    return std::min((int)(u * lights.size()), (int)lights.size() - 1);
+}
+
+double Scene::lightPmf(LightSampling mode, const Vector3d &p, const Vector3d &n, int lightIdx) const {
+    if (mode == LightSampling::LightBvh) {
+        return lightBvh.pmf(p, n, lightIdx);
+    }
+    if (mode == LightSampling::Power) {
+        return lightPower.empty() ? 0 : lightPower.pmf(lightIdx);
+    }
+    return 1.0 / lights.size();
+}
+
+double Scene::environmentPmf() const {
+    if (!environment) {
+        return 0;
+    }
+    return lights.empty() ? 1 : 0.5;
 }
 
 // ******************* Ray Tracing *******************
 
-Vector3d entrywiseProduct(Vector3d &v1, const Vector3d &v2) {
+Vector3d entrywiseProduct(const Vector3d &v1, const Vector3d &v2) {
     return Vector3d(
             v1[0] * v2[0],
             v1[1] * v2[1],
             v1[2] * v2[2]);
 }
 
-Vector3d traceRayHelper(const Scene &scene, const Ray&ray, int depth, int maxDepth) {
-    if (depth > maxDepth) {
-        return Vector3d(0,0,0);
-    }
+// per thread counters, collected into RenderStats by runThreads
+struct ThreadCounters {
+    long long raysTraced = 0;
+    long long primaryHitsReused = 0;
+    long long irradianceLookups = 0;
+    long long irradianceHits = 0;
+};
+thread_local ThreadCounters counters;
+
+// the vertex a bounce ray left from, used to weight emission it finds
+struct ScatterVertex {
+    Vector3d point;
+    Vector3d normal;
+    double pdf; // solid angle pdf of the sampled direction
+    bool specular;
+    bool lambertian; // the surface's caustics come from the photon map
+    bool causticChain; // specular bounces only since the last lambertian one
+    double coneWidth; // of the ray cone at the vertex
+    double coneSpread; // angle of the ray cone leaving the vertex
+};
 
-    HitRecord hit = scene.findHit(ray);
-    if (!hit.didHit) {
-        return Vector3d(0,0,0);
+const Camera &cameraOf(const RenderContext &ctx) {
+    return ctx.camera ? *ctx.camera : ctx.scene->camera;
+}
+
+// Ray cones (Akenine-Moller et al. 2019) for picking texture mip levels: a
+// camera ray is a pixel wide at the image plane and spreads by the pixel
+// angle, non-specular bounces widen the spread by their lobe width.
+double cameraConeSpread(const RenderContext &ctx) {
+    const Camera &camera = cameraOf(ctx);
+    return camera.planeHeight / std::max(1, ctx.options->verticalResolution - 1) / camera.imagePlaneDistance;
+}
+
+double coneSpreadAfter(const Material &material, double spread) {
+    switch (material.type) {
+        case MaterialType::Metallic:
+            return spread;
+        case MaterialType::MetallicRoughness:
+            return spread + material.roughnessFactor * material.roughnessFactor;
+        default:
+            return spread + 1;
     }
+}
 
+// the material at hit with its textures applied, filtered over the footprint
+// of a cone coneWidth wide
+const Material &shadingMaterial(const Scene &scene, const Ray &ray, const HitRecord &hit, double coneWidth,
+                                Material &textured) {
     const Material &material = scene.getMatAtIdx(hit.matIdx);
-    Vector3d incomingReversed = -ray.d;
+    if (material.baseColorTexture < 0 || hit.uvDensity <= 0 || !scene.textures) {
+        return material;
+    }
+    double cosine = std::max(0.05, std::fabs(ray.d.dot(hit.normal)));
+    double footprint = std::sqrt(hit.uvDensity) * coneWidth / cosine;
+    textured = material;
+    Vector3d texel = scene.textures->sample(material.baseColorTexture, hit.uv[0], hit.uv[1], footprint);
+    textured.baseColor = entrywiseProduct(textured.baseColor, texel);
+    return textured;
+}
 
-//    Vector3d reflectDir = 2 * incomingReversed.dot(hit.normal) * hit.normal - incomingReversed;
-//    Vector3d reflectDir = randomGenerator.getRandomNormalVectorInHemisphere(hit.normal);
-    Vector3d reflectDir = material.getScatterDir(incomingReversed, hit.normal);
+double powerHeuristic(double pdfA, double pdfB) {
+    double a = pdfA * pdfA;
+    double b = pdfB * pdfB;
+    return a + b > 0 ? a / (a + b) : 0;
+}
 
-    assert(reflectDir.dot(hit.normal) >= 0);
+Vector3d shadeHit(const RenderContext &ctx, const Ray &ray, const HitRecord &hit, int depth,
+                  const ScatterVertex *from = nullptr);
 
-    Vector3d brdf = material.getBRDF(incomingReversed, reflectDir, hit.normal);
+Vector3d traceRayHelper(const RenderContext &ctx, const Ray&ray, int depth, const ScatterVertex *from = nullptr) {
+    if (depth > ctx.options->maxDepth) {
+        return Vector3d(0,0,0);
+    }
+
+    counters.raysTraced++;
+    HitRecord hit = ctx.scene->findHit(ray);
+    return shadeHit(ctx, ray, hit, depth, from);
+}
 
-    if (dynamic_cast<const LightSource*>(&material)) {
-        return brdf;
+bool isGuided(const RenderContext &ctx, const Material &material) {
+    return ctx.guide && ctx.guide->isTrained() && !material.isSpecular();
+}
+
+// pdf of the bounce direction wi given the material's own pdf, mixing in the
+// path guide where it is used
+double scatterPdf(const RenderContext &ctx, const Material &material, const Vector3d &p, const Vector3d &wi,
+                  double bsdfPdf) {
+    if (!isGuided(ctx, material)) {
+        return bsdfPdf;
     }
+    double a = ctx.options->guidingFraction;
+    return a * ctx.guide->pdf(p, wi) + (1 - a) * bsdfPdf;
+}
 
-    Ray rayOut(hit.point, reflectDir);
-    Vector3d forwardResult = traceRayHelper(scene, rayOut, depth+1, maxDepth);
-    Vector3d ret = entrywiseProduct(brdf, forwardResult);
+// solid angle pdf of light sampling picking dir towards the environment
+double environmentPdf(const RenderContext &ctx, const Vector3d &dir) {
+    const Scene &scene = *ctx.scene;
+    double pdf = ctx.options->environmentImportanceSampling ? scene.environment->pdf(dir) : 1 / (4 * M_PI);
+    return scene.environmentPmf() * pdf;
+}
 
-    return ret;
+// radiance of the environment along a ray that missed, weighted against light
+// sampling when it was found by a bounce
+Vector3d environmentRadiance(const RenderContext &ctx, const Ray &ray, const ScatterVertex *from) {
+    const Scene &scene = *ctx.scene;
+    if (!scene.environment) {
+        return Vector3d();
+    }
+    Vector3d radiance = scene.environment->eval(ray.d);
+    if (ctx.options->lightSampling != LightSampling::None && from && !from->specular) {
+        radiance *= powerHeuristic(from->pdf, environmentPdf(ctx, ray.d));
+    }
+    return radiance;
 }
 
-Pixel traceRay(const RenderContext &ctx, const Ray &ray) {
+// a light sample for next event estimation: the radiance it adds if a shadow
+// ray along wi reaches light lightIdx, or escapes to the environment for -1
+struct LightSample {
+    Vector3d wi;
+    int lightIdx;
+    Vector3d radiance;
+};
 
-    Vector3d agg;
-    for (int sample = 0; sample < ctx.options->samplesPerPixel; sample++) {
-        Vector3d colorSample = traceRayHelper(*ctx.scene, ray, 1, ctx.options->maxDepth);
-        agg = agg + colorSample;
+bool sampleEnvironment(const RenderContext &ctx, const Material &material, const Vector3d &wo,
+                       const HitRecord &hit, LightSample &sample) {
+    const Scene &scene = *ctx.scene;
+    Vector3d wi;
+    double pdf;
+    if (ctx.options->environmentImportanceSampling) {
+        if (!scene.environment->sample(randomGenerator.getUniform(), randomGenerator.getUniform(),
+                                       randomGenerator.getUniform(), wi, pdf)) {
+            return false;
+        }
+    } else {
+        double z = 1 - 2 * randomGenerator.getUniform();
+        double r = std::sqrt(std::max(0.0, 1 - z * z));
+        double phi = 2 * M_PI * randomGenerator.getUniform();
+        wi = Vector3d(r * std::cos(phi), r * std::sin(phi), z);
+        pdf = 1 / (4 * M_PI);
+    }
+    double bsdfPdf = material.getPdf(wo, wi, hit.normal);
+    if (bsdfPdf <= 0) {
+        return false;
     }
-    Vector3d color = agg / ctx.options->samplesPerPixel;
 
-    // convert to 0-255
-    for (int i = 0; i < 3; i++) {
+    pdf *= scene.environmentPmf();
+    Vector3d f = material.getBRDF(wo, wi, hit.normal) * bsdfPdf;
+    double scattered = scatterPdf(ctx, material, hit.point, wi, bsdfPdf);
+    sample.wi = wi;
+    sample.lightIdx = -1;
+    sample.radiance = entrywiseProduct(f, scene.environment->eval(wi)) * (powerHeuristic(pdf, scattered) / pdf);
+    return true;
+}
 
-        double gammaAdjusted = pow(color[i], 0.5);
+// picks a light, or the environment, and a direction to it; false if the
+// sample carries nothing
+bool sampleLightDirection(const RenderContext &ctx, const Material &material, const Vector3d &wo,
+                          const HitRecord &hit, LightSample &sample) {
+    const Scene &scene = *ctx.scene;
+    double environmentPmf = scene.environmentPmf();
+    if (environmentPmf > 0 && randomGenerator.getUniform() < environmentPmf) {
+        return sampleEnvironment(ctx, material, wo, hit, sample);
+    }
 
-        double scaled = gammaAdjusted * 255.0;
+    double pmf;
+    int lightIdx = scene.sampleLight(ctx.options->lightSampling, hit.point, hit.normal,
+                                     randomGenerator.getUniform(), pmf);
+    if (lightIdx < 0) {
+        return false;
+    }
 
-        color[i] = std::max(0.0, std::min(255.0, std::round(scaled)));
+    Vector3d wi;
+    double pdf;
+    const Light &light = scene.lights[lightIdx];
+    if (!light.sample(hit.point, randomGenerator.getUniform(), randomGenerator.getUniform(), wi, pdf)) {
+        return false;
     }
-    return Pixel(color[0], color[1], color[2]);
+    double bsdfPdf = material.getPdf(wo, wi, hit.normal);
+    if (bsdfPdf <= 0) {
+        return false;
+    }
+
+    pdf *= pmf * (1 - environmentPmf);
+    // brdf * cos = sample weight * bsdf pdf
+    Vector3d f = material.getBRDF(wo, wi, hit.normal) * bsdfPdf;
+    double scattered = scatterPdf(ctx, material, hit.point, wi, bsdfPdf);
+    sample.wi = wi;
+    sample.lightIdx = lightIdx;
+    sample.radiance = entrywiseProduct(f, light.emission) * (powerHeuristic(pdf, scattered) / pdf);
+    return true;
 }
 
-struct Job {
-    const RenderContext *ctx;
-    int tid;
+// whether the shadow ray of sample, which found lightHit, gets through
+bool reachesLight(const LightSample &sample, const HitRecord &lightHit) {
+    if (sample.lightIdx < 0) {
+        return !lightHit.didHit;
+    }
+    return lightHit.didHit && lightHit.lightIdx == sample.lightIdx;
+}
 
-    Job(const RenderContext *ctx, int tid) :ctx(ctx), tid(tid) {}
+// next event estimation: radiance from a light sample at a diffuse hit,
+// weighted against BSDF sampling with the power heuristic
+Vector3d sampleDirect(const RenderContext &ctx, const Material &material, const Vector3d &wo, const HitRecord &hit) {
+    LightSample sample;
+    if (!sampleLightDirection(ctx, material, wo, hit, sample)) {
+        return Vector3d();
+    }
+    counters.raysTraced++;
+    if (!reachesLight(sample, ctx.scene->findHit(Ray(hit.point, sample.wi)))) {
+        return Vector3d();
+    }
+    return sample.radiance;
+}
 
-    void operator()() {
-        int hRes =ctx->options->horizontalResolution;
-        int vRes = ctx->options->verticalResolution;
+// Indirect irradiance at a diffuse hit from the cache, gathering a new record
+// from cosine weighted rays on a miss. The gather rays weight the emission
+// they find against light sampling as a bounce from hit would.
+Vector3d cachedIrradiance(const RenderContext &ctx, const HitRecord &hit, int depth) {
+    IrradianceCache &cache = *ctx.irradiance;
+    counters.irradianceLookups++;
+    Vector3d irradiance;
+    if (cache.lookup(hit.point, hit.normal, irradiance)) {
+        counters.irradianceHits++;
+        return irradiance;
+    }
 
-        for (int r = tid; r < vRes; r += ctx->options->threadCount) {
-            for (int c = 0; c < hRes; c++) {
-                ctx->image->pxAt(r,c) = traceRay(*ctx, ctx->scene->camera.pixelRay(r, c, hRes, vRes));
-            }
+    // gather with full paths: records built from other records would lose the
+    // bounces cut off by maxDepth and pass the loss on to every later lookup
+    RenderContext gatherCtx = ctx;
+    gatherCtx.irradiance = nullptr;
+
+    ScatterVertex vertex;
+    vertex.point = hit.point;
+    vertex.normal = hit.normal;
+    vertex.specular = false;
+    vertex.lambertian = true;
+    vertex.causticChain = false;
+    vertex.coneWidth = 0;
+    vertex.coneSpread = 1;
+
+    int rayCount = std::max(1, ctx.options->irradianceCacheRays);
+    double inverseDistances = 0;
+    for (int i = 0; i < rayCount; i++) {
+        Vector3d dir = randomGenerator.getCosineWeightedVectorInHemisphere(hit.normal);
+        vertex.pdf = std::max(0.0, dir.dot(hit.normal)) / M_PI;
+        Ray ray(hit.point, dir);
+        counters.raysTraced++;
+        HitRecord gathered = ctx.scene->findHit(ray);
+        if (gathered.didHit) {
+            inverseDistances += 1 / std::max(gathered.distance, 1e-6);
         }
+        irradiance = irradiance + shadeHit(gatherCtx, ray, gathered, depth + 1, &vertex);
     }
-};
+    // cosine weighted estimate of the integral of L cos over the hemisphere
+    irradiance = irradiance * (M_PI / rayCount);
+    double harmonic = inverseDistances > 0 ? rayCount / inverseDistances : cache.maxSpacing;
+    cache.insert(hit.point, hit.normal, irradiance, harmonic);
+    return irradiance;
+}
 
-void rt::rayTrace(const RenderContext &ctx) {
-    int tc = ctx.options->threadCount;
-    std::thread *threads[tc];
-    for (int tid = 0; tid < tc; tid++) {
-        std::thread *tp = new std::thread(Job(&ctx, tid));
-        threads[tid] = tp;
+// width of the ray cone at hit
+double coneWidthAt(const RenderContext &ctx, const HitRecord &hit, const ScatterVertex *from) {
+    return from ? from->coneWidth + from->coneSpread * hit.distance
+            : cameraConeSpread(ctx) * (cameraOf(ctx).imagePlaneDistance + hit.distance);
+}
+
+bool samplesLights(const RenderContext &ctx) {
+    const Scene &scene = *ctx.scene;
+    return ctx.options->lightSampling != LightSampling::None && (!scene.lights.empty() || scene.environment);
+}
+
+// radiance of a light source hit along ray, emission being its brdf,
+// weighted against light sampling when a bounce found it
+Vector3d emittedRadiance(const RenderContext &ctx, const Ray &ray, const HitRecord &hit, const ScatterVertex *from,
+                         Vector3d emission) {
+    const Scene &scene = *ctx.scene;
+    const RenderOptions &opt = *ctx.options;
+    // caustics through the photons' targets come from the photon map instead
+    if (ctx.photons && from && from->causticChain && ctx.photons->onTarget(from->point)) {
+        return Vector3d();
     }
-    for (auto thread : threads)
-    {
-        thread->join();
-        delete thread;
+    if (samplesLights(ctx) && from && !from->specular && hit.lightIdx >= 0) {
+        double lightPdf = scene.lightPmf(opt.lightSampling, from->point, from->normal, hit.lightIdx)
+                * (1 - scene.environmentPmf()) * scene.lights[hit.lightIdx].pdf(ray, hit);
+        emission *= powerHeuristic(from->pdf, lightPdf);
+    }
+    return emission;
+}
+
+// the caustics the photon map has for a hit
+Vector3d photonRadiance(const RenderContext &ctx, const Material &material, const Vector3d &wo,
+                        const HitRecord &hit) {
+    // the estimate is lambertian, glossy hits keep their caustic paths instead
+    if (!ctx.photons || material.type != MaterialType::Dielectric) {
+        return Vector3d();
+    }
+    // brdf = sample weight * pdf / cos, taken along the normal
+    Vector3d f = material.getBRDF(wo, hit.normal, hit.normal) * material.getPdf(wo, hit.normal, hit.normal);
+    return entrywiseProduct(f, ctx.photons->irradiance(hit.point, hit.normal));
+}
+
+// the vertex a bounce from hit leaves, pdf being that of its direction
+ScatterVertex scatterVertex(const RenderContext &ctx, const Material &material, const HitRecord &hit,
+                            const ScatterVertex *from, double coneWidth, double pdf) {
+    ScatterVertex vertex;
+    vertex.point = hit.point;
+    vertex.normal = hit.normal;
+    vertex.pdf = pdf;
+    vertex.specular = material.isSpecular();
+    vertex.lambertian = material.type == MaterialType::Dielectric;
+    vertex.causticChain = vertex.specular && from && (from->specular ? from->causticChain : from->lambertian);
+    vertex.coneWidth = coneWidth;
+    vertex.coneSpread = coneSpreadAfter(material, from ? from->coneSpread : cameraConeSpread(ctx));
+    return vertex;
+}
+
+Vector3d shadeHit(const RenderContext &ctx, const Ray &ray, const HitRecord &hit, int depth,
+                  const ScatterVertex *from) {
+    if (!hit.didHit) {
+        return environmentRadiance(ctx, ray, from);
+    }
+
+    const Scene &scene = *ctx.scene;
+    const RenderOptions &opt = *ctx.options;
+    double coneWidth = coneWidthAt(ctx, hit, from);
+    Material textured;
+    const Material &material = shadingMaterial(scene, ray, hit, coneWidth, textured);
+    Vector3d incomingReversed = -ray.d;
+
+    bool guided = isGuided(ctx, material);
+
+//    Vector3d reflectDir = 2 * incomingReversed.dot(hit.normal) * hit.normal - incomingReversed;
+//    Vector3d reflectDir = randomGenerator.getRandomNormalVectorInHemisphere(hit.normal);
+    Vector3d reflectDir;
+    if (guided && randomGenerator.getUniform() < opt.guidingFraction) {
+        reflectDir = ctx.guide->sample(hit.point, randomGenerator.getUniform(), randomGenerator.getUniform());
+    } else {
+        reflectDir = material.getScatterDir(incomingReversed, hit.normal);
+    }
+
+    Vector3d brdf = material.getBRDF(incomingReversed, reflectDir, hit.normal);
+
+    if (material.isEmissive) {
+        return emittedRadiance(ctx, ray, hit, from, brdf);
+    }
+
+    Vector3d direct;
+    if (samplesLights(ctx) && !material.isSpecular() && depth < opt.maxDepth) {
+        direct = sampleDirect(ctx, material, incomingReversed, hit);
+    }
+    direct = direct + photonRadiance(ctx, material, incomingReversed, hit);
+    // glossy lobes are too narrow to interpolate, only lambertian hits are cached
+    if (ctx.irradiance && from && !from->specular && material.type == MaterialType::Dielectric
+        && depth < opt.maxDepth) {
+        Vector3d f = material.getBRDF(incomingReversed, hit.normal, hit.normal)
+                * material.getPdf(incomingReversed, hit.normal, hit.normal);
+        return direct + entrywiseProduct(f, cachedIrradiance(ctx, hit, depth));
+    }
+
+    double bsdfPdf = material.getPdf(incomingReversed, reflectDir, hit.normal);
+    ScatterVertex vertex = scatterVertex(ctx, material, hit, from, coneWidth,
+                                         scatterPdf(ctx, material, hit.point, reflectDir, bsdfPdf));
+
+    // a direction below the surface carries nothing
+    if (reflectDir.dot(hit.normal) <= 0 || (guided && (bsdfPdf <= 0 || vertex.pdf <= 0))) {
+        return direct;
+    }
+    if (guided) {
+        brdf *= bsdfPdf / vertex.pdf;
+    }
+
+    Ray rayOut(hit.point, reflectDir);
+    Vector3d forwardResult = traceRayHelper(ctx, rayOut, depth+1, &vertex);
+    Vector3d ret = direct + entrywiseProduct(brdf, forwardResult);
+
+    if (ctx.guide && ctx.guide->isTraining() && !vertex.specular && vertex.pdf > 0) {
+        double incident = 0.2126 * forwardResult[0] + 0.7152 * forwardResult[1] + 0.0722 * forwardResult[2];
+        ctx.guide->record(hit.point, reflectDir, incident / vertex.pdf);
+    }
+
+    return ret;
+}
+
+// A camera path of the path integrator as state that can be put aside
+// between its rays, so that a thread keeps several in flight, see
+// samplePixels. It is shadeHit unrolled into a loop: the throughput of the
+// bounces so far scales what each vertex adds, and the shadow ray of a vertex
+// is traced before its bounce. Path guiding and the irradiance cache are left
+// to the recursive integrator.
+struct PathState {
+    RandomGenerator random; // swapped in while the path is shaded
+    RayQuery query;
+    Ray ray = Ray(Vector3d(), Vector3d()); // the bounce the path goes on with
+    int depth; // of ray, as in traceRayHelper
+    ScatterVertex from; // the vertex ray leaves, for depth > 1
+    Vector3d beta; // throughput of the bounces before ray
+    Vector3d radiance;
+    bool shadow; // query is the shadow ray of light, ray waits behind it if bounce
+    bool bounce;
+    LightSample light; // its radiance scaled by beta
+    int sample = -1; // of the pixel's samples being traced, -1 for a free slot
+    double weight;
+
+    void start(const Ray &cameraRay) {
+        random = randomGenerator;
+        ray = cameraRay;
+        depth = 1;
+        beta = Vector3d(1, 1, 1);
+        radiance = Vector3d();
+        shadow = false;
+        counters.raysTraced++;
+        query.begin(ray);
+    }
+
+    // Goes on from the hit of the finished query: adds what the vertex
+    // contributes and starts the path's next ray. False once the path is done.
+    bool advance(const RenderContext &ctx) {
+        if (shadow) {
+            shadow = false;
+            if (reachesLight(light, query.hit)) {
+                radiance = radiance + light.radiance;
+            }
+            if (!bounce) {
+                return false;
+            }
+            counters.raysTraced++;
+            query.begin(ray);
+            return true;
+        }
+
+        const ScatterVertex *last = depth > 1 ? &from : nullptr;
+        const HitRecord &hit = query.hit;
+        if (!hit.didHit) {
+            radiance = radiance + entrywiseProduct(beta, environmentRadiance(ctx, ray, last));
+            return false;
+        }
+
+        const RenderOptions &opt = *ctx.options;
+        std::swap(random, randomGenerator);
+        double coneWidth = coneWidthAt(ctx, hit, last);
+        Material textured;
+        const Material &material = shadingMaterial(*ctx.scene, ray, hit, coneWidth, textured);
+        Vector3d wo = -ray.d;
+        Vector3d dir = material.getScatterDir(wo, hit.normal);
+        Vector3d brdf = material.getBRDF(wo, dir, hit.normal);
+        if (material.isEmissive) {
+            radiance = radiance + entrywiseProduct(beta, emittedRadiance(ctx, ray, hit, last, brdf));
+            std::swap(random, randomGenerator);
+            return false;
+        }
+
+        shadow = samplesLights(ctx) && !material.isSpecular() && depth < opt.maxDepth
+                && sampleLightDirection(ctx, material, wo, hit, light);
+        radiance = radiance + entrywiseProduct(beta, photonRadiance(ctx, material, wo, hit));
+        std::swap(random, randomGenerator);
+        if (shadow) {
+            light.radiance = entrywiseProduct(beta, light.radiance);
+        }
+
+        // a direction below the surface carries nothing
+        bounce = dir.dot(hit.normal) > 0 && depth < opt.maxDepth;
+        Vector3d point = hit.point;
+        if (bounce) {
+            from = scatterVertex(ctx, material, hit, last, coneWidth, material.getPdf(wo, dir, hit.normal));
+            beta = entrywiseProduct(beta, brdf);
+            ray = Ray(point, dir);
+            depth++;
+        }
+        if (!shadow && !bounce) {
+            return false;
+        }
+        counters.raysTraced++;
+        query.begin(shadow ? Ray(point, light.wi) : ray);
+        return true;
+    }
+};
+
+Pixel toPixel(Vector3d color) {
+    // convert to 0-255
+    for (int i = 0; i < 3; i++) {
+
+        double gammaAdjusted = pow(color[i], 0.5);
+
+        double scaled = gammaAdjusted * 255.0;
+
+        color[i] = std::max(0.0, std::min(255.0, std::round(scaled)));
+    }
+    return Pixel(color[0], color[1], color[2]);
+}
+
+// ******************* Bidirectional Path Tracing *******************
+
+// A vertex of a camera or light subpath. pdfFwd is the area density of
+// sampling the vertex from its predecessor on its own subpath, pdfRev that of
+// sampling it from its successor, as the other subpath would have.
+struct PathVertex {
+    enum Type {
+        CameraVertex,
+        LightVertex, // a point sampled on a light, the start of a light subpath
+        SurfaceVertex
+    };
+
+    Type type;
+    Vector3d point;
+    Vector3d normal;
+    Material material;
+    int lightIdx = -1; // of a light vertex, or of the emitter a surface vertex hit
+    Vector3d beta; // throughput of the subpath up to the vertex
+    bool delta = false; // scattered by a perfect mirror
+    double pdfFwd = 0;
+    double pdfRev = 0;
+};
+
+// solid angle density at from converted to area density at to
+double toAreaPdf(double pdf, const PathVertex &from, const PathVertex &to) {
+    Vector3d w = to.point - from.point;
+    double d2 = w.dot(w);
+    if (d2 == 0) {
+        return 0;
+    }
+    if (to.type != PathVertex::CameraVertex) {
+        pdf *= std::fabs(to.normal.dot(w)) / std::sqrt(d2);
+    }
+    return pdf / d2;
+}
+
+// lights emit cosine weighted, triangles from both sides
+double emissionPdf(const Light &light, const Vector3d &normal, const Vector3d &w) {
+    double cosine = normal.dot(w);
+    if (light.type == Light::TriangleLight) {
+        return std::fabs(cosine) / (2 * M_PI);
+    }
+    return std::max(0.0, cosine) / M_PI;
+}
+
+// area density of a light subpath starting at v, which is on a light
+double lightOriginPdf(const Scene &scene, const PathVertex &v) {
+    if (v.lightIdx < 0 || scene.lightPower.empty()) {
+        return 0;
+    }
+    return scene.lightPower.pmf(v.lightIdx) / scene.lights[v.lightIdx].area();
+}
+
+// area density at next of v scattering light from prev towards it, or of v
+// emitting towards next when prev is null
+double vertexPdf(const Scene &scene, const PathVertex &v, const PathVertex *prev, const PathVertex &next) {
+    Vector3d wn = next.point - v.point;
+    wn.normalize();
+    double pdf;
+    if (!prev) {
+        pdf = v.lightIdx >= 0 ? emissionPdf(scene.lights[v.lightIdx], v.normal, wn) : 0;
+    } else {
+        Vector3d wp = prev->point - v.point;
+        wp.normalize();
+        pdf = v.material.getPdf(wp, wn, v.normal);
+    }
+    return toAreaPdf(pdf, v, next);
+}
+
+// Extends path by BSDF sampled bounces until it holds maxVertices vertices,
+// escapes, hits an emitter or is ended by russian roulette. ray leaves the last vertex with solid angle
+// density pdf and beta is the throughput along it. Camera subpaths pass
+// escaped to receive the environment radiance their last ray finds.
+void randomWalk(const RenderContext &ctx, Ray ray, Vector3d beta, double pdf, int maxVertices,
+                std::vector<PathVertex> &path, Vector3d *escaped = nullptr) {
+    const Scene &scene = *ctx.scene;
+    while ((int)path.size() < maxVertices) {
+        counters.raysTraced++;
+        HitRecord hit = scene.findHit(ray);
+        if (!hit.didHit) {
+            if (escaped && scene.environment) {
+                *escaped = entrywiseProduct(beta, scene.environment->eval(ray.d));
+            }
+            return;
+        }
+
+        PathVertex v;
+        v.type = PathVertex::SurfaceVertex;
+        v.point = hit.point;
+        v.normal = hit.normal;
+        Material textured;
+        v.material = shadingMaterial(scene, ray, hit, 0, textured);
+        v.lightIdx = hit.lightIdx;
+        v.beta = beta;
+        v.pdfFwd = toAreaPdf(pdf, path.back(), v);
+        path.push_back(v);
+        if (v.material.isEmissive) {
+            return;
+        }
+
+        PathVertex &cur = path.back();
+        Vector3d wo = -ray.d;
+        Vector3d wi = cur.material.getScatterDir(wo, cur.normal);
+        if (wi.dot(cur.normal) <= 0) {
+            return;
+        }
+        double pdfRev = 0;
+        if (cur.material.isSpecular()) {
+            // densities of 0 mark the bounce as specular in the MIS weights
+            cur.delta = true;
+            pdf = 0;
+        } else {
+            pdf = cur.material.getPdf(wo, wi, cur.normal);
+            pdfRev = cur.material.getPdf(wi, wo, cur.normal);
+            if (pdf <= 0) {
+                return;
+            }
+        }
+        Vector3d weight = cur.material.getBRDF(wo, wi, cur.normal);
+        // after a few bounces, russian roulette ends paths that carry little
+        if (path.size() > 3) {
+            double survive = std::min(1.0, std::max(weight[0], std::max(weight[1], weight[2])));
+            if (randomGenerator.getUniform() >= survive) {
+                return;
+            }
+            weight = weight / survive;
+        }
+        beta = entrywiseProduct(beta, weight);
+        path[path.size() - 2].pdfRev = toAreaPdf(pdfRev, cur, path[path.size() - 2]);
+        ray = Ray(cur.point, wi);
+    }
+}
+
+// picks a light in proportion to its power and a point on it, returning false
+// if the scene has no lights
+bool sampleLightVertex(const Scene &scene, PathVertex &v) {
+    double pmf;
+    int lightIdx = scene.lightPower.sample(randomGenerator.getUniform(), pmf);
+    if (lightIdx < 0) {
+        return false;
+    }
+    const Light &light = scene.lights[lightIdx];
+    v.type = PathVertex::LightVertex;
+    light.samplePoint(randomGenerator.getUniform(), randomGenerator.getUniform(), v.point, v.normal);
+    v.lightIdx = lightIdx;
+    v.pdfFwd = pmf / light.area();
+    v.beta = light.emission / v.pdfFwd;
+    return true;
+}
+
+void traceLightPath(const RenderContext &ctx, std::vector<PathVertex> &path) {
+    const Scene &scene = *ctx.scene;
+    PathVertex origin;
+    if (!sampleLightVertex(scene, origin)) {
+        return;
+    }
+    path.push_back(origin);
+
+    const Light &light = scene.lights[origin.lightIdx];
+    Vector3d side = origin.normal;
+    if (light.type == Light::TriangleLight && randomGenerator.getUniform() < 0.5) {
+        side = -side;
+    }
+    Vector3d w = randomGenerator.getCosineWeightedVectorInHemisphere(side);
+    double pdf = emissionPdf(light, origin.normal, w);
+    if (pdf <= 0) {
+        return;
+    }
+    Vector3d beta = origin.beta * (std::fabs(origin.normal.dot(w)) / pdf);
+    randomWalk(ctx, Ray(origin.point, w), beta, pdf, ctx.options->maxDepth, path);
+}
+
+bool mutuallyVisible(const Scene &scene, const Vector3d &a, const Vector3d &b) {
+    Vector3d d = b - a;
+    double dist = d.norm();
+    counters.raysTraced++;
+    HitRecord hit = scene.findHit(Ray(a, d / dist));
+    return !hit.didHit || hit.distance > dist * (1 - 1e-6);
+}
+
+// a density of 0 stands for a specular bounce, which cancels out of the ratios
+double remapZero(double pdf) {
+    return pdf != 0 ? pdf : 1;
+}
+
+// Power heuristic weight of connecting the first s light subpath vertices to
+// the first t camera subpath vertices, against every other way of sampling
+// the same path with t >= 2. The light vertex of s = 1 is sampled, not taken
+// from the light subpath.
+double bidirectionalWeight(const Scene &scene, std::vector<PathVertex> &lightPath,
+                           std::vector<PathVertex> &cameraPath, PathVertex &sampled, int s, int t) {
+    PathVertex *qs = s == 1 ? &sampled : s > 1 ? &lightPath[s - 1] : nullptr;
+    PathVertex *qsMinus = s > 1 ? &lightPath[s - 2] : nullptr;
+    PathVertex &pt = cameraPath[t - 1];
+    PathVertex &ptMinus = cameraPath[t - 2];
+
+    // the reverse densities through the connection, restored on return
+    double saved[4] = {pt.pdfRev, ptMinus.pdfRev, qs ? qs->pdfRev : 0, qsMinus ? qsMinus->pdfRev : 0};
+    pt.pdfRev = qs ? vertexPdf(scene, *qs, qsMinus, pt) : lightOriginPdf(scene, pt);
+    ptMinus.pdfRev = vertexPdf(scene, pt, qs, ptMinus);
+    if (qs) {
+        qs->pdfRev = vertexPdf(scene, pt, &ptMinus, *qs);
+    }
+    if (qsMinus) {
+        qsMinus->pdfRev = vertexPdf(scene, *qs, &pt, *qsMinus);
+    }
+
+    double sum = 0;
+    double ratio = 1;
+    for (int i = t - 1; i >= 2; i--) {
+        ratio *= remapZero(cameraPath[i].pdfRev) / remapZero(cameraPath[i].pdfFwd);
+        if (!cameraPath[i].delta && !cameraPath[i - 1].delta) {
+            sum += ratio * ratio;
+        }
+    }
+    ratio = 1;
+    for (int i = s - 1; i >= 0; i--) {
+        const PathVertex &v = s == 1 ? sampled : lightPath[i];
+        ratio *= remapZero(v.pdfRev) / remapZero(v.pdfFwd);
+        if (!v.delta && (i == 0 || !lightPath[i - 1].delta)) {
+            sum += ratio * ratio;
+        }
+    }
+
+    pt.pdfRev = saved[0];
+    ptMinus.pdfRev = saved[1];
+    if (qs) {
+        qs->pdfRev = saved[2];
+    }
+    if (qsMinus) {
+        qsMinus->pdfRev = saved[3];
+    }
+    return 1 / (1 + sum);
+}
+
+// unweighted contribution of the path made of the first s light subpath and
+// the first t camera subpath vertices, t >= 2
+Vector3d connectSubpaths(const Scene &scene, const std::vector<PathVertex> &lightPath,
+                         const std::vector<PathVertex> &cameraPath, PathVertex &sampled, int s, int t) {
+    const PathVertex &pt = cameraPath[t - 1];
+    Vector3d toCamera = cameraPath[t - 2].point - pt.point;
+    toCamera.normalize();
+
+    if (s == 0) {
+        // the camera subpath found a light by itself
+        if (!pt.material.isEmissive || pt.lightIdx < 0
+            || emissionPdf(scene.lights[pt.lightIdx], pt.normal, toCamera) <= 0) {
+            return Vector3d();
+        }
+        return entrywiseProduct(pt.beta, scene.lights[pt.lightIdx].emission);
+    }
+    if (pt.delta || pt.material.isEmissive) {
+        return Vector3d();
+    }
+
+    const PathVertex *qs = &sampled;
+    if (s == 1) {
+        if (!sampleLightVertex(scene, sampled)) {
+            return Vector3d();
+        }
+    } else {
+        qs = &lightPath[s - 1];
+        if (qs->delta || qs->material.isEmissive) {
+            return Vector3d();
+        }
+    }
+
+    Vector3d w = qs->point - pt.point;
+    double d2 = w.dot(w);
+    if (d2 == 0) {
+        return Vector3d();
+    }
+    w = w / std::sqrt(d2);
+    Vector3d cameraSide = pt.material.getBrdfCos(toCamera, w, pt.normal);
+    Vector3d lightSide;
+    if (s == 1) {
+        double cosLight = std::fabs(qs->normal.dot(w));
+        if (emissionPdf(scene.lights[qs->lightIdx], qs->normal, -w) <= 0) {
+            return Vector3d();
+        }
+        lightSide = Vector3d(cosLight, cosLight, cosLight);
+    } else {
+        Vector3d toLight = lightPath[s - 2].point - qs->point;
+        toLight.normalize();
+        lightSide = qs->material.getBrdfCos(toLight, -w, qs->normal);
+    }
+
+    Vector3d contribution = entrywiseProduct(entrywiseProduct(pt.beta, cameraSide),
+                                             entrywiseProduct(qs->beta, lightSide)) / d2;
+    if (contribution[0] <= 0 && contribution[1] <= 0 && contribution[2] <= 0) {
+        return Vector3d();
+    }
+    if (!mutuallyVisible(scene, pt.point, qs->point)) {
+        return Vector3d();
+    }
+    return contribution;
+}
+
+// radiance along a camera ray by bidirectional path tracing
+Vector3d bidirectionalRadiance(const RenderContext &ctx, const Ray &ray) {
+    const Scene &scene = *ctx.scene;
+    int maxDepth = ctx.options->maxDepth;
+    thread_local std::vector<PathVertex> cameraPath;
+    thread_local std::vector<PathVertex> lightPath;
+    cameraPath.clear();
+    lightPath.clear();
+
+    PathVertex camera;
+    camera.type = PathVertex::CameraVertex;
+    camera.point = ray.o;
+    camera.beta = Vector3d(1, 1, 1);
+    cameraPath.push_back(camera);
+    // nothing but camera subpaths reaches the environment, so it needs no weight
+    Vector3d radiance;
+    randomWalk(ctx, ray, camera.beta, 1, maxDepth + 1, cameraPath, &radiance);
+    traceLightPath(ctx, lightPath);
+
+    for (int t = 2; t <= (int)cameraPath.size(); t++) {
+        for (int s = 0; s <= (int)lightPath.size() && s + t - 1 <= maxDepth; s++) {
+            PathVertex sampled;
+            Vector3d contribution = connectSubpaths(scene, lightPath, cameraPath, sampled, s, t);
+            if (contribution[0] > 0 || contribution[1] > 0 || contribution[2] > 0) {
+                double weight = bidirectionalWeight(scene, lightPath, cameraPath, sampled, s, t);
+                radiance = radiance + contribution * weight;
+            }
+        }
+    }
+    return radiance;
+}
+
+// ******************* Film *******************
+
+Film::Film(int width, int height) : width(width), height(height), data(width * height * 4, 0.0f) {}
+
+void Film::add(int row, int col, const Vector3d &color, double weight) {
+    float *px = &data[(row * width + col) * 4];
+    px[0] += color[0];
+    px[1] += color[1];
+    px[2] += color[2];
+    px[3] += weight;
+}
+
+Vector3d Film::radianceAt(int row, int col) const {
+    const float *px = &data[(row * width + col) * 4];
+    if (px[3] <= 0) {
+        return Vector3d();
+    }
+    return Vector3d(px[0], px[1], px[2]) / px[3];
+}
+
+void Film::develop(Image &image) const {
+    for (int r = 0; r < height; r++) {
+        for (int c = 0; c < width; c++) {
+            image.pxAt(r, c) = toPixel(radianceAt(r, c));
+        }
+    }
+}
+
+// ******************* Feature Buffers *******************
+
+FeatureBuffers::FeatureBuffers(int width, int height)
+    : width(width), height(height), albedo(width * height * 3, 0.0f), normal(width * height * 3, 0.0f),
+      depth(width * height, 0.0f) {}
+
+// albedo, normal and depth of the first hit of the pixel center ray
+void writeFeatures(const RenderContext &ctx, int r, int c) {
+    FeatureBuffers &f = *ctx.features;
+    Ray ray = cameraOf(ctx).pixelRay(r, c, f.width, f.height);
+    counters.raysTraced++;
+    HitRecord hit = ctx.scene->findHit(ray);
+    int idx = r * f.width + c;
+    if (!hit.didHit) {
+        return;
+    }
+
+    Vector3d albedo(1, 1, 1);
+    Material textured;
+    double coneWidth = cameraConeSpread(ctx) * (cameraOf(ctx).imagePlaneDistance + hit.distance);
+    const Material &material = shadingMaterial(*ctx.scene, ray, hit, coneWidth, textured);
+    if (!material.isEmissive) {
+        albedo = material.baseColor;
+    }
+    for (int i = 0; i < 3; i++) {
+        f.albedo[idx * 3 + i] = albedo[i];
+        f.normal[idx * 3 + i] = hit.normal[i];
+    }
+    f.depth[idx] = hit.distance;
+}
+
+// ******************* Render Control *******************
+
+// the submitted renders of a Renderer that are still running
+struct rt::JobBoard {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<int> priorities;
+    std::atomic<int> top{-1}; // highest priority running
+
+    void add(int priority) {
+        std::lock_guard<std::mutex> lock(mutex);
+        priorities.push_back(priority);
+        top = *std::max_element(priorities.begin(), priorities.end());
+        changed.notify_all();
+    }
+
+    void remove(int priority) {
+        std::lock_guard<std::mutex> lock(mutex);
+        priorities.erase(std::find(priorities.begin(), priorities.end(), priority));
+        top = priorities.empty() ? -1 : *std::max_element(priorities.begin(), priorities.end());
+        changed.notify_all();
+    }
+};
+
+// Shared by a submitted render and its handle. Render threads check it
+// between tiles and report the tiles they finish to it.
+class rt::RenderControl {
+public:
+    const int priority;
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> finished{false};
+
+    RenderControl(std::shared_ptr<JobBoard> board, RenderPriority priority,
+                  std::function<void(const RenderProgress &)> onProgress)
+        : priority((int)priority), board(std::move(board)), onProgress(std::move(onProgress)) {}
+
+    // the render threads should leave the remaining tiles for later
+    bool shouldYield() const {
+        return cancelled || priority < board->top;
+    }
+
+    // blocks while a render of higher priority runs
+    void waitTurn() {
+        std::unique_lock<std::mutex> lock(board->mutex);
+        board->changed.wait(lock, [this]() { return cancelled || priority >= board->top; });
+    }
+
+    void cancel() {
+        cancelled = true;
+        std::lock_guard<std::mutex> lock(board->mutex);
+        board->changed.notify_all();
+    }
+
+    // tilesTotal over the passes planned so far, the eta is kept within a
+    // positive timeBudget
+    void start(long long tilesTotal, double timeBudget) {
+        std::lock_guard<std::mutex> lock(mutex);
+        startTime = std::chrono::steady_clock::now();
+        budget = timeBudget;
+        current = RenderProgress();
+        current.tilesTotal = tilesTotal;
+    }
+
+    void beginPass(long long tiles) {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.pass++;
+        current.tilesTotal = std::max(current.tilesTotal, current.tilesDone + tiles);
+    }
+
+    void tileDone(long long tileRays) {
+        std::lock_guard<std::mutex> lock(mutex);
+        rays += tileRays;
+        current.tilesDone++;
+        current.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        current.raysPerSecond = rays / std::max(current.seconds, 1e-9);
+        current.etaSeconds = current.seconds * (current.tilesTotal - current.tilesDone) / current.tilesDone;
+        if (budget > 0) {
+            current.etaSeconds = std::max(0.0, std::min(current.etaSeconds, budget - current.seconds));
+        }
+        if (onProgress) {
+            onProgress(current);
+        }
+    }
+
+    RenderProgress progress() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current;
+    }
+
+private:
+    std::shared_ptr<JobBoard> board;
+    std::function<void(const RenderProgress &)> onProgress;
+    mutable std::mutex mutex;
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    double budget = 0;
+    long long rays = 0;
+    RenderProgress current;
+};
+
+void RenderHandle::cancel() {
+    control->cancel();
+}
+
+RenderProgress RenderHandle::progress() const {
+    return control->progress();
+}
+
+// ******************* Render Jobs *******************
+
+double defaultFilterRadius(PixelFilter filter) {
+    switch (filter) {
+        case PixelFilter::Tent: return 1.0;
+        case PixelFilter::BlackmanHarris: return 1.5;
+        default: return 0.5;
+    }
+}
+
+double filterWeight(PixelFilter filter, double radius, double x) {
+    switch (filter) {
+        case PixelFilter::Tent:
+            return std::max(0.0, 1 - std::fabs(x) / radius);
+        case PixelFilter::BlackmanHarris: {
+            double t = 2 * M_PI * (x + radius) / (2 * radius);
+            return 0.35875 - 0.48829 * cos(t) + 0.14128 * cos(2 * t) - 0.01168 * cos(3 * t);
+        }
+        default:
+            return 1.0;
+    }
+}
+
+// primary rays and hits of the sub-pixel strata of one pixel
+struct PrimaryHitCache {
+    int row = -1;
+    int col = -1;
+    int strata = 0;
+    std::vector<std::pair<Ray, HitRecord>> hits;
+};
+
+// splitmix64's finalizer
+uint64_t mixBits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// seeds the thread's generator for sample i of pixel (r, c), see samplePixel
+void seedSample(const RenderContext &ctx, int r, int c, int i) {
+    const RenderOptions &opt = *ctx.options;
+    randomGenerator.seed(mixBits(mixBits(opt.seed) + (uint64_t)r * opt.horizontalResolution + c), i);
+}
+
+// the camera ray of sample i of pixel (r, c), jittered within its stratum of
+// the filter footprint, with weight the filter value at the offset
+Ray jitteredRay(const RenderContext &ctx, int r, int c, int i, int count, double &weight) {
+    const RenderOptions &opt = *ctx.options;
+    double radius = opt.filterRadius > 0 ? opt.filterRadius : defaultFilterRadius(opt.pixelFilter);
+    int n = std::max(1, (int)std::sqrt(count));
+    int stratum = i % (n * n);
+    double dx = ((stratum % n + randomGenerator.getUniform()) / n * 2 - 1) * radius;
+    double dy = ((stratum / n + randomGenerator.getUniform()) / n * 2 - 1) * radius;
+    weight = filterWeight(opt.pixelFilter, radius, dx) * filterWeight(opt.pixelFilter, radius, dy);
+    return cameraOf(ctx).pixelRay(r + dy, c + dx, opt.horizontalResolution, opt.verticalResolution);
+}
+
+// Traces sample i of pixel (r, c), taken in a run of count. Samples are
+// stratified over the filter footprint and weight receives the filter value
+// at the offset. With a cache the sample starts from its stratum's cached
+// primary hit. Its random numbers come from the thread's generator seeded
+// with options.seed and the pixel as key and i as stream, so they do not
+// depend on the thread and no two samples of a render share them.
+Vector3d samplePixel(const RenderContext &ctx, int r, int c, int i, int count, double &weight,
+                     PrimaryHitCache *cache = nullptr) {
+    const RenderOptions &opt = *ctx.options;
+    seedSample(ctx, r, c, i);
+    double radius = opt.filterRadius > 0 ? opt.filterRadius : defaultFilterRadius(opt.pixelFilter);
+    int hRes = opt.horizontalResolution;
+    int vRes = opt.verticalResolution;
+
+    if (cache && opt.primaryHitCache && opt.integrator == Integrator::Path) {
+        int n = std::max(1, std::min((int)std::sqrt(count), opt.primaryHitStrata));
+        int stratum = i % (n * n);
+        if (cache->row != r || cache->col != c || cache->strata != n * n) {
+            cache->row = r;
+            cache->col = c;
+            cache->strata = n * n;
+            cache->hits.clear();
+            for (int s = 0; s < n * n; s++) {
+                double dx = ((s % n + 0.5) / n * 2 - 1) * radius;
+                double dy = ((s / n + 0.5) / n * 2 - 1) * radius;
+                Ray ray = cameraOf(ctx).pixelRay(r + dy, c + dx, hRes, vRes);
+                counters.raysTraced++;
+                cache->hits.emplace_back(ray, ctx.scene->findHit(ray));
+            }
+            // the strata traced up front are paid back by the samples that follow
+            counters.primaryHitsReused -= n * n;
+        }
+        counters.primaryHitsReused++;
+        double dx = ((stratum % n + 0.5) / n * 2 - 1) * radius;
+        double dy = ((stratum / n + 0.5) / n * 2 - 1) * radius;
+        weight = filterWeight(opt.pixelFilter, radius, dx) * filterWeight(opt.pixelFilter, radius, dy);
+        const auto &entry = cache->hits[stratum];
+        return shadeHit(ctx, entry.first, entry.second, 1);
+    }
+
+    Ray ray = jitteredRay(ctx, r, c, i, count, weight);
+    if (opt.integrator == Integrator::Bidirectional) {
+        return bidirectionalRadiance(ctx, ray);
+    }
+    return traceRayHelper(ctx, ray, 1);
+}
+
+const int maxInterleavedPaths = 16;
+
+// Traces samples first to first + n - 1 of pixel (r, c), taken in a run of
+// count, and hands them to add(color, weight) in order. With
+// options.interleavedPaths above 1 that many of them are traced at once as
+// PathStates, whose ray queries take a step each in turn.
+template <typename Add>
+void samplePixels(const RenderContext &ctx, int r, int c, int first, int n, int count, PrimaryHitCache *cache,
+                  const Add &add) {
+    const RenderOptions &opt = *ctx.options;
+    int width = std::min(opt.interleavedPaths, maxInterleavedPaths);
+    if (width <= 1 || opt.integrator != Integrator::Path || ctx.guide || ctx.irradiance
+        || (cache && opt.primaryHitCache) || opt.maxDepth < 1) {
+        for (int i = first; i < first + n; i++) {
+            double weight;
+            Vector3d color = samplePixel(ctx, r, c, i, count, weight, cache);
+            add(color, weight);
+        }
+        return;
+    }
+
+    // paths finish out of order, so their results wait to be handed on in order
+    thread_local std::vector<std::pair<Vector3d, double>> results;
+    results.resize(n);
+    PathState paths[maxInterleavedPaths];
+    int started = 0;
+    int active = 0;
+    auto start = [&](PathState &path) {
+        seedSample(ctx, r, c, first + started);
+        path.start(jitteredRay(ctx, r, c, first + started, count, path.weight));
+        path.sample = started++;
+        active++;
+    };
+    for (int p = 0; p < width && started < n; p++) {
+        start(paths[p]);
+    }
+    while (active > 0) {
+        for (int p = 0; p < width; p++) {
+            PathState &path = paths[p];
+            if (path.sample < 0 || !path.query.step(*ctx.scene) || path.advance(ctx)) {
+                continue;
+            }
+            results[path.sample] = std::make_pair(path.radiance, path.weight);
+            path.sample = -1;
+            active--;
+            if (started < n) {
+                start(path);
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        add(results[i].first, results[i].second);
+    }
+}
+
+Vector3d traceRay(const RenderContext &ctx, int r, int c, PrimaryHitCache *cache) {
+
+    Vector3d agg;
+    double weightSum = 0;
+    int spp = ctx.options->samplesPerPixel;
+    samplePixels(ctx, r, c, 0, spp, spp, cache, [&](const Vector3d &colorSample, double weight) {
+        agg = agg + colorSample * weight;
+        weightSum += weight;
+    });
+    return weightSum > 0 ? agg / weightSum : Vector3d();
+}
+
+// counters of one view of a batch render
+struct ViewCounters {
+    std::atomic<long long> raysTraced{0};
+    std::atomic<int> tilesLeft{0};
+    std::chrono::steady_clock::time_point finished; // set by the thread rendering its last tile
+};
+
+// running mean and variance of the pixel luminance (Welford's algorithm)
+struct PixelEstimate {
+    int n = 0;
+    double mean = 0;
+    double m2 = 0;
+    Vector3d sum;
+    double weightSum = 0;
+    bool done = false;
+
+    void add(const Vector3d &color, double weight) {
+        double y = 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+        n++;
+        double delta = y - mean;
+        mean += delta / n;
+        m2 += delta * (y - mean);
+        sum = sum + color * weight;
+        weightSum += weight;
+    }
+
+    Vector3d radiance() const {
+        return weightSum > 0 ? sum / weightSum : Vector3d();
+    }
+
+    double relativeError() const {
+        if (n < 2) {
+            return INFINITY;
+        }
+        double stdError = std::sqrt(m2 / (n - 1) / n);
+        return stdError / std::max(mean, 1e-4);
+    }
+};
+
+struct Job {
+    const RenderContext *ctx;
+    int tid;
+    TileScheduler *tiles;
+    Film *film;
+    int passSamples;
+    int firstSample; // index of the pass's first sample of each pixel
+    PrimaryHitCache hitCache;
+    // with numaPinning, a tile's pixels are gathered on this thread's node as
+    // r, g, b, weight, samples and written out once the tile is done
+    std::unique_ptr<NodeLocalBuffer> staging;
+    std::vector<int> order; // pixel indices of the last tile shape, see pixels()
+    int orderRows = -1;
+    int orderCols = -1;
+    // a batch render's views, whose tiles switch ctx to viewCtx, a copy of
+    // the view's context reading this job's scene
+    const std::vector<RenderContext> *views = nullptr;
+    std::vector<ViewCounters> *viewCounters = nullptr;
+    RenderContext viewCtx;
+    Scene *scene = nullptr;
+    int view = -1;
+
+    Job(const RenderContext *ctx, int tid, TileScheduler *tiles, Film *film = nullptr, int passSamples = 0,
+        int firstSample = 0)
+        :ctx(ctx), tid(tid), tiles(tiles), film(film), passSamples(passSamples), firstSample(firstSample) {}
+
+    void operator()() {
+        if (ctx->options->numaPinning) {
+            int tileSize = std::max(1, ctx->options->tileSize);
+            staging.reset(new NodeLocalBuffer(tileSize * tileSize * 5));
+        }
+        RenderControl *control = ctx->control;
+        scene = ctx->scene;
+        ImageTile tile;
+        while (!(control && control->shouldYield()) && tiles->next(tid, tile)) {
+            long long rays = counters.raysTraced;
+            if (views && tile.view != view) {
+                view = tile.view;
+                viewCtx = (*views)[view];
+                viewCtx.scene = scene;
+                ctx = &viewCtx;
+                hitCache = PrimaryHitCache();
+            }
+            if (film) {
+                renderPass(tile);
+            } else if (ctx->options->adaptiveSampling) {
+                renderAdaptive(tile);
+            } else {
+                render(tile);
+            }
+            if (staging) {
+                flush(tile);
+            }
+            if (control) {
+                control->tileDone(counters.raysTraced - rays);
+            }
+            if (viewCounters) {
+                ViewCounters &view = (*viewCounters)[tile.view];
+                view.raysTraced += counters.raysTraced - rays;
+                if (--view.tilesLeft == 0) {
+                    view.finished = std::chrono::steady_clock::now();
+                }
+            }
+        }
+    }
+
+    // the estimate of pixel r, c: sum over weightSum of n samples
+    void store(const ImageTile &tile, int r, int c, const Vector3d &sum, double weightSum, int n) {
+        if (!staging) {
+            write(r, c, sum, weightSum, n);
+            return;
+        }
+        float *px = &(*staging)[((r - tile.r0) * (tile.c1 - tile.c0) + c - tile.c0) * 5];
+        px[0] = sum[0];
+        px[1] = sum[1];
+        px[2] = sum[2];
+        px[3] = weightSum;
+        px[4] = n;
+    }
+
+    void flush(const ImageTile &tile) {
+        int cols = tile.c1 - tile.c0;
+        for (int r = tile.r0; r < tile.r1; r++) {
+            for (int c = tile.c0; c < tile.c1; c++) {
+                const float *px = &(*staging)[((r - tile.r0) * cols + c - tile.c0) * 5];
+                write(r, c, Vector3d(px[0], px[1], px[2]), px[3], (int)px[4]);
+            }
+        }
+    }
+
+    // into the pass film if there is one, else into the image, film and sample map
+    void write(int r, int c, const Vector3d &sum, double weightSum, int n) {
+        if (film) {
+            film->add(r, c, sum, weightSum);
+            return;
+        }
+        ctx->image->pxAt(r, c) = toPixel(weightSum > 0 ? sum / weightSum : Vector3d());
+        if (ctx->film) {
+            ctx->film->add(r, c, sum, weightSum);
+        }
+        if (ctx->sampleMap) {
+            (*ctx->sampleMap)[r * ctx->options->horizontalResolution + c] = n;
+        }
+    }
+
+    // indices r * cols + c of the tile's pixels in the order they are rendered
+    const std::vector<int> &pixels(const ImageTile &tile) {
+        int rows = tile.r1 - tile.r0;
+        int cols = tile.c1 - tile.c0;
+        if (rows != orderRows || cols != orderCols) {
+            orderRows = rows;
+            orderCols = cols;
+            if (ctx->options->zOrderPixels) {
+                order = TileScheduler::zOrder(rows, cols);
+            } else {
+                order.resize(rows * cols);
+                for (int i = 0; i < rows * cols; i++) {
+                    order[i] = i;
+                }
+            }
+        }
+        return order;
+    }
+
+    void render(const ImageTile &tile) {
+        int cols = tile.c1 - tile.c0;
+        for (int i : pixels(tile)) {
+            int r = tile.r0 + i / cols;
+            int c = tile.c0 + i % cols;
+            Vector3d color = traceRay(*ctx, r, c, &hitCache);
+            store(tile, r, c, color, 1, ctx->options->samplesPerPixel);
+        }
+    }
+
+    // adds passSamples samples of every pixel of the tile to the film
+    void renderPass(const ImageTile &tile) {
+        int cols = tile.c1 - tile.c0;
+        for (int i : pixels(tile)) {
+            int r = tile.r0 + i / cols;
+            int c = tile.c0 + i % cols;
+            Vector3d agg;
+            double weightSum = 0;
+            samplePixels(*ctx, r, c, firstSample, passSamples, passSamples, &hitCache,
+                         [&](const Vector3d &color, double weight) {
+                agg = agg + color * weight;
+                weightSum += weight;
+            });
+            store(tile, r, c, agg, weightSum, passSamples);
+        }
+    }
+
+    void sample(PixelEstimate &est, int r, int c, int count) {
+        samplePixels(*ctx, r, c, est.n, count, count, &hitCache, [&](const Vector3d &color, double weight) {
+            est.add(color, weight);
+        });
+    }
+
+    // Every pixel of the tile gets minSamplesPerPixel samples, then the
+    // unconverged ones take further rounds until the tile's share of the
+    // samplesPerPixel budget is spent.
+    void renderAdaptive(const ImageTile &tile) {
+        const RenderOptions &opt = *ctx->options;
+        int cols = tile.c1 - tile.c0;
+        int minSpp = std::max(2, opt.minSamplesPerPixel);
+        int maxSpp = std::max(minSpp, opt.maxSamplesPerPixel);
+
+        std::vector<PixelEstimate> est((tile.r1 - tile.r0) * cols);
+        long long budget = (long long)est.size() * opt.samplesPerPixel;
+
+        const std::vector<int> &order = pixels(tile);
+        for (int i : order) {
+            sample(est[i], tile.r0 + i / cols, tile.c0 + i % cols, minSpp);
+            budget -= minSpp;
+        }
+
+        bool active = true;
+        while (active && budget > 0) {
+            active = false;
+            for (size_t k = 0; k < order.size() && budget > 0; k++) {
+                int i = order[k];
+                PixelEstimate &e = est[i];
+                if (e.done) {
+                    continue;
+                }
+                if (e.n >= maxSpp || e.relativeError() < opt.adaptiveErrorThreshold) {
+                    e.done = true;
+                    continue;
+                }
+                int count = (int)std::min<long long>({(long long)minSpp, (long long)(maxSpp - e.n), budget});
+                sample(e, tile.r0 + i / cols, tile.c0 + i % cols, count);
+                budget -= count;
+                active = true;
+            }
+        }
+
+        for (size_t i = 0; i < est.size(); i++) {
+            const PixelEstimate &e = est[i];
+            store(tile, tile.r0 + i / cols, tile.c0 + i % cols, e.sum, e.weightSum, e.n);
+        }
+    }
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// runs fn(tid) for threadCount tids on the pool and adds their counters to
+// stats; a tid is busy from when its task starts until fn returns, and idle
+// for the rest of the wall time, queued behind other pool work or waiting for
+// the rest. With numa given, the worker running tid is pinned to its core
+// meanwhile.
+void runThreads(ThreadPool &pool, int threadCount, const std::function<void(int)> &fn, RenderStats &stats,
+                const NumaTopology *numa = nullptr) {
+    std::vector<ThreadCounters> threadCounters(threadCount);
+    std::vector<double> busy(threadCount);
+    auto start = std::chrono::steady_clock::now();
+    pool.run(threadCount, [&](int tid) {
+        auto taskStart = std::chrono::steady_clock::now();
+        if (numa) {
+            pinThread(numa->cpuOfThread(tid, threadCount));
+        }
+        counters = ThreadCounters();
+        fn(tid);
+        threadCounters[tid] = counters;
+        busy[tid] = secondsSince(taskStart);
+        if (numa) {
+            pinThread(-1);
+        }
+    });
+    double wall = secondsSince(start);
+    for (const auto &x : threadCounters) {
+        stats.raysTraced += x.raysTraced;
+        stats.primaryHitsReused += x.primaryHitsReused;
+        stats.irradianceLookups += x.irradianceLookups;
+        stats.irradianceHits += x.irradianceHits;
+    }
+    if ((int)stats.threadBusySeconds.size() < threadCount) {
+        stats.threadBusySeconds.resize(threadCount);
+        stats.threadIdleSeconds.resize(threadCount);
+    }
+    for (int tid = 0; tid < threadCount; tid++) {
+        stats.threadBusySeconds[tid] += busy[tid];
+        stats.threadIdleSeconds[tid] += wall - busy[tid];
+    }
+}
+
+// renders every tile of the image with Jobs, into film if it is given, or
+// every tile of the views of a batch, counting each view's rays and tiles
+void renderTiles(ThreadPool &pool, const RenderContext &ctx, RenderStats &stats, Film *film = nullptr,
+                 int passSamples = 0, int firstSample = 0, const std::vector<RenderContext> *views = nullptr,
+                 std::vector<ViewCounters> *viewCounters = nullptr) {
+    const RenderOptions &opt = *ctx.options;
+    ImageTile area = ctx.region ? *ctx.region : ImageTile{0, 0, opt.verticalResolution, opt.horizontalResolution};
+    TileScheduler tiles(area, opt.tileSize, opt.threadCount, opt.tileOrder, views ? views->size() : 1);
+    if (viewCounters) {
+        for (auto &view : *viewCounters) {
+            view.tilesLeft = tiles.tileCount() / viewCounters->size();
+        }
+    }
+    const NumaTopology *numa = opt.numaPinning ? &NumaTopology::get() : nullptr;
+    std::vector<long long> misses(opt.threadCount, -1);
+    auto renderThread = [&](int tid) {
+        RenderContext local = ctx;
+        if (ctx.sceneReplicas) {
+            local.scene = (*ctx.sceneReplicas)[numa->nodeOfThread(tid, opt.threadCount)];
+        }
+        std::unique_ptr<CacheMissCounter> counter;
+        if (opt.countCacheMisses) {
+            counter.reset(new CacheMissCounter);
+            counter->start();
+        }
+        Job job(&local, tid, &tiles, film, passSamples, firstSample);
+        job.views = views;
+        job.viewCounters = viewCounters;
+        job();
+        long long count = counter ? counter->stop() : -1;
+        if (count >= 0) {
+            misses[tid] = std::max(0LL, misses[tid]) + count;
+        }
+    };
+    RenderControl *control = ctx.control;
+    if (control) {
+        control->beginPass(tiles.tileCount());
+    }
+    runThreads(pool, opt.threadCount, renderThread, stats, numa);
+    // the threads left tiles for a render of higher priority, or were cancelled
+    while (control && !control->cancelled && !tiles.empty()) {
+        control->waitTurn();
+        runThreads(pool, opt.threadCount, renderThread, stats, numa);
+    }
+    for (long long x : misses) {
+        if (x >= 0) {
+            stats.cacheMisses = std::max(0LL, stats.cacheMisses) + x;
+        }
+    }
+    stats.tiles += tiles.tileCount();
+    stats.tilesStolen += tiles.steals();
+}
+
+// sample-parallel renders split samplesPerPixel into at most this many chunks
+const int maxSampleChunks = 256;
+
+// Renders every pixel on every thread, the threads taking chunks of the
+// samples of every pixel in turn, each into a buffer of its own. Finished
+// chunks are added up in chunk order, which depends on neither threadCount nor
+// which thread finished first, so neither does the image.
+void renderSamples(ThreadPool &pool, const RenderContext &ctx, RenderStats &stats) {
+    const RenderOptions &opt = *ctx.options;
+    ImageTile area = ctx.region ? *ctx.region : ImageTile{0, 0, opt.verticalResolution, opt.horizontalResolution};
+    int rows = area.r1 - area.r0;
+    int cols = area.c1 - area.c0;
+    size_t size = (size_t)rows * cols * 4; // r, g, b, weight per pixel
+    const NumaTopology *numa = opt.numaPinning ? &NumaTopology::get() : nullptr;
+
+    int chunkSamples = std::max(1, (opt.samplesPerPixel + maxSampleChunks - 1) / maxSampleChunks);
+    int chunkCount = (opt.samplesPerPixel + chunkSamples - 1) / chunkSamples;
+    std::vector<std::unique_ptr<NodeLocalBuffer>> buffers(opt.threadCount);
+    // the chunk and row each thread is at, -1 before its first chunk
+    std::vector<int> chunkOf(opt.threadCount, -1);
+    std::vector<int> nextRow(opt.threadCount, area.r1);
+    std::mutex mutex;
+    int nextChunk = 0;
+    int added = 0; // chunks in sums
+    std::vector<double> sums(size);
+    std::vector<std::vector<float>> finished(chunkCount); // waiting for the chunks before them
+
+    // adds a chunk into sums, with the finished ones it held up
+    auto addChunk = [&](int chunk, const float *values) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (chunk != added) {
+            finished[chunk].assign(values, values + size);
+            return;
+        }
+        for (;;) {
+            for (size_t i = 0; i < size; i++) {
+                sums[i] += values[i];
+            }
+            std::vector<float>().swap(finished[added]);
+            if (++added == chunkCount || finished[added].empty()) {
+                break;
+            }
+            values = finished[added].data();
+        }
+    };
+
+    RenderControl *control = ctx.control;
+    if (control) {
+        control->beginPass((long long)rows * chunkCount);
+    }
+    auto renderThread = [&](int tid) {
+        RenderContext local = ctx;
+        if (ctx.sceneReplicas) {
+            local.scene = (*ctx.sceneReplicas)[numa->nodeOfThread(tid, opt.threadCount)];
+        }
+        if (!buffers[tid]) {
+            // allocated, and so first touched, by the thread filling it
+            buffers[tid].reset(new NodeLocalBuffer(size));
+        }
+        PrimaryHitCache hitCache;
+        // a render of higher priority takes over between rows
+        while (!(control && control->shouldYield())) {
+            int &chunk = chunkOf[tid];
+            int &r = nextRow[tid];
+            if (r == area.r1) {
+                if (chunk >= 0 && chunk < chunkCount) {
+                    addChunk(chunk, buffers[tid]->data());
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                chunk = nextChunk < chunkCount ? nextChunk++ : chunkCount;
+                if (chunk == chunkCount) {
+                    break;
+                }
+                r = area.r0;
+            }
+            int first = chunk * chunkSamples;
+            int last = std::min(opt.samplesPerPixel, first + chunkSamples);
+            long long rays = counters.raysTraced;
+            float *px = &(*buffers[tid])[(size_t)(r - area.r0) * cols * 4];
+            for (int c = area.c0; c < area.c1; c++, px += 4) {
+                Vector3d agg;
+                double weightSum = 0;
+                samplePixels(local, r, c, first, last - first, opt.samplesPerPixel, &hitCache,
+                             [&](const Vector3d &color, double weight) {
+                    agg = agg + color * weight;
+                    weightSum += weight;
+                });
+                px[0] = agg[0];
+                px[1] = agg[1];
+                px[2] = agg[2];
+                px[3] = weightSum;
+            }
+            r++;
+            if (control) {
+                control->tileDone(counters.raysTraced - rays);
+            }
+        }
+    };
+    runThreads(pool, opt.threadCount, renderThread, stats, numa);
+    while (control && !control->cancelled && added < chunkCount) {
+        control->waitTurn();
+        runThreads(pool, opt.threadCount, renderThread, stats, numa);
+    }
+    if (control && control->cancelled) {
+        return;
+    }
+
+    runThreads(pool, opt.threadCount, [&](int tid) {
+        for (int r = area.r0 + tid; r < area.r1; r += opt.threadCount) {
+            for (int c = area.c0; c < area.c1; c++) {
+                const double *px = &sums[((size_t)(r - area.r0) * cols + c - area.c0) * 4];
+                Vector3d sum(px[0], px[1], px[2]);
+                double weightSum = px[3];
+                ctx.image->pxAt(r, c) = toPixel(weightSum > 0 ? sum / weightSum : Vector3d());
+                if (ctx.film) {
+                    ctx.film->add(r, c, sum, weightSum);
+                }
+                if (ctx.sampleMap) {
+                    (*ctx.sampleMap)[r * opt.horizontalResolution + c] = opt.samplesPerPixel;
+                }
+            }
+        }
+    }, stats, numa);
+}
+
+// Renders passes of increasing spp into a film, checking the deadline between
+// passes. The next pass is shrunk to what the measured time per sample says
+// still fits in the budget.
+void renderProgressive(ThreadPool &pool, const RenderContext &ctx, RenderStats &stats) {
+    const RenderOptions &opt = *ctx.options;
+    auto start = std::chrono::steady_clock::now();
+
+    Film localFilm(opt.horizontalResolution, opt.verticalResolution);
+    Film &film = ctx.film ? *ctx.film : localFilm;
+
+    int done = 0;
+    int passSamples = 1;
+    while (done < opt.samplesPerPixel) {
+        int count = std::min(passSamples, opt.samplesPerPixel - done);
+        renderTiles(pool, ctx, stats, &film, count, done);
+        if (ctx.control && ctx.control->cancelled) {
+            break;
+        }
+        done += count;
+        stats.passes++;
+
+        double elapsed = secondsSince(start);
+        double remaining = opt.timeBudget - elapsed;
+        if (remaining <= 0) {
+            break;
+        }
+        double perSample = elapsed / done;
+        int fits = (int)(remaining / perSample);
+        if (fits < 1) {
+            break;
+        }
+        passSamples = std::min({passSamples * 2, std::max(1, opt.maxPassSamples), fits});
+    }
+
+    film.develop(*ctx.image);
+    stats.samplesPerPixel = done;
+    if (ctx.sampleMap) {
+        ctx.sampleMap->assign(opt.horizontalResolution * opt.verticalResolution, done);
+    }
+}
+
+// Renders every view in one pass over their interleaved tiles, with ctx's
+// scene, options and rendering aids. Each view's stats get its rays, tiles
+// and the time until its last tile was done.
+void renderViews(ThreadPool &pool, const RenderContext &ctx, std::vector<BatchView> &views, RenderStats &stats) {
+    const RenderOptions &opt = *ctx.options;
+    int pixelCount = opt.horizontalResolution * opt.verticalResolution;
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::vector<int>> sampleMaps(views.size(), std::vector<int>(pixelCount, 0));
+    std::vector<RenderContext> contexts(views.size(), ctx);
+    for (size_t i = 0; i < views.size(); i++) {
+        contexts[i].camera = &views[i].camera;
+        contexts[i].image = views[i].image;
+        contexts[i].sampleMap = &sampleMaps[i];
+    }
+    std::vector<ViewCounters> viewCounters(views.size());
+    long long tilesBefore = stats.tiles;
+    renderTiles(pool, contexts[0], stats, nullptr, 0, 0, &contexts, &viewCounters);
+    long long viewTiles = (stats.tiles - tilesBefore) / views.size();
+
+    long long samples = 0;
+    for (size_t i = 0; i < views.size(); i++) {
+        long long viewSamples = 0;
+        for (int x : sampleMaps[i]) {
+            viewSamples += x;
+        }
+        samples += viewSamples;
+        if (views[i].stats) {
+            RenderStats &view = *views[i].stats;
+            view = RenderStats();
+            view.passes = 1;
+            view.samplesPerPixel = (double)viewSamples / pixelCount;
+            view.raysTraced = viewCounters[i].raysTraced;
+            view.tiles = viewTiles;
+            view.seconds = std::chrono::duration<double>(viewCounters[i].finished - start).count();
+            view.raysPerSecond = view.raysTraced / std::max(view.seconds, 1e-9);
+        }
+    }
+    stats.passes = 1;
+    stats.samplesPerPixel = (double)samples / ((long long)pixelCount * views.size());
+}
+
+// Learns the path guide over passes of doubling spp whose images are
+// discarded; each pass samples from what the previous passes learned.
+void trainPathGuide(ThreadPool &pool, const RenderContext &ctx, RenderStats &stats) {
+    const RenderOptions &opt = *ctx.options;
+    Film film(opt.horizontalResolution, opt.verticalResolution);
+    ctx.guide->setTraining(true);
+    int done = 0;
+    for (int pass = 0; pass < opt.guidingTrainingPasses && !(ctx.control && ctx.control->cancelled); pass++) {
+        int count = 1 << std::min(pass, 10);
+        renderTiles(pool, ctx, stats, &film, count, done);
+        done += count;
+        ctx.guide->update(pass);
+    }
+    ctx.guide->setTraining(false);
+}
+
+Renderer::Renderer(int threadCount) : threads(threadCount), board(std::make_shared<JobBoard>()) {}
+
+Renderer::~Renderer() {
+    std::lock_guard<std::mutex> lock(submittedMutex);
+    for (auto &x : submitted) {
+        x.driver.join();
+    }
+}
+
+void rt::rayTrace(const RenderContext &ctx) {
+    static Renderer renderer(ctx.options->threadCount);
+    renderer.render(ctx);
+}
+
+void Renderer::render(const RenderContext &ctx) {
+    threads.resize(ctx.options->threadCount);
+    run(ctx);
+}
+
+RenderHandle Renderer::submit(RenderRequest request) {
+    auto control = std::make_shared<RenderControl>(board, request.priority, std::move(request.onProgress));
+    std::promise<Image> promise;
+    RenderHandle handle;
+    handle.image = promise.get_future();
+    handle.control = control;
+    // counted as running from now on, so lower priority renders yield at once
+    board->add(control->priority);
+
+    auto drive = [this, control, request = std::move(request), promise = std::move(promise)]() mutable {
+        control->waitTurn();
+        std::exception_ptr error;
+        try {
+            Image image(request.options.horizontalResolution, request.options.verticalResolution);
+            RenderContext ctx;
+            ctx.scene = request.scene;
+            ctx.options = &request.options;
+            ctx.image = &image;
+            ctx.stats = request.stats;
+            ctx.control = control.get();
+            if (!control->cancelled) {
+                run(ctx);
+            }
+            if (!control->cancelled) {
+                board->remove(control->priority);
+                promise.set_value(std::move(image));
+                control->finished = true;
+                return;
+            }
+            error = std::make_exception_ptr(RenderCancelled());
+        } catch (...) {
+            error = std::current_exception();
+        }
+        board->remove(control->priority);
+        promise.set_exception(error);
+        control->finished = true;
+    };
+
+    std::lock_guard<std::mutex> lock(submittedMutex);
+    for (auto it = submitted.begin(); it != submitted.end();) {
+        if (it->control->finished) {
+            it->driver.join();
+            it = submitted.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    submitted.push_back({std::thread(std::move(drive)), control});
+    return handle;
+}
+
+void Renderer::renderBatch(Scene &scene, RenderOptions &options, std::vector<BatchView> &views,
+                           RenderStats *stats) {
+    if (views.empty()) {
+        return;
+    }
+    threads.resize(options.threadCount);
+    RenderContext ctx;
+    ctx.scene = &scene;
+    ctx.options = &options;
+    ctx.image = views[0].image;
+    ctx.camera = &views[0].camera;
+    ctx.stats = stats;
+    run(ctx, &views);
+}
+
+void Renderer::renderRegions(const RenderContext &ctx, const std::function<bool(ImageTile &)> &next,
+                             const std::function<bool(const ImageTile &, const RenderStats &)> &done) {
+    threads.resize(ctx.options->threadCount);
+    Regions regions{next, done};
+    run(ctx, nullptr, &regions);
+}
+
+// renders ctx on the pool as it is, every view of a batch with the camera
+// and image of ctx standing for the first view, or the regions handed out
+void Renderer::run(const RenderContext &ctx, std::vector<BatchView> *views, const Regions *regions) {
+    RenderStats localStats;
+    RenderStats &stats = ctx.stats ? *ctx.stats : localStats;
+    stats = RenderStats();
+    auto start = std::chrono::steady_clock::now();
+
+    TextureCache *textures = ctx.scene->textures.get();
+    if (textures) {
+        textures->setBudget(ctx.options->textureCacheBytes);
+        textures->resetCounters();
+    }
+
+    if (ctx.film) {
+        *ctx.film = Film(ctx.options->horizontalResolution, ctx.options->verticalResolution);
+    }
+    if (ctx.features) {
+        *ctx.features = FeatureBuffers(ctx.options->horizontalResolution, ctx.options->verticalResolution);
+        runThreads(threads, ctx.options->threadCount, [&](int tid) {
+            for (int r = tid; r < ctx.options->verticalResolution; r += ctx.options->threadCount) {
+                for (int c = 0; c < ctx.options->horizontalResolution; c++) {
+                    writeFeatures(ctx, r, c);
+                }
+            }
+        }, stats);
+    }
+
+    PathGuide localGuide;
+    PhotonMap photonMap;
+    IrradianceCache irradianceCache(ctx.options->irradianceCacheError, ctx.options->irradianceCacheMinSpacing,
+                                    ctx.options->irradianceCacheMaxSpacing);
+    RenderContext renderCtx = ctx;
+    if (ctx.options->irradianceCache) {
+        renderCtx.irradiance = &irradianceCache;
+    }
+    if (ctx.options->causticPhotons) {
+        auto photonStart = std::chrono::steady_clock::now();
+        photonMap.build(*ctx.scene, *ctx.options, &threads);
+        stats.photonsEmitted = photonMap.emitted();
+        stats.photonsStored = photonMap.stored();
+        stats.photonSeconds = secondsSince(photonStart);
+        renderCtx.photons = &photonMap;
+    }
+    if (ctx.options->pathGuiding && !ctx.guide) {
+        renderCtx.guide = &localGuide;
+    }
+    std::vector<std::unique_ptr<Scene>> replicas;
+    std::vector<Scene *> replicaPtrs;
+    if (ctx.options->numaPinning) {
+        const NumaTopology &numa = NumaTopology::get();
+        stats.numaNodes = numa.nodeCount();
+        if (ctx.options->numaReplicateScene) {
+            // each copy is made, and so first touched, by a thread on its node
+            auto replicaStart = std::chrono::steady_clock::now();
+            replicas.resize(numa.nodeCount());
+            threads.run(numa.nodeCount(), [&](int node) {
+                pinThread(numa.nodeCpus[node][0]);
+                replicas[node].reset(new Scene(*ctx.scene));
+                pinThread(-1);
+            });
+            for (auto &replica : replicas) {
+                replicaPtrs.push_back(replica.get());
+            }
+            renderCtx.sceneReplicas = &replicaPtrs;
+            stats.replicaSeconds = secondsSince(replicaStart);
+        }
+    }
+    if (ctx.control) {
+        const RenderOptions &opt = *ctx.options;
+        int tileSize = std::max(1, opt.tileSize);
+        long long tiles = (long long)((opt.horizontalResolution + tileSize - 1) / tileSize)
+                * ((opt.verticalResolution + tileSize - 1) / tileSize);
+        bool training = opt.pathGuiding && !renderCtx.guide->isTrained();
+        ctx.control->start(tiles * ((training ? opt.guidingTrainingPasses : 0) + 1), opt.timeBudget);
+    }
+    if (ctx.options->pathGuiding && !renderCtx.guide->isTrained()) {
+        trainPathGuide(threads, renderCtx, stats);
+    }
+
+    if (views) {
+        renderViews(threads, renderCtx, *views, stats);
+    } else if (ctx.options->timeBudget > 0 && !regions) {
+        renderProgressive(threads, renderCtx, stats);
+    } else {
+        int pixelCount = ctx.options->horizontalResolution * ctx.options->verticalResolution;
+        std::vector<int> localMap;
+        std::vector<int> &sampleMap = ctx.sampleMap ? *ctx.sampleMap : localMap;
+        sampleMap.assign(pixelCount, 0);
+
+        RenderContext jobCtx = renderCtx;
+        jobCtx.sampleMap = &sampleMap;
+        if (regions) {
+            ImageTile region;
+            while (regions->next(region)) {
+                RenderContext regionCtx = jobCtx;
+                regionCtx.region = &region;
+                if (ctx.film) {
+                    // a region handed out again is rendered afresh
+                    for (int r = region.r0; r < region.r1; r++) {
+                        std::fill(&ctx.film->data[(r * ctx.film->width + region.c0) * 4],
+                                  &ctx.film->data[(r * ctx.film->width + region.c1) * 4], 0.0f);
+                    }
+                }
+                RenderStats regionStats;
+                if (ctx.options->sampleParallel) {
+                    renderSamples(threads, regionCtx, regionStats);
+                } else {
+                    renderTiles(threads, regionCtx, regionStats);
+                }
+                stats.raysTraced += regionStats.raysTraced;
+                stats.tiles += regionStats.tiles;
+                stats.tilesStolen += regionStats.tilesStolen;
+                if (!regions->done(region, regionStats)) {
+                    break;
+                }
+            }
+        } else if (ctx.options->sampleParallel) {
+            renderSamples(threads, jobCtx, stats);
+        } else {
+            renderTiles(threads, jobCtx, stats);
+        }
+
+        long long samples = 0;
+        for (int x : sampleMap) {
+            samples += x;
+        }
+        stats.passes = 1;
+        stats.samplesPerPixel = (double)samples / pixelCount;
+    }
+
+    stats.irradianceRecords = irradianceCache.size();
+    if (textures) {
+        stats.textureTileLookups = textures->lookups();
+        stats.textureTileHits = textures->hits();
+        stats.textureResidentBytes = textures->residentBytes();
+        stats.texturePeakBytes = textures->peakResidentBytes();
+    }
+    stats.seconds = secondsSince(start);
+    stats.raysPerSecond = stats.raysTraced / std::max(stats.seconds, 1e-9);
+}
+
+// Shades hits of camera rays through random pixels over and over: sample a
+// bounce, evaluate its weight and pdf, or take the emission of a light.
+// Returns shading evaluations per second.
+double rt::benchmarkShading(const Scene &scene, int count) {
+    std::vector<std::pair<Vector3d, HitRecord>> hits;
+    while ((int)hits.size() < 4096) {
+        Ray ray = scene.camera.pixelRay(randomGenerator.getUniform() * 64, randomGenerator.getUniform() * 64, 64, 64);
+        HitRecord hit = scene.findHit(ray);
+        if (hit.didHit) {
+            hits.emplace_back(-ray.d, hit);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Vector3d sum;
+    for (int i = 0; i < count; i++) {
+        const auto &entry = hits[i & 4095];
+        const HitRecord &hit = entry.second;
+        const Material &material = scene.getMatAtIdx(hit.matIdx);
+        if (material.isEmissive) {
+            sum = sum + material.getBRDF(entry.first, entry.first, hit.normal);
+            continue;
+        }
+        Vector3d wi = material.getScatterDir(entry.first, hit.normal);
+        double pdf = material.getPdf(entry.first, wi, hit.normal);
+        sum = sum + material.getBRDF(entry.first, wi, hit.normal) * (pdf + wi[0]);
+    }
+    double seconds = secondsSince(start);
+    // keep the loop from being optimized away
+    if (sum[0] == 1234.5) {
+        std::cout << sum.to_string() << std::endl;
     }
+    return count / std::max(seconds, 1e-9);
 }
 
 int rt::test(int count) {
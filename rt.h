@@ -5,12 +5,22 @@
 #ifndef PATH_TRACER_RT_H
 #define PATH_TRACER_RT_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
 #include <iostream>
+#include <stdexcept>
 
 #include "image.h"
+#include "guiding.h"
+#include "photons.h"
+#include "irradiance.h"
+#include "texture.h"
+#include "alias.h"
+#include "scheduler.h"
+#include "threadpool.h"
+#include "envmap.h"
 #include "tinygltf/tiny_gltf.h"
 
 #ifdef USE_EIGEN
@@ -36,38 +46,47 @@ struct Ray {
     Ray(const Vector3d &o, const Vector3d &d);
 };
 
-class Material {
-public:
-    static Material *makeFromGltfMaterial(const tinygltf::Material &m);
-
-    virtual ~Material() = default;
-    virtual Vector3d getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const = 0;
-    virtual Vector3d getScatterDir(const Vector3d &d1, const Vector3d &n) const = 0;
+enum class MaterialType : uint8_t {
+    Dielectric, // lambertian
+    Metallic, // perfect mirror
+    MetallicRoughness, // glTF metallic-roughness: GGX specular over a lambertian base
+    LightSource
 };
 
-struct PbrMaterial : public Material {
-    double alpha;
+// A material record. Scenes keep their materials by value in one array and
+// shading switches on the type, so there is no virtual dispatch per hit.
+struct Material {
+    MaterialType type = MaterialType::Dielectric;
+    bool isEmissive = false;
+    bool doubleSided = false;
+    double alpha = 1;
+    double metallicFactor = 0;
+    double roughnessFactor = 1;
     Vector3d baseColor;
-    bool doubleSided;
     Vector3d emissiveFactor;
-    std::string name;
-    double metallicFactor;
-    double roughnessFactor;
-};
-
-struct MetallicMaterial : public PbrMaterial {
-    Vector3d getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const override ;
-    Vector3d getScatterDir(const Vector3d &d1, const Vector3d &n) const override;
-};
-
-struct DielectricMaterial : public PbrMaterial {
-    Vector3d getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const override;
-    Vector3d getScatterDir(const Vector3d &d1, const Vector3d &n) const override;
-};
-
-struct LightSource : public PbrMaterial {
-    Vector3d getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const override;
-    Vector3d getScatterDir(const Vector3d &d1, const Vector3d &n) const override;
+    int baseColorTexture = -1; // in Scene::textures, multiplies baseColor
+
+    static Material makeFromGltfMaterial(const tinygltf::Material &m);
+    static Material makeDielectric(const Vector3d &baseColor);
+    static Material makeMetallic(const Vector3d &baseColor);
+    // GGX over a lambertian base, a perfect mirror for a smooth metal
+    static Material makeMetallicRoughness(const Vector3d &baseColor, double metallic, double roughness);
+    static Material makeLightSource(const Vector3d &emission);
+
+    // sample weight brdf * cos / pdf of scattering d1 into d2, the emission of
+    // a light source
+    Vector3d getBRDF(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const;
+    Vector3d getScatterDir(const Vector3d &d1, const Vector3d &n) const;
+    // solid angle pdf of getScatterDir returning d2, 0 for specular materials
+    double getPdf(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const;
+    // brdf * cos of scattering d1 into d2, 0 for specular materials and light sources
+    Vector3d getBrdfCos(const Vector3d &d1, const Vector3d &d2, const Vector3d &n) const;
+    bool isSpecular() const { return type == MaterialType::Metallic; }
+
+private:
+    Vector3d specularColor() const;
+    double specularProbability() const;
+    Vector3d evalMetallicRoughness(const Vector3d &wo, const Vector3d &wi, const Vector3d &n) const;
 };
 
 struct HitRecord {
@@ -76,32 +95,50 @@ struct HitRecord {
     Vector3d point;
     Vector3d normal;
     int matIdx;
+    int lightIdx = -1;
+    double uv[2] = {0, 0};
+    double uvDensity = 0; // texture space area per unit surface area, 0 without texcoords
 };
 
 class Object {
 public:
     virtual ~Object() = default;
     virtual bool doesHit(const Ray &ray, HitRecord &hit) const = 0;
+    virtual std::unique_ptr<Object> clone() const = 0;
 };
 
 struct Primitive {
     Vector3i vIndicies;
     int matIdx;
+    int lightIdx = -1;
+};
+
+struct BvhNode {
+    double min[3];
+    double max[3];
+    int start; // first primitive of a leaf, right child of an interior node
+    int count; // 0 for interior nodes, whose left child follows them
 };
 
 struct Mesh : public Object {
     std::vector<Primitive> primitives;
     std::vector<Vector3d> vertices;
+    std::vector<double> texcoords; // u, v per vertex, empty if the mesh has none
+    std::vector<BvhNode> bvh;
 
+    void build(); // reorders primitives and builds the bvh
     bool doesHit(const Ray &ray, HitRecord &hit) const;
+    std::unique_ptr<Object> clone() const { return std::unique_ptr<Object>(new Mesh(*this)); }
 };
 
 struct Sphere : public Object {
     double radius;
     Vector3d point;
     int matIdx;
+    int lightIdx = -1;
 
     bool doesHit(const Ray &ray, HitRecord &hit) const;
+    std::unique_ptr<Object> clone() const { return std::unique_ptr<Object>(new Sphere(*this)); }
 };
 
 struct Camera {
@@ -124,18 +161,130 @@ struct Camera {
 
     void init();
     Ray pixelRay(int r, int c, int hRes, int vRes) const;
+    Ray pixelRay(double r, double c, int hRes, int vRes) const; // fractional pixel coordinates
+};
+
+// bounds on the position, power and emitted directions of a set of lights
+struct LightBounds {
+    Vector3d min;
+    Vector3d max;
+    double phi = 0;
+    Vector3d w; // axis of the cone of emitter normals
+    double cosThetaO = 1; // spread of the normals around w
+    double cosThetaE = 0; // spread of emission around each normal
+    bool twoSided = false;
+
+    double importance(const Vector3d &p, const Vector3d &n) const;
+    static LightBounds merge(const LightBounds &a, const LightBounds &b);
+};
+
+// an emitter: a LightSource sphere or an emissive mesh triangle
+struct Light {
+    enum Type {
+        SphereLight,
+        TriangleLight
+    };
+
+    Type type;
+    Vector3d p0; // sphere center or first triangle vertex
+    Vector3d p1;
+    Vector3d p2;
+    double radius = 0;
+    Vector3d emission;
+
+    double area() const;
+    double power() const;
+    LightBounds bounds() const;
+
+    // uniform over the surface of the light
+    void samplePoint(double u1, double u2, Vector3d &point, Vector3d &normal) const;
+    // samples a direction towards the light from p, returning false if none
+    bool sample(const Vector3d &p, double u1, double u2, Vector3d &wi, double &pdf) const;
+    // solid angle pdf of sample() returning the direction of ray hitting the light at hit
+    double pdf(const Ray &ray, const HitRecord &hit) const;
+};
+
+// bvh over the lights of a scene for picking lights in proportion to their
+// estimated contribution at a shading point
+class LightBvh {
+public:
+    void build(const std::vector<Light> &lights);
+    // returns the index of the picked light, or -1 if no light contributes
+    int sample(const Vector3d &p, const Vector3d &n, double u, double &pmf) const;
+    double pmf(const Vector3d &p, const Vector3d &n, int lightIdx) const;
+
+private:
+    struct Node {
+        LightBounds bounds;
+        int child; // right child of an interior node, left child is next
+        int lightIdx; // >= 0 for leaves
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint64_t> bitTrails; // path from the root to each light's leaf
+
+    int buildNode(const std::vector<Light> &lights, std::vector<int> &idx, int begin, int end, uint64_t trail, int depth);
+};
+
+enum class LightSampling {
+    None, // emitters are only found by BSDF sampling
+    Uniform,
+    Power, // in proportion to emitted power, in constant time
+    LightBvh
 };
 
 struct Scene {
     std::vector<std::unique_ptr<Object>> objects;
-    std::vector<std::unique_ptr<Material>> materials;
+    std::vector<Material> materials;
+    std::vector<Light> lights;
+    LightBvh lightBvh;
+    AliasTable lightPower; // over the lights, weighted by power()
     Camera camera;
+    std::shared_ptr<TextureCache> textures; // null if no material is textured
+    std::shared_ptr<EnvironmentMap> environment; // lights rays that miss, null for black
 
-    Scene(const tinygltf::Model &m);
+    // builds the mesh bvhs on pool if given
+    Scene(const tinygltf::Model &m, ThreadPool *pool = nullptr);
     Scene();
-
+    // copies the objects, bvhs, lights and materials into memory allocated by
+    // the calling thread; the copy shares the texture cache and environment
+    Scene(const Scene &other);
+    Scene(Scene &&) = default;
+    Scene &operator=(Scene &&) = default;
+
+    // the default room lit by lightCount small emissive triangles below the ceiling
+    static Scene makeManyLights(int lightCount);
+    // the default room with its spheres replaced by a row of count gold
+    // spheres whose roughness goes from 0 to 1
+    static Scene makeRoughnessSweep(int count);
+    // spheres on a ground plane and no lights, for environment lighting
+    static Scene makeProductShot();
+    // the default room lit only through a small hole in a wall across its
+    // back, behind which hangs a small light
+    static Scene makeSmallOpening();
+
+    void prepare(ThreadPool *pool = nullptr); // builds mesh bvhs, on pool if given, and gathers the lights
     const Material& getMatAtIdx(int matIdx) const;
     HitRecord findHit(const Ray &r) const;
+
+    int sampleLight(LightSampling mode, const Vector3d &p, const Vector3d &n, double u, double &pmf) const;
+    double lightPmf(LightSampling mode, const Vector3d &p, const Vector3d &n, int lightIdx) const;
+    // chance that light sampling picks the environment instead of a light
+    double environmentPmf() const;
+};
+
+// reads a .gltf or .glb file, keeping images encoded for the texture cache
+bool loadGltf(const std::string &path, tinygltf::Model &model, std::string &err);
+
+enum class Integrator {
+    Path, // unidirectional from the camera
+    Bidirectional
+};
+
+enum class PixelFilter {
+    Box,
+    Tent,
+    BlackmanHarris
 };
 
 struct RenderOptions {
@@ -144,16 +293,306 @@ struct RenderOptions {
     int maxDepth;
     int threadCount;
     int samplesPerPixel;
+    // the random numbers of each sample are a function of seed, its pixel and
+    // its index, so the image does not depend on threadCount or timing. That
+    // holds for fixed and adaptive sampling without a timeBudget, and for
+    // sampleParallel, but not with path guiding, photons or the irradiance
+    // cache, whose state is shared between threads.
+    uint64_t seed = 0;
+
+    // pixels are rendered in tiles of tileSize x tileSize, which threads
+    // take from their own queue or steal from the others. Queues are filled
+    // in tileOrder, and zOrderPixels walks each tile in Z-order instead of
+    // row by row, keeping consecutive paths closer together in the scene.
+    int tileSize = 16;
+    TileOrder tileOrder = TileOrder::Rows;
+    bool zOrderPixels = false;
+    // counts the render threads' cache misses into RenderStats::cacheMisses
+    bool countCacheMisses = false;
+    // sample-parallel rendering: instead of taking tiles, the threads take
+    // chunks of the samplesPerPixel samples of every pixel, at most 256 of
+    // them, into buffers of their own, and the chunks are summed pixel by pixel
+    // in chunk order. For small images at high spp, which have fewer tiles than
+    // there are threads.
+    // Renders with a timeBudget still go by tiles; adaptive sampling is not
+    // used.
+    bool sampleParallel = false;
+
+    // bidirectional path tracing connects every vertex of a light subpath to
+    // every vertex of the camera subpath and weights the strategies by
+    // multiple importance sampling. Light subpaths are not splatted onto the
+    // image and the path guide, photon map and irradiance cache are not used.
+    Integrator integrator = Integrator::Path;
+
+    // each sample gets a stratified sub-pixel offset within filterRadius of
+    // the pixel center and is weighted by pixelFilter; a radius of 0 picks the
+    // filter's default width
+    PixelFilter pixelFilter = PixelFilter::Box;
+    double filterRadius = 0;
+
+    // trace the primary ray of each of the primaryHitStrata^2 sub-pixel strata
+    // once per pixel and start every sample of that stratum from the cached
+    // hit. This changes the image: samples sit at stratum centers instead of
+    // being jittered, so edges and textures are antialiased by that fixed
+    // grid with its filter weights, and regular detail finer than it aliases.
+    // The difference stays under the noise at moderate spp but not as the
+    // noise falls; --hit-cache-check measures it.
+    bool primaryHitCache = false;
+    int primaryHitStrata = 2;
+
+    // interleaved paths: each thread traces interleavedPaths (at most 16)
+    // samples of a pixel at once, advancing their rays by a bvh node each in
+    // turn and prefetching the node a ray visits next, so that the cache
+    // misses of one ray overlap the work on the others in scenes larger than
+    // the cache. The bidirectional integrator, path guiding, the irradiance
+    // cache and the primary hit cache trace one path at a time. The image is
+    // the same for every interleavedPaths above 1, and differs from one path
+    // at a time only by rounding.
+    int interleavedPaths = 1;
+
+    // adaptive sampling: every pixel takes minSamplesPerPixel samples, then
+    // keeps sampling until the relative standard error of its luminance drops
+    // below adaptiveErrorThreshold or it reaches maxSamplesPerPixel. The
+    // samplesPerPixel * pixel count budget saved on converged pixels is spent
+    // on the noisy ones.
+    bool adaptiveSampling = false;
+    int minSamplesPerPixel = 16;
+    int maxSamplesPerPixel = 4096;
+    double adaptiveErrorThreshold = 0.02;
+
+    // next event estimation: diffuse hits also sample a light, combined with
+    // the BSDF sample by multiple importance sampling
+    LightSampling lightSampling = LightSampling::None;
+    // light sampling draws environment directions in proportion to their
+    // radiance, or uniformly over the sphere when this is false
+    bool environmentImportanceSampling = true;
+
+    // path guiding: guidingTrainingPasses passes of doubling spp learn where
+    // light comes from, then diffuse bounces draw guidingFraction of their
+    // directions from the learned distribution
+    bool pathGuiding = false;
+    int guidingTrainingPasses = 6;
+    double guidingFraction = 0.5;
+
+    // caustic photon map: photonCount photons are shot from the lights
+    // towards specular spheres before rendering, and lambertian hits estimate
+    // the caustics from the photons within photonRadius instead of finding
+    // them through diffuse-specular-light paths; glossy hits still do
+    bool causticPhotons = false;
+    long long photonCount = 1000000;
+    size_t photonMemoryCap = 64 << 20; // bytes
+    double photonRadius = 0.1;
+
+    // irradiance cache: diffuse hits reached through a diffuse bounce take
+    // their indirect light from cached records, each gathered once from
+    // irradianceCacheRays rays and reused within irradianceCacheError times
+    // its distance to the surrounding geometry (clamped to the spacing range)
+    bool irradianceCache = false;
+    int irradianceCacheRays = 128;
+    double irradianceCacheError = 0.3;
+    double irradianceCacheMinSpacing = 0.5;
+    double irradianceCacheMaxSpacing = 10;
+
+    // progressive rendering: when timeBudget (seconds) is positive the image is
+    // rendered in passes of increasing spp until the budget runs out or
+    // samplesPerPixel is reached, and the best image so far is returned.
+    double timeBudget = 0;
+    int maxPassSamples = 64;
+
+    // memory the texture cache may keep decoded tiles in
+    size_t textureCacheBytes = 256 << 20;
+
+    // NUMA: numaPinning pins render thread tid to a core of node
+    // tid * nodeCount / threadCount, so each node renders a contiguous band
+    // of tiles, staged in buffers allocated on the node. numaReplicateScene
+    // also gives the threads of each node their own copy of the scene.
+    bool numaPinning = false;
+    bool numaReplicateScene = false;
 };
 
+// floating point radiance accumulation buffer
+struct Film {
+    int width;
+    int height;
+    std::vector<float> data; // r, g, b, weight per pixel
+
+    Film(int width, int height);
+
+    void add(int row, int col, const Vector3d &color, double weight);
+    Vector3d radianceAt(int row, int col) const;
+    void develop(Image &image) const;
+};
+
+// albedo, normal and depth of the first hit of each pixel, for denoising
+struct FeatureBuffers {
+    int width;
+    int height;
+    std::vector<float> albedo; // r, g, b per pixel
+    std::vector<float> normal; // x, y, z per pixel
+    std::vector<float> depth;
+
+    FeatureBuffers(int width, int height);
+};
+
+struct RenderStats {
+    int passes = 0;
+    double samplesPerPixel = 0; // achieved average
+    long long raysTraced = 0;
+    long long primaryHitsReused = 0; // intersections saved by the primary hit cache
+    long long photonsEmitted = 0;
+    long long photonsStored = 0;
+    double photonSeconds = 0;
+    long long irradianceLookups = 0;
+    long long irradianceHits = 0; // lookups served by existing records
+    long long irradianceRecords = 0;
+    long long textureTileLookups = 0;
+    long long textureTileHits = 0;
+    size_t textureResidentBytes = 0; // at the end of the render
+    size_t texturePeakBytes = 0;
+    long long tiles = 0; // rendered, summed over passes
+    long long tilesStolen = 0;
+    long long cacheMisses = -1; // while rendering tiles, -1 if not counted or unavailable
+    // per render thread, the time spent working and waiting for the others
+    std::vector<double> threadBusySeconds;
+    std::vector<double> threadIdleSeconds;
+    int numaNodes = 0; // the render threads were pinned to, 0 if unpinned
+    double replicaSeconds = 0; // copying the scene to the nodes
+    double seconds = 0;
+    double raysPerSecond = 0;
+};
+
+// a render's progress, reported between tiles
+struct RenderProgress {
+    int pass = 0; // tile passes started, path guide training included
+    long long tilesDone = 0; // over all passes
+    long long tilesTotal = 0; // grows as a progressive render adds passes
+    double seconds = 0;
+    double etaSeconds = 0;
+    double raysPerSecond = 0;
+};
+
+enum class RenderPriority {
+    Low,
+    Normal,
+    High // pauses lower priority renders of the same Renderer between tiles
+};
+
+class RenderControl;
+struct JobBoard;
+
 struct RenderContext {
     Scene *scene;
     RenderOptions *options;
     Image *image;
+    const Camera *camera = nullptr; // optional, in place of the scene's
+    const ImageTile *region = nullptr; // optional, the only pixels rendered
+    std::vector<int> *sampleMap = nullptr; // optional, samples taken per pixel
+    Film *film = nullptr; // optional, receives the accumulated radiance
+    FeatureBuffers *features = nullptr; // optional, filled before rendering
+    RenderStats *stats = nullptr; // optional
+    PathGuide *guide = nullptr; // optional, trained by rayTrace if pathGuiding is set
+    const PhotonMap *photons = nullptr; // set by rayTrace if causticPhotons is set
+    IrradianceCache *irradiance = nullptr; // set by rayTrace if irradianceCache is set
+    const std::vector<Scene *> *sceneReplicas = nullptr; // per numa node, set by rayTrace if numaReplicateScene is set
+    RenderControl *control = nullptr; // set by Renderer::submit
 };
 
+// one view of a batch render
+struct BatchView {
+    Camera camera; // initialized
+    Image *image;
+    // optional: its rays and tiles, and seconds until its last tile was done
+    RenderStats *stats = nullptr;
+};
+
+// what Renderer::submit renders
+struct RenderRequest {
+    Scene *scene; // must outlive the render
+    RenderOptions options;
+    RenderPriority priority = RenderPriority::Normal;
+    // called after every tile on the render thread that finished it, never
+    // by two threads at once
+    std::function<void(const RenderProgress &)> onProgress;
+    RenderStats *stats = nullptr; // optional, filled before the image is ready
+};
+
+// thrown by the image of a RenderHandle whose render was cancelled
+struct RenderCancelled : std::runtime_error {
+    RenderCancelled() : std::runtime_error("render cancelled") {}
+};
+
+// a render started by Renderer::submit
+struct RenderHandle {
+    std::future<Image> image; // throws RenderCancelled if cancelled
+
+    // stops the render once the tiles being rendered are done
+    void cancel();
+    RenderProgress progress() const;
+
+    std::shared_ptr<RenderControl> control;
+};
+
+// Renders on a long-lived pool of threads, which callers may share for other
+// parallel work such as building bvhs, denoising or writing images.
+class Renderer {
+public:
+    explicit Renderer(int threadCount = 8);
+    // waits for the submitted renders
+    ~Renderer();
+
+    // renders ctx, first resizing the pool to ctx.options->threadCount
+    void render(const RenderContext &ctx);
+
+    // Starts rendering request on the pool without resizing it and returns
+    // at once. While a render of higher priority runs, lower ones give up
+    // their threads between tiles and wait.
+    RenderHandle submit(RenderRequest request);
+
+    // Renders every view of scene with options in one pass over the tiles of
+    // all of them, interleaved so each thread works on the same part of every
+    // view. The photon map, irradiance cache and path guide are built once,
+    // the guide trained on the first view. Progressive rendering is not
+    // supported and timeBudget is ignored.
+    void renderBatch(Scene &scene, RenderOptions &options, std::vector<BatchView> &views,
+                     RenderStats *stats = nullptr);
+
+    // Renders the regions of ctx's image that next hands out, one at a time
+    // until it returns false, passing each with its stats to done, which
+    // returns false to stop. The photon map, irradiance cache and path guide
+    // are built once for all of them, the guide trained on the whole image.
+    // timeBudget is ignored.
+    void renderRegions(const RenderContext &ctx, const std::function<bool(ImageTile &)> &next,
+                       const std::function<bool(const ImageTile &, const RenderStats &)> &done);
+
+    void setThreadCount(int threadCount) { threads.resize(threadCount); }
+    int threadCount() const { return threads.size(); }
+    ThreadPool &pool() { return threads; }
+
+private:
+    struct Submitted {
+        std::thread driver; // waits for the pool to render the request
+        std::shared_ptr<RenderControl> control;
+    };
+
+    ThreadPool threads;
+    std::shared_ptr<JobBoard> board; // the running submitted renders
+    std::mutex submittedMutex;
+    std::vector<Submitted> submitted;
+
+    struct Regions {
+        const std::function<bool(ImageTile &)> &next;
+        const std::function<bool(const ImageTile &, const RenderStats &)> &done;
+    };
+
+    void run(const RenderContext &ctx, std::vector<BatchView> *views = nullptr, const Regions *regions = nullptr);
+};
+
+// renders on a renderer shared by all callers
 void rayTrace(const RenderContext &ctx);
 
+// shading evaluations per second over count hits, without tracing rays
+double benchmarkShading(const Scene &scene, int count);
+
 int test(int count);
 
 }
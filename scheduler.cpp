@@ -0,0 +1,143 @@
+//
+// Tile scheduler.
+//
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+using namespace rt;
+
+namespace {
+
+// the bits of x and y interleaved, x in the low bit
+uint64_t mortonKey(uint32_t x, uint32_t y) {
+    uint64_t key = 0;
+    for (int bit = 0; bit < 32; bit++) {
+        key |= (uint64_t)((x >> bit) & 1) << (2 * bit) | (uint64_t)((y >> bit) & 1) << (2 * bit + 1);
+    }
+    return key;
+}
+
+// distance along the Hilbert curve filling the n x n grid, n a power of two
+uint64_t hilbertKey(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+}
+
+TileScheduler::TileScheduler(int width, int height, int tileSize, int threadCount, TileOrder order,
+                             int viewCount)
+    : TileScheduler(ImageTile{0, 0, height, width}, tileSize, threadCount, order, viewCount) {}
+
+TileScheduler::TileScheduler(const ImageTile &area, int tileSize, int threadCount, TileOrder order,
+                             int viewCount) {
+    tileSize = std::max(1, tileSize);
+    threadCount = std::max(1, threadCount);
+    int tilesX = (area.c1 - area.c0 + tileSize - 1) / tileSize;
+    int tilesY = (area.r1 - area.r0 + tileSize - 1) / tileSize;
+    uint32_t n = 1;
+    while (n < (uint32_t)std::max(tilesX, tilesY)) {
+        n *= 2;
+    }
+
+    std::vector<std::pair<double, ImageTile>> keyed;
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            int r = area.r0 + ty * tileSize;
+            int c = area.c0 + tx * tileSize;
+            ImageTile tile = {r, c, std::min(area.r1, r + tileSize), std::min(area.c1, c + tileSize)};
+            double key = ty * tilesX + tx;
+            if (order == TileOrder::Morton) {
+                key = mortonKey(tx, ty);
+            } else if (order == TileOrder::Hilbert) {
+                key = hilbertKey(n, tx, ty);
+            } else if (order == TileOrder::Spiral) {
+                // by ring around the center, then by angle within the ring
+                double dx = tx - (tilesX - 1) / 2.0;
+                double dy = ty - (tilesY - 1) / 2.0;
+                double ring = std::ceil(std::max(std::abs(dx), std::abs(dy)));
+                key = ring * 8 + std::atan2(dy, dx) + M_PI;
+            }
+            for (int view = 0; view < viewCount; view++) {
+                tile.view = view;
+                keyed.emplace_back(key, tile);
+            }
+        }
+    }
+    std::stable_sort(keyed.begin(), keyed.end(), [](const std::pair<double, ImageTile> &a,
+                                                    const std::pair<double, ImageTile> &b) {
+        return a.first < b.first;
+    });
+    count = keyed.size();
+
+    for (int tid = 0; tid < threadCount; tid++) {
+        queues.emplace_back(new Queue);
+    }
+    for (int i = 0; i < count; i++) {
+        // neighbouring tiles go to the same thread, thieves take the far end;
+        // a spiral is dealt round robin instead so the center is done first
+        int tid = order == TileOrder::Spiral ? i % threadCount : (long long)i * threadCount / count;
+        queues[tid]->tiles.push_back(keyed[i].second);
+    }
+}
+
+bool TileScheduler::empty() {
+    for (auto &queue : queues) {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (!queue->tiles.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<int> TileScheduler::zOrder(int rows, int cols) {
+    std::vector<int> order(rows * cols);
+    for (int i = 0; i < rows * cols; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [cols](int a, int b) {
+        return mortonKey(a % cols, a / cols) < mortonKey(b % cols, b / cols);
+    });
+    return order;
+}
+
+bool TileScheduler::next(int tid, ImageTile &tile) {
+    int threadCount = queues.size();
+    {
+        Queue &own = *queues[tid % threadCount];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tiles.empty()) {
+            tile = own.tiles.front();
+            own.tiles.pop_front();
+            return true;
+        }
+    }
+    for (int i = 1; i < threadCount; i++) {
+        Queue &victim = *queues[(tid + i) % threadCount];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            stolen++;
+            return true;
+        }
+    }
+    return false;
+}
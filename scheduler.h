@@ -0,0 +1,70 @@
+//
+// Tile scheduler: the image is split into tiles dealt out to per thread
+// deques, and threads that run out of tiles steal from the others.
+//
+
+#ifndef PATH_TRACER_SCHEDULER_H
+#define PATH_TRACER_SCHEDULER_H
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace rt {
+
+// the order tiles are dealt out in
+enum class TileOrder {
+    Rows, // left to right, top to bottom
+    Morton, // Z-order curve
+    Hilbert, // neighbours on the curve are always neighbours in the image
+    Spiral // center out, dealt round robin so every thread starts in the middle
+};
+
+// rows [r0, r1) and columns [c0, c1) of the image, or of image view of a batch
+struct ImageTile {
+    int r0;
+    int c0;
+    int r1;
+    int c1;
+    int view = 0;
+};
+
+class TileScheduler {
+public:
+    // splits a width x height image into tiles of tileSize pixels square and
+    // deals contiguous runs of them in the given order to the threadCount
+    // threads. With several views, the tiles of each place in the image
+    // follow each other, one per view.
+    TileScheduler(int width, int height, int tileSize, int threadCount, TileOrder order = TileOrder::Rows,
+                  int viewCount = 1);
+    // the same over the pixels of area only
+    TileScheduler(const ImageTile &area, int tileSize, int threadCount, TileOrder order = TileOrder::Rows,
+                  int viewCount = 1);
+
+    // the next tile for thread tid: the front of its own deque, or else one
+    // stolen from the back of another's. Returns false once all are taken.
+    bool next(int tid, ImageTile &tile);
+
+    int tileCount() const { return count; }
+    bool empty(); // every tile has been taken
+    long long steals() const { return stolen.load(); }
+
+    // indices r * cols + c of the pixels of a rows x cols tile in Z-order
+    static std::vector<int> zOrder(int rows, int cols);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<ImageTile> tiles;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    int count = 0;
+    std::atomic<long long> stolen{0};
+};
+
+}
+
+#endif //PATH_TRACER_SCHEDULER_H
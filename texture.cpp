@@ -0,0 +1,241 @@
+//
+// Texture cache.
+//
+
+#include "texture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <unistd.h>
+
+#include "tinygltf/stb_image.h"
+
+using namespace rt;
+using lin::Vector3d;
+
+namespace {
+
+struct SrgbTable {
+    float toLinear[256];
+
+    SrgbTable() {
+        for (int i = 0; i < 256; i++) {
+            double c = i / 255.0;
+            toLinear[i] = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+        }
+    }
+};
+const SrgbTable srgbTable;
+
+uint8_t toSrgb(double c) {
+    c = c <= 0.0031308 ? c * 12.92 : 1.055 * std::pow(c, 1 / 2.4) - 0.055;
+    return (uint8_t)std::min(255.0, std::max(0.0, std::round(c * 255)));
+}
+
+// half resolution of an rgba8 image, averaging in linear space when srgb
+std::vector<uint8_t> downsample(const std::vector<uint8_t> &src, int w, int h, bool srgb, int &outW, int &outH) {
+    outW = std::max(1, w / 2);
+    outH = std::max(1, h / 2);
+    std::vector<uint8_t> out(outW * outH * 4);
+    for (int y = 0; y < outH; y++) {
+        for (int x = 0; x < outW; x++) {
+            for (int ch = 0; ch < 4; ch++) {
+                double sum = 0;
+                for (int dy = 0; dy < 2; dy++) {
+                    for (int dx = 0; dx < 2; dx++) {
+                        int sx = std::min(w - 1, x * 2 + dx);
+                        int sy = std::min(h - 1, y * 2 + dy);
+                        uint8_t v = src[(sy * w + sx) * 4 + ch];
+                        sum += srgb && ch < 3 ? srgbTable.toLinear[v] : v / 255.0;
+                    }
+                }
+                sum /= 4;
+                out[(y * outW + x) * 4 + ch] = srgb && ch < 3 ? toSrgb(sum)
+                        : (uint8_t)std::round(std::min(1.0, sum) * 255);
+            }
+        }
+    }
+    return out;
+}
+
+}
+
+TextureCache::TextureCache(size_t budget) : budgetBytes(budget) {
+    file = std::tmpfile();
+}
+
+TextureCache::~TextureCache() {
+    if (file) {
+        std::fclose(file);
+    }
+}
+
+int TextureCache::addTexture(std::vector<unsigned char> encoded, bool srgb) {
+    textures.emplace_back(new Texture);
+    textures.back()->encoded = std::move(encoded);
+    textures.back()->srgb = srgb;
+    return textures.size() - 1;
+}
+
+void TextureCache::setBudget(size_t bytes) {
+    budgetBytes = bytes;
+}
+
+void TextureCache::resetCounters() {
+    tileLookups = 0;
+    tileHits = 0;
+    peakResident = resident.load();
+}
+
+const TextureCache::Texture &TextureCache::prepare(int texture) const {
+    Texture &t = *textures[texture];
+    std::call_once(t.prepared, [this, &t]() {
+        writeLevels(t);
+        std::vector<unsigned char>().swap(t.encoded);
+    });
+    return t;
+}
+
+// decodes the image and appends every level of its mip pyramid to the backing
+// file, tile by tile
+void TextureCache::writeLevels(Texture &t) const {
+    int w, h, channels;
+    unsigned char *pixels = stbi_load_from_memory(t.encoded.data(), (int)t.encoded.size(), &w, &h, &channels, 4);
+    if (!pixels || !file) {
+        if (pixels) {
+            stbi_image_free(pixels);
+        }
+        return;
+    }
+    std::vector<uint8_t> level(pixels, pixels + w * h * 4);
+    stbi_image_free(pixels);
+
+    int fd = fileno(file);
+    Tile buffer(TILE_SIZE * TILE_SIZE * 4);
+    while (true) {
+        Level info;
+        info.width = w;
+        info.height = h;
+        info.tilesX = (w + TILE_SIZE - 1) / TILE_SIZE;
+        info.tilesY = (h + TILE_SIZE - 1) / TILE_SIZE;
+        long long bytes = (long long)info.tilesX * info.tilesY * buffer.size();
+        {
+            std::lock_guard<std::mutex> lock(fileMutex);
+            info.offset = fileEnd;
+            fileEnd += bytes;
+        }
+
+        for (int ty = 0; ty < info.tilesY; ty++) {
+            for (int tx = 0; tx < info.tilesX; tx++) {
+                std::fill(buffer.begin(), buffer.end(), 0);
+                for (int y = 0; y < TILE_SIZE && ty * TILE_SIZE + y < h; y++) {
+                    int x0 = tx * TILE_SIZE;
+                    int count = std::min(TILE_SIZE, w - x0);
+                    std::copy_n(&level[((ty * TILE_SIZE + y) * w + x0) * 4], count * 4, &buffer[y * TILE_SIZE * 4]);
+                }
+                long long offset = info.offset + (long long)(ty * info.tilesX + tx) * buffer.size();
+                if (pwrite(fd, buffer.data(), buffer.size(), offset) != (ssize_t)buffer.size()) {
+                    return;
+                }
+            }
+        }
+        t.levels.push_back(info);
+
+        if (w == 1 && h == 1) {
+            break;
+        }
+        level = downsample(level, w, h, t.srgb, w, h);
+    }
+    t.valid = true;
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::tile(int texture, int level, int tx, int ty) const {
+    uint64_t key = (uint64_t)texture << 40 | (uint64_t)level << 32 | (uint64_t)ty << 16 | (uint64_t)tx;
+    Shard &shard = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+    tileLookups++;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.tiles.find(key);
+        if (it != shard.tiles.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            tileHits++;
+            return it->second->second;
+        }
+    }
+
+    // read outside the lock, another thread may load the same tile meanwhile
+    const Level &info = textures[texture]->levels[level];
+    auto data = std::make_shared<Tile>(TILE_SIZE * TILE_SIZE * 4);
+    long long offset = info.offset + (long long)(ty * info.tilesX + tx) * data->size();
+    if (pread(fileno(file), data->data(), data->size(), offset) != (ssize_t)data->size()) {
+        std::fill(data->begin(), data->end(), 0);
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.tiles.find(key);
+    if (it != shard.tiles.end()) {
+        return it->second->second;
+    }
+    shard.lru.emplace_front(key, data);
+    shard.tiles[key] = shard.lru.begin();
+    shard.bytes += data->size();
+    size_t now = resident += data->size();
+    size_t shardBudget = budgetBytes / SHARD_COUNT;
+    while (shard.bytes > shardBudget && shard.lru.size() > 1) {
+        shard.bytes -= shard.lru.back().second->size();
+        now = resident -= shard.lru.back().second->size();
+        shard.tiles.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+    size_t peak = peakResident.load();
+    while (now > peak && !peakResident.compare_exchange_weak(peak, now)) {}
+    return data;
+}
+
+Vector3d TextureCache::bilinear(int texture, int level, double u, double v) const {
+    const Texture &t = *textures[texture];
+    const Level &info = t.levels[level];
+    double x = (u - std::floor(u)) * info.width - 0.5;
+    double y = (v - std::floor(v)) * info.height - 0.5;
+    int x0 = (int)std::floor(x);
+    int y0 = (int)std::floor(y);
+    double fx = x - x0;
+    double fy = y - y0;
+
+    Vector3d sum;
+    int lastTile = -1;
+    std::shared_ptr<const Tile> current;
+    for (int i = 0; i < 4; i++) {
+        int px = ((x0 + (i & 1)) % info.width + info.width) % info.width;
+        int py = ((y0 + (i >> 1)) % info.height + info.height) % info.height;
+        int tx = px / TILE_SIZE;
+        int ty = py / TILE_SIZE;
+        if (ty * info.tilesX + tx != lastTile) {
+            lastTile = ty * info.tilesX + tx;
+            current = tile(texture, level, tx, ty);
+        }
+        const uint8_t *texel = &(*current)[((py % TILE_SIZE) * TILE_SIZE + px % TILE_SIZE) * 4];
+        double w = ((i & 1) ? fx : 1 - fx) * ((i >> 1) ? fy : 1 - fy);
+        for (int ch = 0; ch < 3; ch++) {
+            sum[ch] += w * (t.srgb ? srgbTable.toLinear[texel[ch]] : texel[ch] / 255.0);
+        }
+    }
+    return sum;
+}
+
+Vector3d TextureCache::sample(int texture, double u, double v, double footprint) const {
+    const Texture &t = prepare(texture);
+    if (!t.valid) {
+        return Vector3d(1, 1, 1);
+    }
+    const Level &finest = t.levels[0];
+    double level = std::log2(std::max(1e-12, footprint * std::max(finest.width, finest.height)));
+    level = std::min((double)t.levels.size() - 1, std::max(0.0, level));
+    int l0 = (int)level;
+    double f = level - l0;
+    Vector3d c = bilinear(texture, l0, u, v);
+    if (f > 0 && l0 + 1 < (int)t.levels.size()) {
+        c = c * (1 - f) + bilinear(texture, l0 + 1, u, v) * f;
+    }
+    return c;
+}
@@ -0,0 +1,96 @@
+//
+// Tiled, mip-mapped texture cache with a fixed memory budget.
+//
+
+#ifndef PATH_TRACER_TEXTURE_H
+#define PATH_TRACER_TEXTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "linalg.h"
+
+namespace rt {
+
+// Textures are registered as encoded image files (png, jpeg, ...). The first
+// lookup of a texture decodes it once, builds its mip pyramid and writes the
+// levels as 64x64 tiles to a backing file. Tiles are then read back on demand
+// into a cache of at most the budget, evicting the least recently used.
+class TextureCache {
+public:
+    static const int TILE_SIZE = 64;
+
+    explicit TextureCache(size_t budget = 256 << 20);
+    ~TextureCache();
+
+    // returns the texture's index, sRGB images are linearized on lookup
+    int addTexture(std::vector<unsigned char> encoded, bool srgb);
+
+    // trilinear lookup at (u, v), wrapping, from the mip level whose texels
+    // are footprint wide in texture space
+    lin::Vector3d sample(int texture, double u, double v, double footprint) const;
+
+    size_t textureCount() const { return textures.size(); }
+
+    void setBudget(size_t bytes);
+    size_t budget() const { return budgetBytes; }
+    size_t residentBytes() const { return resident.load(); }
+    size_t peakResidentBytes() const { return peakResident.load(); }
+    long long lookups() const { return tileLookups.load(); }
+    long long hits() const { return tileHits.load(); }
+    void resetCounters();
+
+private:
+    struct Level {
+        int width;
+        int height;
+        int tilesX;
+        int tilesY;
+        long long offset; // of the first tile in the backing file
+    };
+
+    struct Texture {
+        std::vector<unsigned char> encoded; // freed once the tiles are written
+        bool srgb = false;
+        std::vector<Level> levels;
+        std::once_flag prepared;
+        bool valid = false;
+    };
+
+    typedef std::vector<uint8_t> Tile; // rgba8, TILE_SIZE^2 texels
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<std::pair<uint64_t, std::shared_ptr<const Tile>>> lru; // most recent first
+        std::unordered_map<uint64_t, decltype(lru)::iterator> tiles;
+        size_t bytes = 0;
+    };
+    static const int SHARD_COUNT = 16;
+
+    std::vector<std::unique_ptr<Texture>> textures;
+    mutable Shard shards[SHARD_COUNT];
+    size_t budgetBytes;
+    mutable std::mutex fileMutex; // guards the end of the backing file
+    std::FILE *file = nullptr;
+    mutable long long fileEnd = 0;
+
+    mutable std::atomic<size_t> resident{0};
+    mutable std::atomic<size_t> peakResident{0};
+    mutable std::atomic<long long> tileLookups{0};
+    mutable std::atomic<long long> tileHits{0};
+
+    const Texture &prepare(int texture) const;
+    void writeLevels(Texture &t) const;
+    std::shared_ptr<const Tile> tile(int texture, int level, int tx, int ty) const;
+    lin::Vector3d bilinear(int texture, int level, double u, double v) const;
+};
+
+}
+
+#endif //PATH_TRACER_TEXTURE_H
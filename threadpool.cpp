@@ -0,0 +1,104 @@
+//
+// Thread pool.
+//
+
+#include "threadpool.h"
+
+#include <algorithm>
+
+using namespace rt;
+
+namespace {
+
+thread_local const ThreadPool *currentPool = nullptr; // the pool running this thread's task
+
+}
+
+ThreadPool::ThreadPool(int threadCount) {
+    resize(threadCount);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+        worker.thread.join();
+    }
+}
+
+void ThreadPool::resize(int threadCount) {
+    threadCount = std::max(1, threadCount);
+    std::vector<Worker> retired;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while ((int)workers.size() < threadCount) {
+            auto retire = std::make_shared<std::atomic<bool>>(false);
+            workers.push_back({std::thread(&ThreadPool::work, this, retire), retire});
+        }
+        while ((int)workers.size() > threadCount) {
+            *workers.back().retire = true;
+            retired.push_back(std::move(workers.back()));
+            workers.pop_back();
+        }
+    }
+    wake.notify_all();
+    for (auto &worker : retired) {
+        worker.thread.join();
+    }
+}
+
+int ThreadPool::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return workers.size();
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> fn) {
+    std::packaged_task<void()> task(std::move(fn));
+    std::future<void> done = task.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+    return done;
+}
+
+void ThreadPool::run(int count, const std::function<void(int)> &fn) {
+    if (currentPool == this) {
+        for (int i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+    std::vector<std::future<void>> done;
+    for (int i = 0; i < count; i++) {
+        done.push_back(submit([&fn, i]() { fn(i); }));
+    }
+    // the tasks refer to fn, so all must finish before one's exception is rethrown
+    for (auto &f : done) {
+        f.wait();
+    }
+    for (auto &f : done) {
+        f.get();
+    }
+}
+
+void ThreadPool::work(std::shared_ptr<std::atomic<bool>> retire) {
+    currentPool = this;
+    while (true) {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return *retire || stopping || !tasks.empty(); });
+            if (*retire || tasks.empty()) {
+                return; // retired, or stopping with nothing left to run
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
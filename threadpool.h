@@ -0,0 +1,60 @@
+//
+// Long-lived pool of worker threads shared by rendering, bvh building,
+// denoising and image output.
+//
+
+#ifndef PATH_TRACER_THREADPOOL_H
+#define PATH_TRACER_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rt {
+
+class ThreadPool {
+public:
+    explicit ThreadPool(int threadCount);
+    // runs the tasks still queued, then joins the workers
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // grows or shrinks the pool; a worker being retired finishes its task
+    // first. Must not be called from a task.
+    void resize(int threadCount);
+    int size() const;
+
+    // queues fn, the future is ready once it has run
+    std::future<void> submit(std::function<void()> fn);
+
+    // runs fn(0) .. fn(count - 1) on the workers and waits for all of them.
+    // Called from a task of this pool it runs them in order on the caller
+    // instead, since the workers may all be waiting.
+    void run(int count, const std::function<void(int)> &fn);
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> retire;
+    };
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::packaged_task<void()>> tasks;
+    std::vector<Worker> workers;
+    bool stopping = false;
+
+    void work(std::shared_ptr<std::atomic<bool>> retire);
+};
+
+}
+
+#endif //PATH_TRACER_THREADPOOL_H